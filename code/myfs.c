@@ -5,10 +5,15 @@
 */
 
 #define FUSE_USE_VERSION 26
+#define _GNU_SOURCE                 /* SEEK_DATA and SEEK_HOLE */
 
 #include <fuse.h>
+#include <fuse_opt.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
+#include <limits.h>
+#include <stddef.h>
 
 #include "myfs.h"
 
@@ -22,821 +27,5569 @@ unqlite_int64 root_object_size_value = sizeof(myfcb);
 unqlite *pDb;
 uuid_t zero_uuid;
 
+// Filesystem wide parameters, read from the store by init_fs
+mysuper the_super;
 
-//functions on save and read
-int fetch_ent(uuid_t *key, myent *ent) {
-	int rc;
-	unqlite_int64 nBytes = sizeof(myent);
+// Multithreading. An operation holds fs_lock shared and a group commit holds it exclusive, so
+// commits still only happen between operations. Each fcb is guarded by the reader/writer lock of
+// its stripe of inode_locks, held exclusive by whoever changes the fcb or the data under it. Reads
+// of file data hold it exclusive too, as they fill the inode's block map cache. The caches and the
+// root fcb have mutexes of their own, held only while they are looked at or changed.
+pthread_rwlock_t fs_lock;
+pthread_rwlock_t inode_locks[MY_INODE_LOCKS];
+pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t root_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	rc = unqlite_kv_fetch(pDb, key, KEY_SIZE, NULL, &nBytes);
-	if (nBytes != sizeof(myent)) {
-		write_log("fetch_ent failed: invalid fetch size - %i, want: %i\n", nBytes, sizeof(myent));
-		return rc;
+struct myfs_options myfs_options = { MY_DEFAULT_BLOCK_SIZE, 0, MY_COMMIT_OPS, MY_COMMIT_MS, 0, 0,
+	MY_ATTR_TIMEOUT, MY_ENTRY_TIMEOUT, MY_NEGATIVE_TIMEOUT, MY_LOG_ERROR };
+
+static struct fuse_opt myfs_opts[] = {
+	{ "blocksize=%u", offsetof(struct myfs_options, block_size), 0 },
+	{ "extents", offsetof(struct myfs_options, extents), 1 },
+	{ "commit_ops=%u", offsetof(struct myfs_options, commit_ops), 0 },
+	{ "commit_ms=%u", offsetof(struct myfs_options, commit_ms), 0 },
+	{ "lowlevel", offsetof(struct myfs_options, lowlevel), 1 },
+	{ "seqids", offsetof(struct myfs_options, seq_ids), 1 },
+	{ "attr_timeout=%lf", offsetof(struct myfs_options, attr_timeout), 0 },
+	{ "entry_timeout=%lf", offsetof(struct myfs_options, entry_timeout), 0 },
+	{ "negative_timeout=%lf", offsetof(struct myfs_options, negative_timeout), 0 },
+	{ "loglevel=%i", offsetof(struct myfs_options, log_level), 0 },
+	FUSE_OPT_END
+};
+
+//Sequential ids, see myfs.h. A key is made of and taken apart into its two numbers here.
+void seq_key(uint64_t hi, uint64_t lo, uuid_t out) {
+	for (int i = 0; i < 8; i++) {
+		out[i] = hi >> (56 - 8 * i);
+		out[8 + i] = lo >> (56 - 8 * i);
 	}
-	rc = unqlite_kv_fetch(pDb, key, KEY_SIZE, ent, &nBytes);
-	if (rc != UNQLITE_OK) {
-		write_log("fetch_ent failed: error code - %i\n", rc);
-		return rc;
+}
+
+uint64_t key_hi(const unsigned char *key) {
+	uint64_t v = 0;
+	for (int i = 0; i < 8; i++) {
+		v = (v << 8) | key[i];
 	}
-	return 0;
+	return v;
 }
 
-int fetch_fcb(uuid_t *key, myfcb *fcb) {
-	int rc;
-	unqlite_int64 nBytes = sizeof(myfcb);
-	
-	rc = unqlite_kv_fetch(pDb, key, KEY_SIZE, NULL, &nBytes);
-	if (nBytes != sizeof(myfcb)) {
-		write_log("fetch_ent failed: invalid fetch size - %i, want: %i\n", nBytes, sizeof(myfcb));
-		return rc;
+uint64_t key_lo(const unsigned char *key) {
+	return key_hi(key + 8);
+}
+
+//Length of a key in the store
+int key_size(const unsigned char *key) {
+	return (the_super.flags & MY_SUPER_SEQIDS) && key_lo(key) == 0 ? 8 : KEY_SIZE;
+}
+
+//Latency statistics. Each thread times the operation it runs and the phases of it, and adds the
+//times to the shared histograms when the operation ends. Nothing here touches the store.
+myhist op_hist[MY_OP_COUNT][MY_PHASE_COUNT];
+
+const char *op_names[MY_OP_COUNT] = { "getattr", "fgetattr", "lookup", "forget", "setattr",
+	"opendir", "readdir", "releasedir", "open", "read", "write", "create", "mkdir", "unlink",
+	"rmdir", "rename", "link", "utime", "chmod", "chown", "truncate", "fallocate", "ioctl",
+	"flush", "release", "fsync", "reclaim", "commit" };
+const char *phase_names[MY_PHASE_COUNT] = { "total", "lookup", "fetch", "store" };
+
+static __thread int op_current = -1;                     //operation being timed, -1 for none
+static __thread uint64_t op_start_ns;
+static __thread uint64_t op_phase_ns[MY_PHASE_COUNT];
+
+uint64_t now_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+unsigned int hist_index(uint64_t v) {
+	if (v < (1u << MY_HIST_SUB_BITS)) {
+		return v;
 	}
-	rc = unqlite_kv_fetch(pDb, key, KEY_SIZE, fcb, &nBytes);
-	if (rc != UNQLITE_OK) {
-		write_log("fetch_ent failed: error code - %i\n", rc);
-		return rc;
+	int e = 63 - __builtin_clzll(v);
+	return ((e - MY_HIST_SUB_BITS + 1) << MY_HIST_SUB_BITS) + ((v >> (e - MY_HIST_SUB_BITS)) & ((1u << MY_HIST_SUB_BITS) - 1));
+}
+
+//Largest value which falls in a bucket
+uint64_t hist_value(unsigned int i) {
+	if (i < (1u << MY_HIST_SUB_BITS)) {
+		return i;
 	}
-	return 0;
+	int shift = (i >> MY_HIST_SUB_BITS) - 1;
+	uint64_t sub = (i & ((1u << MY_HIST_SUB_BITS) - 1)) + (1u << MY_HIST_SUB_BITS);
+	return ((sub + 1) << shift) - 1;
 }
 
-int fetch_file(uuid_t *key, myfile *file) {
-	int rc; 
-	unqlite_int64 nBytes = sizeof(myfile);
+void hist_add(myhist *h, uint64_t v) {
+	atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->sum_ns, v, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->bucket[hist_index(v)], 1, memory_order_relaxed);
+	uint_fast64_t max = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+	while (v > max && !atomic_compare_exchange_weak_explicit(&h->max_ns, &max, v, memory_order_relaxed, memory_order_relaxed));
+}
 
-	rc = unqlite_kv_fetch(pDb, key, KEY_SIZE, NULL, &nBytes);
-	if (nBytes != sizeof(myfile)) {
-		write_log("fetch_file failed: invalid fetch size - %i, want: %i\n", nBytes, sizeof(myfile));
-		return rc;
+//Start timing an operation of this thread
+void op_timer_start(int op) {
+	op_current = op;
+	memset(op_phase_ns, 0, sizeof(op_phase_ns));
+	op_start_ns = now_ns();
+}
+
+//Stop timing it and add its times to the histograms. A phase it never entered is left out of
+//that phase's histogram, so the phase counts say how many operations went to the store at all.
+void op_timer_stop() {
+	if (op_current < 0) {
+		return;
 	}
-	rc = unqlite_kv_fetch(pDb, key, KEY_SIZE, file, &nBytes);
-	if (rc != UNQLITE_OK) {
-		write_log("fetch_file failed: error code - %i\n", rc);
-		return rc;
+	hist_add(&op_hist[op_current][MY_PHASE_TOTAL], now_ns() - op_start_ns);
+	for (int p = MY_PHASE_TOTAL + 1; p < MY_PHASE_COUNT; p++) {
+		if (op_phase_ns[p] > 0) {
+			hist_add(&op_hist[op_current][p], op_phase_ns[p]);
+		}
 	}
-	return 0;
+	op_current = -1;
 }
 
-int store_file(uuid_t *key, myfile *file) {
-	int rc;
-	rc = unqlite_kv_store(pDb, key, KEY_SIZE, file, sizeof(myfile));
-	if (rc != UNQLITE_OK) {
-		write_log("store_file: Store file failed with %i\n", rc);
-		return rc;
+void op_phase_add(int phase, uint64_t since) {
+	op_phase_ns[phase] += now_ns() - since;
+}
+
+//The store calls of the file system, timed into the phases of the running operation
+int kv_fetch(const void *key, int len, void *buf, unqlite_int64 *nbytes) {
+	uint64_t start = now_ns();
+	int rc = unqlite_kv_fetch(pDb, key, len, buf, nbytes);
+	op_phase_add(MY_PHASE_FETCH, start);
+	return rc;
+}
+
+int kv_store(const void *key, int len, const void *buf, unqlite_int64 nbytes) {
+	uint64_t start = now_ns();
+	int rc = unqlite_kv_store(pDb, key, len, buf, nbytes);
+	op_phase_add(MY_PHASE_STORE, start);
+	return rc;
+}
+
+int kv_delete(const void *key, int len) {
+	uint64_t start = now_ns();
+	int rc = unqlite_kv_delete(pDb, key, len);
+	op_phase_add(MY_PHASE_STORE, start);
+	return rc;
+}
+
+//Smallest value at least fraction q of a histogram's values are no larger than
+uint64_t hist_quantile(uint64_t *bucket, uint64_t count, double q) {
+	uint64_t want = (uint64_t) (q * count + 0.5), seen = 0;
+	if (want < 1) {
+		want = 1;
 	}
-	return 0;
+	for (unsigned int i = 0; i < MY_HIST_BUCKETS; i++) {
+		if ((seen += bucket[i]) >= want) {
+			return hist_value(i);
+		}
+	}
+	return hist_value(MY_HIST_BUCKETS - 1);
 }
 
-int store_ent(uuid_t *key, myent *ent) {
-	int rc;
-	rc = unqlite_kv_store(pDb, key, KEY_SIZE, ent, sizeof(myent));
-	if (rc != UNQLITE_OK) {
-		write_log("store_ent: store entrance failed\n");
-		return rc;
+//Render the histograms as a table, one line for each operation and phase seen so far, times in
+//microseconds, followed by the spread of the inode cache and the number of orphans the reclaimer
+//has still to free. The counters move on while they are read, so a line is only roughly consistent.
+int stats_render(mystats *st) {
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	uint64_t bucket[MY_HIST_BUCKETS];
+	FILE *f;
+	if ((f = open_memstream(&st->text, &st->len)) == NULL) {
+		return -errno;
+	}
+	fprintf(f, "%-10s %-6s %10s %10s %10s %10s %10s %10s %10s\n", "op", "phase", "count", "mean_us",
+		"p50_us", "p90_us", "p99_us", "p99.9_us", "max_us");
+	for (int op = 0; op < MY_OP_COUNT; op++) {
+		for (int p = 0; p < MY_PHASE_COUNT; p++) {
+			myhist *h = &op_hist[op][p];
+			uint64_t count = 0;
+			for (unsigned int i = 0; i < MY_HIST_BUCKETS; i++) {
+				count += bucket[i] = atomic_load_explicit(&h->bucket[i], memory_order_relaxed);
+			}
+			if (count == 0) {
+				continue;
+			}
+			uint64_t max = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+			fprintf(f, "%-10s %-6s %10llu %10.1f", op_names[op], phase_names[p], (unsigned long long) count,
+				atomic_load_explicit(&h->sum_ns, memory_order_relaxed) / 1000.0 / count);
+			for (int q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+				uint64_t v = hist_quantile(bucket, count, quantiles[q]);
+				fprintf(f, " %10.1f", (v < max ? v : max) / 1000.0);	//a bucket's top may be above any value in it
+			}
+			fprintf(f, " %10.1f\n", max / 1000.0);
+		}
+	}
+	icache_spread(f);
+	fprintf(f, "orphans %u\n", orphan_pending());
+	if (fclose(f) != 0) {
+		free(st->text);
+		return -ENOMEM;
 	}
 	return 0;
 }
 
-int store_fcb(uuid_t *key, myfcb *fcb) {
+//Open the stats file: take a snapshot of the histograms for the reads to come
+int stats_open(struct fuse_file_info *fi) {
 	int rc;
-	rc = unqlite_kv_store(pDb, key, KEY_SIZE, fcb, sizeof(myfcb));
-	if (rc != UNQLITE_OK) {
-		write_log("store_fcb: store fcb failed\n");
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		return -EACCES;
+	}
+	mystats *st = malloc(sizeof(mystats));
+	if (st == NULL) {
+		return -ENOMEM;
+	}
+	if ((rc = stats_render(st)) != 0) {
+		free(st);
 		return rc;
 	}
+	fi->fh = (uintptr_t) st;
+	fi->direct_io = 1;	//the file claims no size, the kernel must not cut reads short by it
 	return 0;
 }
 
+int stats_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset) {
+	mystats *st = (mystats *) (uintptr_t) fi->fh;
+	if (offset >= st->len) {
+		return 0;
+	}
+	if (size > st->len - offset) {
+		size = st->len - offset;
+	}
+	memcpy(buf, st->text + offset, size);
+	return size;
+}
 
-//functions on delete. Key is the key of the entrance
-int deletion(uuid_t *key) {
-	int rc;
-	myent ent;
-	myfcb fcb;
+void stats_release(struct fuse_file_info *fi) {
+	mystats *st = (mystats *) (uintptr_t) fi->fh;
+	if (st != NULL) {
+		free(st->text);
+		free(st);
+		fi->fh = 0;
+	}
+}
 
-	//fetch fcb and entrance node
-	if ((rc = fetch_ent(key, &ent)) != 0) {
-		write_log("deletion: fetch entrance failed with %i\n", rc);
-		return rc;
+//Attributes of the stats directory or file, by inode number
+void stats_stat(fuse_ino_t ino, struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = ino;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+	if (ino == MY_STATS_DIR_INO) {
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+	}
+	else {
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
 	}
+}
 
-	if ((rc = fetch_fcb(&(ent.fcb_id), &fcb)) != 0) {
-		write_log("deletion: fetch fcb failed with %i\n", rc);
-		return rc;
+//What name in the directory parent is in the stats tree: MY_STATS_DIR_INO or MY_STATS_INO, 1 for
+//a name under the stats directory which is not there, 0 for a name outside the tree. The stats
+//directory shadows whatever is stored under its name and is not listed in the root, it is only
+//reached by name.
+fuse_ino_t stats_lookup(fuse_ino_t parent, const char *name) {
+	if (parent == FUSE_ROOT_ID) {
+		return strcmp(name, MY_STATS_DIR) == 0 ? MY_STATS_DIR_INO : 0;
 	}
+	if (parent == MY_STATS_DIR_INO) {
+		return strcmp(name, MY_STATS_FILE) == 0 ? MY_STATS_INO : 1;
+	}
+	return parent == MY_STATS_INO;
+}
 
-	//delete all files
-	for (int i = 0; i < MY_MAX_DIRECT; i++) {
-		if (uuid_compare(fcb.direct[i], zero_uuid) != 0) {
-			if ((rc = unqlite_kv_delete(pDb, &(fcb.direct[i]), KEY_SIZE)) != 0) {
-				write_log("deletion: delete file failed.");
-				return rc;
-			}
-		}
+//stats_lookup for a whole path
+fuse_ino_t stats_path(const char *path) {
+	size_t len = strlen("/" MY_STATS_DIR);
+	if (strncmp(path, "/" MY_STATS_DIR, len) != 0) {
+		return 0;
+	}
+	if (path[len] == '\0') {
+		return MY_STATS_DIR_INO;
+	}
+	if (path[len] != '/') {
+		return 0;
 	}
+	return stats_lookup(MY_STATS_DIR_INO, path + len + 1);
+}
 
-	//delete fcb
-	if ((rc = unqlite_kv_delete(pDb, &(ent.fcb_id), KEY_SIZE)) != 0) {
-		write_log("deletion: delete entrance failed.");
-		return rc;
+//List the stats directory from offset on, each entry giving the offset of the next
+int stats_readdir(void *buf, fuse_fill_dir_t filler, off_t offset) {
+	static const char *names[] = { ".", "..", MY_STATS_FILE };
+	struct stat st;
+	for (off_t i = offset; i < sizeof(names) / sizeof(names[0]); i++) {
+		stats_stat(i == 2 ? MY_STATS_INO : MY_STATS_DIR_INO, &st);
+		if (i == 1) {
+			st.st_ino = FUSE_ROOT_ID;
+		}
+		if (filler(buf, names[i], &st, i + 1)) {
+			break;
+		}
 	}
+	return 0;
+}
 
-	//delete entry
-	if ((rc = unqlite_kv_delete(pDb, key, KEY_SIZE)) != 0) {
-		write_log("deletion: delete entrance failed.\n");
-		return rc;
+//Dentry cache. find_entrance resolves every component of a path through here first, so a warm
+//path costs no entrance fetches at all. Entries are hashed on (parent fcb id, name).
+mydentry *dcache_table[MY_DCACHE_BUCKETS];
+mydentry *dcache_lru_head;
+mydentry *dcache_lru_tail;
+int dcache_count;
+
+unsigned int dcache_hash(uuid_t parent, const char *name) {
+	unsigned int h = 2166136261u;	//FNV-1a
+	for (int i = 0; i < sizeof(uuid_t); i++) {
+		h = (h ^ parent[i]) * 16777619u;
 	}
+	for (; *name != '\0'; name++) {
+		h = (h ^ (unsigned char) *name) * 16777619u;
+	}
+	return h;
+}
 
-	return 0;
+void dcache_lru_unlink(mydentry *d) {
+	if (d->prev) d->prev->next = d->next; else dcache_lru_head = d->next;
+	if (d->next) d->next->prev = d->prev; else dcache_lru_tail = d->prev;
+	d->prev = d->next = NULL;
 }
 
-//Functions on entrance finding
-int find_entrance_with_name(char* path, myfcb *fcb, myent *ent) {
-	int rc;
-	for (int i = 0;i < MY_MAX_DIRECT; i++) {
-		if (uuid_compare(zero_uuid,fcb -> direct[i]) != 0) {
-			if((rc = fetch_ent(&(fcb->direct[i]), ent)) != 0) {
-				write_log("find_path_with_name: entrance fetch failed with %i\n", rc);
-				return rc;
-			}
-			if (strcmp(path, ent->name) == 0) {
-				if((rc = fetch_fcb(&(ent->fcb_id), fcb)) != 0) {
-					write_log("find_entrance_with_name: file control block fetch failed with %i\n", rc);
-					return rc;
-				}
-				return 0;
-			}
+void dcache_lru_push(mydentry *d) {
+	d->next = dcache_lru_head;
+	if (dcache_lru_head) dcache_lru_head->prev = d; else dcache_lru_tail = d;
+	dcache_lru_head = d;
+}
+
+//Unlink an entry from every list and free it
+void dcache_drop(mydentry *d) {
+	mydentry **pp;
+	for (pp = &dcache_table[d->hash % MY_DCACHE_BUCKETS]; *pp != d; pp = &(*pp)->hnext);
+	*pp = d->hnext;
+	dcache_lru_unlink(d);
+	free(d);
+	dcache_count--;
+}
+
+mydentry *dcache_lookup(uuid_t parent, const char *name) {
+	unsigned int h = dcache_hash(parent, name);
+	for (mydentry *d = dcache_table[h % MY_DCACHE_BUCKETS]; d != NULL; d = d->hnext) {
+		if (d->hash == h && uuid_compare(d->parent, parent) == 0 && strcmp(d->ent.name, name) == 0) {
+			dcache_lru_unlink(d);
+			dcache_lru_push(d);
+			return d;
 		}
 	}
-	return -ENOENT;
+	return NULL;
 }
 
-//Find entrance does works for find the entrance of fcb required and return the fcb and the entrance node
-int find_entrance(const char *path, myfcb* fcb, myent *ent) {
-	char* s_path = strdup(path); 		//Copy path itself to prevent interrupt const value
-	char* token = strtok(s_path, "/");  //Divide the path into tokens
-	*fcb = the_root_fcb;
-	int rc;
+//Copy out the entry for (parent, name): 1 if it is cached, with *negative set for a name known
+//not to exist; 0 if nothing is cached
+int dcache_get(uuid_t parent, const char *name, myent *ent, int *negative) {
+	pthread_mutex_lock(&dcache_lock);
+	mydentry *d = dcache_lookup(parent, name);
+	if (d != NULL) {
+		*ent = d->ent;
+		*negative = d->negative;
+	}
+	pthread_mutex_unlock(&dcache_lock);
+	return d != NULL;
+}
 
-	while (token != NULL) {
-		if ((rc = find_entrance_with_name(token, fcb, ent))!=0) {
-			write_log("find_entrance: find entrance with name failed with code %i\n", rc);
-			return rc;
+void dcache_remove(uuid_t parent, const char *name) {
+	mydentry *d = dcache_lookup(parent, name);
+	if (d != NULL) {
+		dcache_drop(d);
+	}
+}
+
+//Remove the entry for (parent, name), positive or negative
+void dcache_invalidate(uuid_t parent, const char *name) {
+	pthread_mutex_lock(&dcache_lock);
+	dcache_remove(parent, name);
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+//Remove every entry found under a directory which is going away
+void dcache_purge_parent(uuid_t parent) {
+	pthread_mutex_lock(&dcache_lock);
+	mydentry *d = dcache_lru_head;
+	while (d != NULL) {
+		mydentry *next = d->next;
+		if (uuid_compare(d->parent, parent) == 0) {
+			dcache_drop(d);
 		}
-		// write_log("find_ent: %s - expect %s\n", ent->name, token);
-		token = strtok(0, "/");
+		d = next;
 	}
-	return 0;
+	pthread_mutex_unlock(&dcache_lock);
 }
 
-//functions on creative
-int get_path_filename(const char *path, char ** file, char ** directory) {
-	char *pathdup = strdup(path);
-	char *last = strrchr(pathdup, '/');
-	*last = '\0';
-	*file = last + 1;
-	if (last == pathdup) {
-		*directory = "/";
+//Cache the result of a lookup. ent is NULL for a negative entry.
+void dcache_insert(uuid_t parent, const char *name, myent *ent) {
+	mydentry *d = calloc(1, sizeof(mydentry));
+	if (d == NULL) {
+		return;		//The cache is only an optimisation
+	}
+	pthread_mutex_lock(&dcache_lock);
+	dcache_remove(parent, name);
+	while (dcache_count >= MY_DCACHE_SIZE) {
+		dcache_drop(dcache_lru_tail);
+	}
+	uuid_copy(d->parent, parent);
+	if (ent != NULL) {
+		d->ent = *ent;
 	}
 	else {
-		*directory = pathdup;  //<= changed
+		strncpy(d->ent.name, name, MY_MAX_PATH - 1);
+		d->negative = 1;
 	}
-	return 0;
+	d->hash = dcache_hash(parent, d->ent.name);
+	d->hnext = dcache_table[d->hash % MY_DCACHE_BUCKETS];
+	dcache_table[d->hash % MY_DCACHE_BUCKETS] = d;
+	dcache_lru_push(d);
+	dcache_count++;
+	pthread_mutex_unlock(&dcache_lock);
 }
 
-//This will create a fcb and a ent and generate a new uuid. Write back should be done outside the function
-int create_fcb_with_ent(mode_t mode, char* name, myfcb *newFCB, myent* newENT) {
-	memset(newFCB, 0, sizeof(myfcb));			//Memory init
-	memset(newENT, 0, sizeof(myent));			//Memory init
+//Inode cache. fetch_fcb and store_fcb work on the in-memory copy; the store is only written when
+//a dirty fcb is written back, so repeated metadata updates to a file coalesce into one store.
+myinode *icache_table[MY_ICACHE_BUCKETS];
+myinode *icache_lru_head;
+myinode *icache_lru_tail;
+int icache_count;
 
-	//Set the information of new fcb
-	struct fuse_context *context = fuse_get_context();
-	newFCB->uid = context -> uid;
-	newFCB->gid = context -> gid;
-	newFCB->mode = mode; 
-	newFCB->size = sizeof(myfcb);
-	time_t now = time(NULL);
-	newFCB->mtime=now;
-	newFCB->ctime=now;
-	//setup entrance
-	strcpy(newENT->name, name);
-	uuid_generate(newENT->fcb_id);
-	return 0;
+//Hash of all 16 bytes of an id. A seqid keeps its number in bytes 0-7 and zeros in 8-15, so a
+//hash of any fixed part of the id sends every file to the same bucket. FNV only carries a change
+//up into the high bits, so they are folded back before the callers take a power-of-two modulus.
+unsigned int id_hash(uuid_t id) {
+	unsigned int h = 2166136261u;	//FNV-1a
+	for (int i = 0; i < sizeof(uuid_t); i++) {
+		h = (h ^ id[i]) * 16777619u;
+	}
+	return h ^ (h >> 16);
 }
 
-//This will generate a uuid in a free fcb access space with the entrance.
-int free_space_generator(uuid_t* uuid, myent* ent) {
-	myfcb fcb;
+unsigned int icache_hash(uuid_t id) {
+	return id_hash(id) % MY_ICACHE_BUCKETS;
+}
+
+void icache_lru_unlink(myinode *n) {
+	if (n->prev) n->prev->next = n->next; else icache_lru_head = n->next;
+	if (n->next) n->next->prev = n->prev; else icache_lru_tail = n->prev;
+	n->prev = n->next = NULL;
+}
+
+void icache_lru_push(myinode *n) {
+	n->next = icache_lru_head;
+	if (icache_lru_head) icache_lru_head->prev = n; else icache_lru_tail = n;
+	icache_lru_head = n;
+}
+
+myinode *icache_lookup(uuid_t id) {
+	for (myinode *n = icache_table[icache_hash(id)]; n != NULL; n = n->hnext) {
+		if (uuid_compare(n->id, id) == 0) {
+			icache_lru_unlink(n);
+			icache_lru_push(n);
+			return n;
+		}
+	}
+	return NULL;
+}
+
+//Write a dirty fcb back to the store
+int icache_write_back(myinode *n) {
 	int rc;
-	if ((rc = fetch_fcb(&(ent->fcb_id), &fcb)) != 0) {
-		write_log("free_space_generator: fetch failed - Failed to generate a new free space key.");
-		return rc;
+	if (n->detached) {
+		return 0;
 	}
-	for (int i = 0; i < MY_MAX_DIRECT; i++) {
-		if (uuid_compare(zero_uuid, fcb.direct[i]) == 0) {
-			uuid_generate(fcb.direct[i]);
-			uuid_copy(*uuid, fcb.direct[i]);
-			break;
+	//Storing the buffered data blocks may allocate keys in the fcb
+	if (n->map != NULL && n->map->ndirty > 0) {
+		n->dirty = 1;
+		if ((rc = flush_blocks(&(n->fcb), n->map)) != 0) {
+			return rc;
 		}
 	}
-	//write back fcb
-	if ((rc = store_fcb(&(ent->fcb_id), &fcb)) != 0) {
-		write_log("free_space_generator: store_fcb: failed with err code %i\n", rc);
-		return rc;
+	if (!n->dirty) {
+		return 0;
 	}
-	//fetch testing
-	if ((rc = fetch_fcb(&(ent->fcb_id), NULL)) != 0) {
-		write_log("free_space_generator: fetch_fcb testing: store_fcb: failed to fetch with error code %i", rc);
+	rc = kv_store(n->id, key_size(n->id), &(n->fcb), sizeof(myfcb));
+	if (rc != UNQLITE_OK) {
+		log_error("icache_write_back: store fcb failed with %i\n", rc);
 		return rc;
 	}
+	n->dirty = 0;
 	return 0;
 }
 
-//This only works on the root fcb
-int root_free_space_gen(uuid_t *uuid) {
-	for (int i = 0; i < MY_MAX_DIRECT; i++) {
-		if (uuid_compare(zero_uuid, the_root_fcb.direct[i]) == 0) {
-			uuid_generate(the_root_fcb.direct[i]);
-			uuid_copy(*uuid, the_root_fcb.direct[i]);
-			break;
-		}
+//Write back an open inode, whose fcb and map only the holder of its lock changes, without holding
+//the cache lock through the store calls. The blocks are stored against a copy of the fcb, which
+//goes back into the cache once the keys they were given are in it; fetch_fcb copies the cached fcb
+//meanwhile. A detached inode, whose fcb is deleted, is never written back. The caller holds the
+//inode lock.
+int inode_write_back(myinode *n) {
+	myfcb fcb;
+	int dirty, rc = 0;
+	pthread_mutex_lock(&icache_lock);
+	fcb = n->fcb;
+	dirty = n->dirty;
+	int detached = n->detached;
+	pthread_mutex_unlock(&icache_lock);
+	if (detached) {
+		return 0;
 	}
-	int rc;
-	//write back the root fcb
-	if((rc = unqlite_kv_store(pDb,ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE,&the_root_fcb,sizeof(myfcb))) != 0) {
-		write_log("root_free_space_gen: Root FCB write_back failed %i", rc);
-		return rc;
+	if (n->map != NULL && n->map->ndirty > 0) {
+		dirty = 1;
+		rc = flush_blocks(&fcb, n->map);
 	}
-	return 0;
+	if (rc == 0 && dirty && (rc = kv_store(n->id, key_size(n->id), &fcb, sizeof(myfcb))) != UNQLITE_OK) {
+		log_error("inode_write_back: store fcb failed with %i\n", rc);
+	}
+	pthread_mutex_lock(&icache_lock);
+	n->fcb = fcb;
+	n->dirty = dirty && rc != 0;
+	pthread_mutex_unlock(&icache_lock);
+	return rc;
 }
 
-//find the path, unlink the entrance
-//add to free list(Extension)
-int remove_node(char* filepath, char* filename) {
-	int rc;
-	//Following two will be used for storing path fcb and ent
-	myfcb fcb;
-	myent ent;
-
-	//If it is in the root dir
-	if (strcmp("/", filepath) == 0) {
-		for (int i = 0; i < MY_MAX_DIRECT; i++) {
-			if (uuid_compare(the_root_fcb.direct[i], zero_uuid) != 0) {
-				if ((rc = fetch_ent(&(the_root_fcb.direct[i]), &ent)) != 0) {
-					write_log("remove_node: fetch_ent failed with %i\n", rc);
-					return rc;
-				}
-				if (strcmp(ent.name, filename) == 0) {
-					deletion(&(the_root_fcb.direct[i]));
-					uuid_clear(the_root_fcb.direct[i]);
-					the_root_fcb.mtime = time(NULL);
-					the_root_fcb.ctime = time(NULL);
-					if((rc = unqlite_kv_store(pDb,ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE,&the_root_fcb,sizeof(myfcb))) != 0) {
-						write_log("remove_node: root_free_space_gen: Root FCB write_back failed %i", rc);
-						return rc;
-					}
-					return 0;
-				}
-			}
+void map_free(mymap *mc) {
+	if (mc != NULL) {
+		for (unsigned int i = 0; i < mc->ndirty; i++) {
+			free(mc->dirty[i].data);
 		}
-		return -ENOENT;
+		free(mc->dirty);
+		free(mc->ext);
+		free(mc->ra);
+		free(mc);
 	}
+}
 
-	fcb = the_root_fcb;
-	if ((rc = find_entrance(filepath, &fcb, &ent)) != 0) {
-		write_log("remove_node: find entrance: find_entrance failed: %i", rc);
-		return rc;
-	}
+void icache_free(myinode *n) {
+	map_free(n->map);
+	free(n);
+}
 
-	myent tmp;
-	for (int i = 0; i < MY_MAX_DIRECT; i++) {
-		if (uuid_compare(fcb.direct[i], zero_uuid) != 0) {
-			if ((rc = fetch_ent(&(fcb.direct[i]), &tmp)) != 0) {
-				write_log("remove_node: fetch_ent: failed with %i\n", rc);
-				return rc;
-			}
-			// write_log("expected - %s | get - %s\n", ent.name, filename);
-			if (strcmp(tmp.name, filename) == 0) {
-				deletion(&(fcb.direct[i]));
-				uuid_clear(fcb.direct[i]);
-				fcb.ctime = time(NULL);
-				fcb.mtime = time(NULL);
-				if ((rc = store_fcb(&(ent.fcb_id), &fcb)) != 0) {
-					write_log("remove_node: free_space: write_back failed with %i", rc);
-					return rc;
-				}
-				return 0;
-			}
-		}
-	}
-	return -ENOENT;
+//Unlink an inode from the table and the lru list
+void icache_unlink(myinode *n) {
+	myinode **pp;
+	for (pp = &icache_table[icache_hash(n->id)]; *pp != n; pp = &(*pp)->hnext);
+	*pp = n->hnext;
+	icache_lru_unlink(n);
+	icache_count--;
 }
 
-//create all path does not exist
-int create_new(char* path, char* name, mode_t mode) {
-	int rc; 
+//Unlink an inode from the cache and free it. Dirty contents are lost.
+void icache_drop(myinode *n) {
+	icache_unlink(n);
+	icache_free(n);
+}
 
-	myfcb fcb;
-	myent ent;
-	uuid_t key;
-	if (strcmp (path, "/") == 0) {
-		if ((rc = root_free_space_gen(&key)) != 0) {
-			write_log("create_dir - root_free_space_gen failed with error: %i", rc);
-			return rc;
+myinode *icache_insert(uuid_t id, myfcb *fcb) {
+	//Memory pressure: write back and evict the least recently used fcbs which are not open
+	myinode *victim = icache_lru_tail;
+	while (icache_count >= MY_ICACHE_SIZE && victim != NULL) {
+		myinode *prev = victim->prev;
+		if (victim->refs == 0 && victim->map == NULL) {
+			if (icache_write_back(victim) != 0) {
+				break;
+			}
+			icache_drop(victim);
 		}
+		victim = prev;
 	}
-	else {
-		fcb = the_root_fcb;
-		int rc;
-		if ((rc = find_entrance(path, &fcb, &ent)) != 0) {
-			write_log("create_directory - find_entrance failed with %i\n", rc);
-			return rc;
-		}
-		if ((rc = free_space_generator(&key, &ent)) != 0) {
-			write_log("create_directory - space_generator_failed with %i\n", rc);
-		}
+	myinode *n = calloc(1, sizeof(myinode));
+	if (n == NULL) {
+		return NULL;
 	}
-	if ((rc = create_fcb_with_ent(mode, name, &fcb, &ent)) != 0) {
-		write_log("create_dir - Create Directory with error: %i", rc);
-		return rc;
+	uuid_copy(n->id, id);
+	n->fcb = *fcb;
+	n->hnext = icache_table[icache_hash(id)];
+	icache_table[icache_hash(id)] = n;
+	icache_lru_push(n);
+	icache_count++;
+	return n;
+}
+
+//Write back one fcb, if it is cached and dirty. The inode is pinned so that no insert evicts it
+//while inode_write_back stores it without the cache lock. The caller holds the inode lock.
+int icache_flush(uuid_t id) {
+	pthread_mutex_lock(&icache_lock);
+	myinode *n = icache_lookup(id);
+	if (n != NULL) {
+		n->refs++;
 	}
-	if ((rc = store_fcb(&(ent.fcb_id), &fcb)) != 0) {
-		write_log("create_dir - Store fcb failed: %i\n", rc);
-		return rc;
+	pthread_mutex_unlock(&icache_lock);
+	if (n == NULL) {
+		return 0;
 	}
-	if ((rc = store_ent(&key, &ent)) != 0) {
-		write_log("create_dir - store ent failed: %i", rc);
-		return rc;
+	int rc = inode_write_back(n);
+	pthread_mutex_lock(&icache_lock);
+	n->refs--;
+	pthread_mutex_unlock(&icache_lock);
+	return rc;
+}
+
+//Write back every dirty fcb
+int icache_flush_all() {
+	int rc = 0;
+	pthread_mutex_lock(&icache_lock);
+	for (myinode *n = icache_lru_head; n != NULL; n = n->next) {
+		if ((rc = icache_write_back(n)) != 0) {
+			break;
+		}
 	}
+	pthread_mutex_unlock(&icache_lock);
+	return rc;
+}
 
-	//Test fetch
-	if ((rc = fetch_ent(&key, NULL)) != 0) {
-		write_log("create_dir - fetch ent failed: %i", rc);
-		return rc;
+//1 if the inode of id has handles open on it
+int icache_is_open(uuid_t id) {
+	pthread_mutex_lock(&icache_lock);
+	myinode *n = icache_lookup(id);
+	int open = n != NULL && n->refs > 0;
+	pthread_mutex_unlock(&icache_lock);
+	return open;
+}
+
+//The fcb is being deleted from the store; make sure it is never written back. An inode which is
+//still open stays allocated, out of the cache, until its last handle is closed. 1 if it is open.
+int icache_forget(uuid_t id) {
+	int open = 0;
+	pthread_mutex_lock(&icache_lock);
+	myinode *n = icache_lookup(id);
+	if (n != NULL && n->refs > 0) {
+		icache_unlink(n);
+		n->dirty = 0;
+		n->detached = 1;
+		open = 1;
 	}
-	if ((rc = fetch_fcb(&(ent.fcb_id), NULL)) != 0) {
-		write_log("create_dir - fetch fcb failed: %i", rc);
-		return rc;
+	else if (n != NULL) {
+		icache_drop(n);
 	}
+	pthread_mutex_unlock(&icache_lock);
+	return open;
+}
 
-	return 0;
+//Copy the fcb of an open inode out, and a changed copy back in. The caller holds the inode lock,
+//the cache lock keeps fetch_fcb from copying a half written fcb.
+void inode_get(myinode *n, myfcb *fcb) {
+	pthread_mutex_lock(&icache_lock);
+	*fcb = n->fcb;
+	pthread_mutex_unlock(&icache_lock);
 }
 
-//This will create an empty file
-int create_file(uuid_t* key, myfile* file) {
-	int rc;
-	memset(file, 0, sizeof(myfile));
+void inode_put(myinode *n, myfcb *fcb) {
+	pthread_mutex_lock(&icache_lock);
+	n->fcb = *fcb;
+	n->dirty = 1;
+	pthread_mutex_unlock(&icache_lock);
+}
 
-	//initialise
-	if ((rc = store_file(key, file)) != 0) {
-		write_log("create_file: store_file: new file create failed. error: %i\n", rc);
-		return rc;
+//Reader/writer lock of an fcb
+pthread_rwlock_t *inode_lock(uuid_t id) {
+	return &inode_locks[id_hash(id) % MY_INODE_LOCKS];
+}
+
+//Print how the cached fcbs spread over the buckets of the inode cache and the stripes of the
+//inode locks, for the stats file
+void icache_spread(FILE *f) {
+	unsigned char stripe[MY_INODE_LOCKS] = { 0 };
+	int used = 0, longest = 0, stripes = 0;
+	pthread_mutex_lock(&icache_lock);
+	for (int b = 0; b < MY_ICACHE_BUCKETS; b++) {
+		int chain = 0;
+		for (myinode *n = icache_table[b]; n != NULL; n = n->hnext, chain++) {
+			pthread_rwlock_t *l = inode_lock(n->id);
+			if (!stripe[l - inode_locks]) {
+				stripe[l - inode_locks] = 1;
+				stripes++;
+			}
+		}
+		used += chain > 0;
+		longest = chain > longest ? chain : longest;
 	}
-	return 0;
+	fprintf(f, "icache fcbs %i buckets %i/%i longest %i stripes %i/%i\n", icache_count, used,
+		MY_ICACHE_BUCKETS, longest, stripes, MY_INODE_LOCKS);
+	pthread_mutex_unlock(&icache_lock);
 }
 
-// The functions which follow are handler functions for various things a filesystem needs to do:
-// reading, getting attributes, truncating, etc. They will be called by FUSE whenever it needs
-// your filesystem to do something, so this is where functionality goes.
+void lock_inode(uuid_t id, int write) {
+	if (write) {
+		pthread_rwlock_wrlock(inode_lock(id));
+	}
+	else {
+		pthread_rwlock_rdlock(inode_lock(id));
+	}
+}
 
-// Get file and directory attributes (meta-data).
-// Read 'man 2 stat' and 'man 2 chmod'.
+void unlock_inode(uuid_t id) {
+	pthread_rwlock_unlock(inode_lock(id));
+}
+
+//Lock two fcbs for writing. The locks are taken in address order, and only once when both fcbs
+//fall on the same one, so two threads locking pairs never wait on each other.
+void lock_inode_pair(uuid_t a, uuid_t b) {
+	pthread_rwlock_t *la = inode_lock(a);
+	pthread_rwlock_t *lb = inode_lock(b);
+	if (la > lb) {
+		pthread_rwlock_t *t = la;
+		la = lb;
+		lb = t;
+	}
+	pthread_rwlock_wrlock(la);
+	if (lb != la) {
+		pthread_rwlock_wrlock(lb);
+	}
+}
+
+void unlock_inode_pair(uuid_t a, uuid_t b) {
+	pthread_rwlock_unlock(inode_lock(a));
+	if (inode_lock(b) != inode_lock(a)) {
+		pthread_rwlock_unlock(inode_lock(b));
+	}
+}
+
+//The distinct locks of n fcbs in address order, the order lock_inodes takes them in
+int inode_lock_set(uuid_t *ids, int n, pthread_rwlock_t **set) {
+	int count = 0;
+	for (int i = 0; i < n; i++) {
+		pthread_rwlock_t *l = inode_lock(ids[i]);
+		int j = count;
+		while (j > 0 && set[j - 1] > l) {
+			j--;
+		}
+		if (j > 0 && set[j - 1] == l) {
+			continue;
+		}
+		memmove(&set[j + 1], &set[j], (count - j) * sizeof(pthread_rwlock_t *));
+		set[j] = l;
+		count++;
+	}
+	return count;
+}
+
+//Lock up to MY_LOCK_SET fcbs for writing, as lock_inode_pair does two
+void lock_inodes(uuid_t *ids, int n) {
+	pthread_rwlock_t *set[MY_LOCK_SET];
+	int count = inode_lock_set(ids, n, set);
+	for (int i = 0; i < count; i++) {
+		pthread_rwlock_wrlock(set[i]);
+	}
+}
+
+void unlock_inodes(uuid_t *ids, int n) {
+	pthread_rwlock_t *set[MY_LOCK_SET];
+	int count = inode_lock_set(ids, n, set);
+	for (int i = count - 1; i >= 0; i--) {
+		pthread_rwlock_unlock(set[i]);
+	}
+}
+
+
+//functions on save and read
+int fetch_fcb(uuid_t *key, myfcb *fcb) {
+	int rc;
+	myinode *n;
+	myfcb tmp;
+	unqlite_int64 nBytes = sizeof(myfcb);
+
+	if (uuid_is_null(*key)) {		//The root fcb is always in memory
+		pthread_mutex_lock(&root_lock);
+		*fcb = the_root_fcb;
+		pthread_mutex_unlock(&root_lock);
+		return 0;
+	}
+	pthread_mutex_lock(&icache_lock);
+	if ((n = icache_lookup(*key)) != NULL) {
+		*fcb = n->fcb;
+		pthread_mutex_unlock(&icache_lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&icache_lock);
+	rc = kv_fetch(key, key_size(*key), NULL, &nBytes);
+	if (nBytes != sizeof(myfcb)) {
+		log_error("fetch_ent failed: invalid fetch size - %i, want: %i\n", nBytes, sizeof(myfcb));
+		return rc;
+	}
+	rc = kv_fetch(key, key_size(*key), &tmp, &nBytes);
+	if (rc != UNQLITE_OK) {
+		log_error("fetch_ent failed: error code - %i\n", rc);
+		return rc;
+	}
+	//Another thread may have cached it, and changed it since, while the store was read
+	pthread_mutex_lock(&icache_lock);
+	if ((n = icache_lookup(*key)) != NULL) {
+		tmp = n->fcb;
+	}
+	else {
+		icache_insert(*key, &tmp);
+	}
+	pthread_mutex_unlock(&icache_lock);
+	*fcb = tmp;
+	return 0;
+}
+
+//Fetch a data block into buf, which holds block_size bytes. The part of the block past the end of
+//the record, or the whole block if it was never written, reads as zeros.
+int fetch_block(uuid_t *key, char *buf) {
+	int rc;
+	unqlite_int64 nBytes = the_super.block_size;
+
+	rc = kv_fetch(key, key_size(*key), buf, &nBytes);
+	if (rc == UNQLITE_NOTFOUND) {
+		nBytes = 0;
+	}
+	else if (rc != UNQLITE_OK) {
+		log_error("fetch_block failed: error code - %i\n", rc);
+		return rc;
+	}
+	memset(buf + nBytes, 0, the_super.block_size - nBytes);
+	return 0;
+}
+
+//Store the first len bytes of a data block
+int store_block(uuid_t *key, const char *buf, size_t len) {
+	int rc;
+	rc = kv_store(key, key_size(*key), buf, len);
+	if (rc != UNQLITE_OK) {
+		log_error("store_block: Store block failed with %i\n", rc);
+		return rc;
+	}
+	return 0;
+}
+
+//Delete the record of a data block, which then reads as zeros. A block never stored is no error.
+int delete_block(uuid_t *key) {
+	int rc = kv_delete(key, key_size(*key));
+	if (rc != UNQLITE_OK && rc != UNQLITE_NOTFOUND) {
+		log_error("delete_block: delete failed with %i\n", rc);
+		return rc;
+	}
+	return 0;
+}
+
+//1 if a record is stored under the key of a data block
+int block_stored(uuid_t *key) {
+	unqlite_int64 nBytes;
+	return kv_fetch(key, key_size(*key), NULL, &nBytes) == UNQLITE_OK;
+}
+
+//1 if block idx of a file, whose key is not null, has a record, and so is counted in fcb->blocks.
+//Outside the unwritten range a key always has one, so only a block inside it is looked up.
+int block_recorded(myfcb *fcb, unsigned long long idx, uuid_t *key) {
+	return idx < fcb->unwritten_first || idx >= fcb->unwritten_end || block_stored(key);
+}
+
+//1 if the n bytes at data are all zero
+int block_is_zero(const char *data, size_t n) {
+	return n == 0 || (data[0] == 0 && memcmp(data, data + 1, n - 1) == 0);
+}
+
+int fetch_ind(uuid_t *key, ind *blk) {
+	int rc;
+	unqlite_int64 nBytes = sizeof(ind);
+
+	rc = kv_fetch(key, key_size(*key), blk, &nBytes);
+	if (rc != UNQLITE_OK) {
+		log_error("fetch_ind failed: error code - %i\n", rc);
+		return rc;
+	}
+	if (nBytes != sizeof(ind)) {
+		log_error("fetch_ind failed: invalid fetch size - %i, want: %i\n", nBytes, sizeof(ind));
+		return -EIO;
+	}
+	return 0;
+}
+
+int store_ind(uuid_t *key, ind *blk) {
+	int rc;
+	rc = kv_store(key, key_size(*key), blk, sizeof(ind));
+	if (rc != UNQLITE_OK) {
+		log_error("store_ind: Store indirect block failed with %i\n", rc);
+		return rc;
+	}
+	return 0;
+}
+
+//The root fcb is kept in the_root_fcb and written through under ROOT_OBJECT_KEY. The caller holds
+//root_lock.
+int store_root_fcb() {
+	int rc;
+	if ((rc = kv_store(ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE,&the_root_fcb,sizeof(myfcb))) != UNQLITE_OK) {
+		log_error("store_root_fcb: Root FCB write_back failed %i\n", rc);
+		return rc;
+	}
+	return 0;
+}
+
+//The fcb is only updated in the inode cache; it reaches the store when it is written back.
+//zero_uuid addresses the root fcb.
+int store_fcb(uuid_t *key, myfcb *fcb) {
+	myinode *n;
+	int rc = 0;
+	if (uuid_is_null(*key)) {
+		pthread_mutex_lock(&root_lock);
+		the_root_fcb = *fcb;
+		rc = store_root_fcb();
+		pthread_mutex_unlock(&root_lock);
+		return rc;
+	}
+	pthread_mutex_lock(&icache_lock);
+	if ((n = icache_lookup(*key)) == NULL && (n = icache_insert(*key, fcb)) == NULL) {
+		//No memory to cache it, write it through instead
+		if ((rc = kv_store(key, key_size(*key), fcb, sizeof(myfcb))) != UNQLITE_OK) {
+			log_error("store_fcb: store fcb failed\n");
+		}
+	}
+	else {
+		n->fcb = *fcb;
+		n->dirty = 1;
+	}
+	pthread_mutex_unlock(&icache_lock);
+	return rc;
+}
+
+//Pin the inode of an open file in the cache and give it a block map cache. The caller holds the
+//inode lock.
+int icache_open(uuid_t *key, myinode **out) {
+	int rc;
+	myfcb fcb;
+	myinode *n;
+
+	if ((rc = fetch_fcb(key, &fcb)) != 0) {
+		return rc;
+	}
+	pthread_mutex_lock(&icache_lock);
+	if ((n = icache_lookup(*key)) == NULL && (n = icache_insert(*key, &fcb)) == NULL) {
+		pthread_mutex_unlock(&icache_lock);
+		return -ENOMEM;
+	}
+	if (n->map == NULL) {
+		n->map = calloc(1, sizeof(mymap));	//Without one the map is simply not cached
+	}
+	n->refs++;
+	pthread_mutex_unlock(&icache_lock);
+	*out = n;
+	return 0;
+}
+
+//Block map cache of an fcb, if it is cached and open. It stays valid while the inode lock is held.
+mymap *icache_map(uuid_t id) {
+	pthread_mutex_lock(&icache_lock);
+	myinode *n = icache_lookup(id);
+	mymap *mc = n == NULL ? NULL : n->map;
+	pthread_mutex_unlock(&icache_lock);
+	return mc;
+}
+
+//Free list. Deleting a record gives its id back here and creating one takes an id from here, so
+//the ids of a busy filesystem keep being reused instead of new ones being generated every time.
+//Taking and giving back are a slot move in the head record, held in free_head; once in
+//MY_MAX_FREE + 1 times a full head is stored as a record of its own, or one is fetched back.
+//The head is written with each group commit. free_lock guards it.
+myfree free_head;
+unsigned int free_count;            //ids in use in free_head
+int free_dirty;                     //free_head differs from the stored copy
+pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Read the head of the free list, an empty one if the filesystem has never freed anything
+int free_list_load() {
+	int rc;
+	unqlite_int64 nBytes = sizeof(myfree);
+
+	memset(&free_head, 0, sizeof(myfree));
+	free_count = 0;
+	free_dirty = 0;
+	rc = kv_fetch(FREE_OBJECT_KEY, FREE_OBJECT_KEY_SIZE, &free_head, &nBytes);
+	if (rc == UNQLITE_NOTFOUND) {
+		return 0;
+	}
+	if (rc != UNQLITE_OK || nBytes != sizeof(myfree)) {
+		log_error("free_list_load: fetch failed with %i\n", rc);
+		memset(&free_head, 0, sizeof(myfree));	//The ids on the list are lost, nothing else
+		return rc;
+	}
+	while (free_count < MY_MAX_FREE && !uuid_is_null(free_head.free_node[free_count])) {
+		free_count++;
+	}
+	return 0;
+}
+
+//Write the head of the free list back if it changed
+int free_list_store() {
+	int rc = 0;
+	pthread_mutex_lock(&free_lock);
+	if (free_dirty) {
+		if ((rc = kv_store(FREE_OBJECT_KEY, FREE_OBJECT_KEY_SIZE, &free_head, sizeof(myfree))) != UNQLITE_OK) {
+			log_error("free_list_store: store failed with %i\n", rc);
+		}
+		else {
+			free_dirty = 0;
+		}
+	}
+	pthread_mutex_unlock(&free_lock);
+	return rc;
+}
+
+//An id never handed out before. Sequential ids are reserved MY_SEQ_BATCH at a time in the
+//superblock, so a crash skips at most that many of them. The caller holds free_lock.
+uint64_t seq_next = 1;
+
+void id_new(uuid_t out) {
+	int rc;
+	if (!(the_super.flags & MY_SUPER_SEQIDS)) {
+		uuid_generate(out);
+		return;
+	}
+	if (seq_next >= the_super.seq_limit) {
+		the_super.seq_limit = seq_next + MY_SEQ_BATCH;
+		if ((rc = kv_store(SUPER_OBJECT_KEY, SUPER_OBJECT_KEY_SIZE, &the_super, sizeof(mysuper))) != UNQLITE_OK) {
+			log_error("id_new: store superblock failed with %i\n", rc);
+		}
+	}
+	seq_key(seq_next++, 0, out);
+}
+
+//An id for a new record: a freed one if there is any, a new one otherwise
+void id_alloc(uuid_t out) {
+	int rc;
+	unqlite_int64 nBytes = sizeof(myfree);
+	myfree next;
+
+	pthread_mutex_lock(&free_lock);
+	if (free_count > 0) {
+		free_count--;
+		uuid_copy(out, free_head.free_node[free_count]);
+		uuid_clear(free_head.free_node[free_count]);
+		free_dirty = 1;
+	}
+	else if (!uuid_is_null(free_head.next)) {
+		//The next record becomes the head and its id is the one handed out
+		rc = kv_fetch(free_head.next, key_size(free_head.next), &next, &nBytes);
+		if (rc != UNQLITE_OK || nBytes != sizeof(myfree)) {
+			log_error("id_alloc: fetch free list failed with %i\n", rc);
+			uuid_clear(free_head.next);		//Drop the rest of the list rather than fail
+			id_new(out);
+		}
+		else {
+			uuid_copy(out, free_head.next);
+			if ((rc = kv_delete(out, key_size(out))) != UNQLITE_OK) {
+				log_error("id_alloc: delete free list record failed with %i\n", rc);
+			}
+			free_head = next;
+			free_count = MY_MAX_FREE;
+		}
+		free_dirty = 1;
+	}
+	else {
+		id_new(out);
+	}
+	pthread_mutex_unlock(&free_lock);
+}
+
+//Give back the id of a record which has been deleted. The key of a block which derives from its
+//inode number is not an id of its own and is left alone.
+void id_free(uuid_t id) {
+	int rc;
+	if ((the_super.flags & MY_SUPER_SEQIDS) && key_lo(id) != 0) {
+		return;
+	}
+	pthread_mutex_lock(&free_lock);
+	if (free_count < MY_MAX_FREE) {
+		uuid_copy(free_head.free_node[free_count++], id);
+	}
+	else {
+		//The full head is stored under the id freed, and an empty head leads to it
+		if ((rc = kv_store(id, key_size(id), &free_head, sizeof(myfree))) != UNQLITE_OK) {
+			log_error("id_free: store free list record failed with %i\n", rc);
+			pthread_mutex_unlock(&free_lock);
+			return;		//The id is not used again, nothing else is lost
+		}
+		memset(&free_head, 0, sizeof(myfree));
+		uuid_copy(free_head.next, id);
+		free_count = 0;
+	}
+	free_dirty = 1;
+	pthread_mutex_unlock(&free_lock);
+}
+
+
+//Orphan list. A file whose data has to be deleted is taken out of its directory and its id put
+//here, and the reclaimer thread frees its blocks and then the fcb in the background. The list is
+//written with each group commit, so the removal from the directory and the move to the list
+//reach the store together, and a filesystem mounted again goes on with what was left of it.
+//orphan_lock guards it; it is taken after icache_lock.
+uuid_t *orphans;
+unsigned int orphan_count;
+unsigned int orphan_room;           //ids allocated in orphans
+int orphan_dirty;                   //orphans differs from the stored copy
+pthread_mutex_t orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t orphan_cond = PTHREAD_COND_INITIALIZER;
+
+//Read the orphan list, left over by the last mount
+int orphan_load() {
+	int rc;
+	unqlite_int64 nBytes;
+
+	free(orphans);
+	orphans = NULL;
+	orphan_count = orphan_room = 0;
+	orphan_dirty = 0;
+	rc = kv_fetch(ORPHAN_OBJECT_KEY, ORPHAN_OBJECT_KEY_SIZE, NULL, &nBytes);
+	if (rc == UNQLITE_NOTFOUND) {
+		return 0;
+	}
+	if (rc != UNQLITE_OK || (orphans = malloc(nBytes)) == NULL ||
+		(rc = kv_fetch(ORPHAN_OBJECT_KEY, ORPHAN_OBJECT_KEY_SIZE, orphans, &nBytes)) != UNQLITE_OK) {
+		log_error("orphan_load: fetch failed with %i\n", rc);	//Their records are lost, nothing else
+		return rc != UNQLITE_OK ? rc : -ENOMEM;
+	}
+	orphan_count = orphan_room = nBytes / sizeof(uuid_t);
+	return 0;
+}
+
+//Write the orphan list back if it changed, an empty one is deleted
+int orphan_store() {
+	int rc = 0;
+	pthread_mutex_lock(&orphan_lock);
+	if (orphan_dirty) {
+		if (orphan_count == 0) {
+			rc = kv_delete(ORPHAN_OBJECT_KEY, ORPHAN_OBJECT_KEY_SIZE);
+			rc = rc == UNQLITE_NOTFOUND ? 0 : rc;
+		}
+		else {
+			rc = kv_store(ORPHAN_OBJECT_KEY, ORPHAN_OBJECT_KEY_SIZE, orphans, orphan_count * sizeof(uuid_t));
+		}
+		if (rc != UNQLITE_OK) {
+			log_error("orphan_store: store failed with %i\n", rc);
+		}
+		else {
+			orphan_dirty = 0;
+		}
+	}
+	pthread_mutex_unlock(&orphan_lock);
+	return rc;
+}
+
+//Put an fcb on the orphan list and wake the reclaimer
+int orphan_add(uuid_t id) {
+	pthread_mutex_lock(&orphan_lock);
+	if (orphan_count == orphan_room) {
+		unsigned int room = orphan_room ? orphan_room * 2 : 16;
+		uuid_t *grown = realloc(orphans, room * sizeof(uuid_t));
+		if (grown == NULL) {
+			pthread_mutex_unlock(&orphan_lock);
+			return -ENOMEM;
+		}
+		orphans = grown;
+		orphan_room = room;
+	}
+	uuid_copy(orphans[orphan_count++], id);
+	orphan_dirty = 1;
+	pthread_cond_signal(&orphan_cond);
+	pthread_mutex_unlock(&orphan_lock);
+	return 0;
+}
+
+//Take an fcb off the orphan list, it has been reclaimed
+void orphan_remove(uuid_t id) {
+	pthread_mutex_lock(&orphan_lock);
+	for (unsigned int i = 0; i < orphan_count; i++) {
+		if (uuid_compare(orphans[i], id) == 0) {
+			memmove(&(orphans[i]), &(orphans[i + 1]), (orphan_count - i - 1) * sizeof(uuid_t));
+			orphan_count--;
+			orphan_dirty = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&orphan_lock);
+}
+
+//1 if an fcb is on the orphan list, deleted but not reclaimed yet
+int orphan_has(uuid_t id) {
+	int found = 0;
+	pthread_mutex_lock(&orphan_lock);
+	for (unsigned int i = 0; i < orphan_count && !found; i++) {
+		found = uuid_compare(orphans[i], id) == 0;
+	}
+	pthread_mutex_unlock(&orphan_lock);
+	return found;
+}
+
+//Orphans not reclaimed yet, for the stats file
+unsigned int orphan_pending() {
+	pthread_mutex_lock(&orphan_lock);
+	unsigned int count = orphan_count;
+	pthread_mutex_unlock(&orphan_lock);
+	return count;
+}
+
+//Wake the reclaimer, an orphan it had to pass over may have been closed
+void orphan_kick() {
+	pthread_mutex_lock(&orphan_lock);
+	if (orphan_count > 0) {
+		pthread_cond_signal(&orphan_cond);
+	}
+	pthread_mutex_unlock(&orphan_lock);
+}
+
+//Directory index. The entries of a directory are found through a linear hash table whose
+//buckets are stored as records keyed by (directory fcb id, bucket number). A bucket holds its
+//entries packed as mydirrecs, fcb id, type and name, so a lookup or a listing fetches one record
+//per bucket and none per entry. The table grows by splitting one bucket at a time once the
+//directory holds more than MY_DIR_LOAD entries per bucket, so no insert ever rehashes the
+//whole directory.
+unsigned int name_hash(const char *name, size_t len) {
+	unsigned int h = 2166136261u;	//FNV-1a
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ (unsigned char) name[i]) * 16777619u;
+	}
+	return h;
+}
+
+unsigned int dir_buckets(myfcb *dir) {
+	return (1u << dir->dir_level) + dir->dir_split;
+}
+
+unsigned int dir_bucket_of(myfcb *dir, unsigned int hash) {
+	unsigned int bucket = hash & ((1u << dir->dir_level) - 1);
+	if (bucket < dir->dir_split) {
+		bucket = hash & ((2u << dir->dir_level) - 1);	//Already split, use the next level
+	}
+	return bucket;
+}
+
+void dir_key(uuid_t dir, unsigned int bucket, mydirkey *key) {
+	memset(key, 0, sizeof(mydirkey));
+	uuid_copy(key->dir, dir);
+	key->bucket = bucket;
+}
+
+//Fetch a bucket into a malloc'd buffer with room for one more entry. A bucket which was never
+//written is empty.
+int fetch_bucket(uuid_t dir, unsigned int bucket, char **recs, size_t *len) {
+	int rc;
+	mydirkey key;
+	unqlite_int64 nBytes;
+
+	*recs = NULL;
+	*len = 0;
+	dir_key(dir, bucket, &key);
+	rc = kv_fetch(&key, sizeof(key), NULL, &nBytes);
+	if (rc == UNQLITE_NOTFOUND) {
+		return 0;
+	}
+	if (rc != UNQLITE_OK) {
+		log_error("fetch_bucket: size fetch failed with %i\n", rc);
+		return rc;
+	}
+	if ((*recs = malloc(nBytes + MY_DIR_REC_SIZE(MY_MAX_PATH))) == NULL) {	//Room for one insert
+		return -ENOMEM;
+	}
+	if ((rc = kv_fetch(&key, sizeof(key), *recs, &nBytes)) != UNQLITE_OK) {
+		log_error("fetch_bucket: fetch failed with %i\n", rc);
+		free(*recs);
+		*recs = NULL;
+		return rc;
+	}
+	*len = nBytes;
+	return 0;
+}
+
+//Store a bucket, an empty bucket is deleted
+int store_bucket(uuid_t dir, unsigned int bucket, char *recs, size_t len) {
+	int rc;
+	mydirkey key;
+
+	dir_key(dir, bucket, &key);
+	if (len == 0) {
+		rc = kv_delete(&key, sizeof(key));
+		return rc == UNQLITE_NOTFOUND ? 0 : rc;
+	}
+	if ((rc = kv_store(&key, sizeof(key), recs, len)) != UNQLITE_OK) {
+		log_error("store_bucket: store failed with %i\n", rc);
+		return rc;
+	}
+	return 0;
+}
+
+//Offset of the entry of name in a bucket, len if it is not there
+size_t dir_find(char *recs, size_t len, const char *name) {
+	size_t pos, n = strlen(name);
+	for (pos = 0; pos < len; pos += MY_DIR_REC_SIZE(((mydirrec *) (recs + pos))->len)) {
+		mydirrec *r = (mydirrec *) (recs + pos);
+		if (r->len == n && memcmp(r->name, name, n) == 0) {
+			break;
+		}
+	}
+	return pos < len ? pos : len;
+}
+
+//Find name in a directory. On success ent holds the entry.
+int dir_lookup(uuid_t dir, myfcb *dirfcb, const char *name, myent *ent) {
+	int rc;
+	char *recs;
+	size_t len, pos;
+
+	if (strlen(name) >= MY_MAX_PATH) {
+		return -ENOENT;
+	}
+	if ((rc = fetch_bucket(dir, dir_bucket_of(dirfcb, name_hash(name, strlen(name))), &recs, &len)) != 0) {
+		return rc;
+	}
+	rc = -ENOENT;
+	if ((pos = dir_find(recs, len, name)) < len) {
+		mydirrec *r = (mydirrec *) (recs + pos);
+		memset(ent, 0, sizeof(myent));
+		uuid_copy(ent->fcb_id, r->fcb_id);
+		memcpy(ent->name, r->name, r->len);
+		rc = 0;
+	}
+	free(recs);
+	return rc;
+}
+
+//Split the next bucket in line, moving the entries which now hash to its buddy
+int dir_split(uuid_t dir, myfcb *dirfcb) {
+	int rc;
+	char *recs, *buddy;
+	size_t len, pos, kept = 0, moved = 0;
+	unsigned int bucket = dirfcb->dir_split;
+	unsigned int mask = (2u << dirfcb->dir_level) - 1;
+
+	if ((rc = fetch_bucket(dir, bucket, &recs, &len)) != 0) {
+		return rc;
+	}
+	if ((buddy = malloc(len + 1)) == NULL) {
+		free(recs);
+		return -ENOMEM;
+	}
+	//Entries kept are moved down over the ones which went, never past where they were
+	for (pos = 0; pos < len; ) {
+		mydirrec *r = (mydirrec *) (recs + pos);
+		size_t size = MY_DIR_REC_SIZE(r->len);
+		if ((name_hash(r->name, r->len) & mask) == bucket) {
+			memmove(recs + kept, r, size);
+			kept += size;
+		}
+		else {
+			memcpy(buddy + moved, r, size);
+			moved += size;
+		}
+		pos += size;
+	}
+	if ((rc = store_bucket(dir, bucket + (1u << dirfcb->dir_level), buddy, moved)) == 0 &&
+		(rc = store_bucket(dir, bucket, recs, kept)) == 0) {
+		if (++dirfcb->dir_split == (1u << dirfcb->dir_level)) {
+			dirfcb->dir_level++;
+			dirfcb->dir_split = 0;
+		}
+	}
+	free(recs);
+	free(buddy);
+	return rc;
+}
+
+//Add an entry for the fcb id, of the given mode, to a directory. The caller stores the directory
+//fcb.
+int dir_add(uuid_t dir, myfcb *dirfcb, const char *name, uuid_t id, mode_t mode) {
+	int rc;
+	char *recs;
+	size_t len, n = strlen(name);
+	unsigned int bucket = dir_bucket_of(dirfcb, name_hash(name, n));
+	mydirrec *r;
+
+	if (n >= MY_MAX_PATH) {
+		return -ENAMETOOLONG;
+	}
+	if ((rc = fetch_bucket(dir, bucket, &recs, &len)) != 0) {
+		return rc;
+	}
+	if (recs == NULL && (recs = malloc(MY_DIR_REC_SIZE(n))) == NULL) {
+		return -ENOMEM;
+	}
+	r = (mydirrec *) (recs + len);
+	uuid_copy(r->fcb_id, id);
+	r->len = n;
+	r->type = (mode & S_IFMT) >> 12;
+	memcpy(r->name, name, n);
+	rc = store_bucket(dir, bucket, recs, len + MY_DIR_REC_SIZE(n));
+	free(recs);
+	if (rc != 0) {
+		return rc;
+	}
+	dirfcb->dir_count++;
+	if (dirfcb->dir_count > (unsigned long) MY_DIR_LOAD * dir_buckets(dirfcb)) {
+		return dir_split(dir, dirfcb);
+	}
+	return 0;
+}
+
+//Remove the entry of name from a directory. The caller stores the directory fcb.
+int dir_remove(uuid_t dir, myfcb *dirfcb, const char *name) {
+	int rc;
+	char *recs;
+	size_t len, pos;
+	unsigned int bucket = dir_bucket_of(dirfcb, name_hash(name, strlen(name)));
+
+	if ((rc = fetch_bucket(dir, bucket, &recs, &len)) != 0) {
+		return rc;
+	}
+	rc = -ENOENT;
+	if ((pos = dir_find(recs, len, name)) < len) {
+		size_t size = MY_DIR_REC_SIZE(((mydirrec *) (recs + pos))->len);
+		memmove(recs + pos, recs + pos + size, len - pos - size);
+		if ((rc = store_bucket(dir, bucket, recs, len - size)) == 0) {
+			dirfcb->dir_count--;
+		}
+	}
+	free(recs);
+	return rc;
+}
+
+//Block map. Block i of a file is direct[i] for the first MY_MAX_DIRECT blocks, after that it is
+//found through the single, double or triple indirect tree, each level of which fans out by
+//MY_MAX_INDIRECT. Only the blocks an operation covers are fetched or stored, so the cost of a
+//read or write does not depend on the size of the file.
+uuid_t *bmap_root(myfcb *fcb, int depth) {
+	switch (depth) {
+	case 1: return &(fcb->single_indirect);
+	case 2: return &(fcb->double_indirect);
+	default: return &(fcb->triple_indirect);
+	}
+}
+
+//Largest file size the block map can address
+off_t max_file_size() {
+	unsigned long long blocks = MY_MAX_DIRECT, span = 1;
+	for (int depth = 1; depth <= 3; depth++) {
+		span *= MY_MAX_INDIRECT;
+		blocks += span;
+	}
+	return (off_t) (blocks * the_super.block_size);
+}
+
+//Key of block idx of a file, with sequential ids
+void block_key(myfcb *fcb, unsigned long long idx, uuid_t out) {
+	seq_key(fcb->ino, idx + 1, out);
+}
+
+//Extent layout. The extents of a file are kept sorted by block, in the fcb while there are at
+//most MY_INLINE_EXTENTS of them and in a record of their own after that. A block is found with a
+//binary search over the extents, and a file written sequentially grows its last extent by one
+//block at a time, so it needs a handful of extents rather than a key per block.
+void extent_key(myextent *e, unsigned long long idx, uuid_t out) {
+	uint32_t n = (uint32_t) (idx - e->block);
+	if (the_super.flags & MY_SUPER_SEQIDS) {
+		seq_key(key_hi(e->key), key_lo(e->key) + n, out);
+		return;
+	}
+	uuid_copy(out, e->key);
+	out[12] = n >> 24;
+	out[13] = n >> 16;
+	out[14] = n >> 8;
+	out[15] = n;
+}
+
+//Index of the last extent starting at or before idx, -1 if there is none
+int extent_find(myextent *ext, unsigned int count, unsigned long long idx) {
+	int lo = 0, hi = (int) count - 1, found = -1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (ext[mid].block <= idx) {
+			found = mid;
+			lo = mid + 1;
+		}
+		else {
+			hi = mid - 1;
+		}
+	}
+	return found;
+}
+
+//Fetch the extents of a file into a malloc'd array with room for one more
+int fetch_extents(myfcb *fcb, myextent **ext, unsigned int *count) {
+	int rc;
+	unqlite_int64 nBytes = fcb->extent_count * sizeof(myextent);
+
+	*count = fcb->extent_count;
+	if ((*ext = malloc(nBytes + sizeof(myextent))) == NULL) {
+		return -ENOMEM;
+	}
+	if (fcb->extent_count <= MY_INLINE_EXTENTS) {
+		memcpy(*ext, fcb->extent, nBytes);
+		return 0;
+	}
+	if ((rc = kv_fetch(fcb->extent_list, key_size(fcb->extent_list), *ext, &nBytes)) != UNQLITE_OK) {
+		log_error("fetch_extents failed: error code - %i\n", rc);
+		free(*ext);
+		return rc;
+	}
+	return 0;
+}
+
+//Store the extents of a file, inline in the fcb when they fit. The caller stores the fcb.
+int store_extents(myfcb *fcb, myextent *ext, unsigned int count) {
+	int rc;
+	if (count <= MY_INLINE_EXTENTS) {
+		if (!uuid_is_null(fcb->extent_list)) {
+			if ((rc = kv_delete(fcb->extent_list, key_size(fcb->extent_list))) != 0 && rc != UNQLITE_NOTFOUND) {
+				log_error("store_extents: delete extent list failed with %i\n", rc);
+				return rc;
+			}
+			id_free(fcb->extent_list);
+			uuid_clear(fcb->extent_list);
+		}
+		memset(fcb->extent, 0, sizeof(fcb->extent));
+		memcpy(fcb->extent, ext, count * sizeof(myextent));
+	}
+	else {
+		if (uuid_is_null(fcb->extent_list)) {
+			id_alloc(fcb->extent_list);
+		}
+		if ((rc = kv_store(fcb->extent_list, key_size(fcb->extent_list), ext, count * sizeof(myextent))) != UNQLITE_OK) {
+			log_error("store_extents: store extent list failed with %i\n", rc);
+			return rc;
+		}
+	}
+	fcb->extent_count = count;
+	return 0;
+}
+
+//Extents of a file with room for one more, taken from the map cache when it holds them. Hand
+//them back with release_extents.
+int load_extents(myfcb *fcb, mymap *mc, myextent **ext, unsigned int *count) {
+	if (mc != NULL && mc->ext != NULL && mc->ext_count == fcb->extent_count) {
+		*ext = mc->ext;
+		*count = mc->ext_count;
+		return 0;
+	}
+	return fetch_extents(fcb, ext, count);
+}
+
+//Done with the extents of load_extents. A list which has its own record stays in the map cache
+//as long as it matches the fcb; inline ones are cheap to copy and are freed.
+void release_extents(myfcb *fcb, mymap *mc, myextent *ext, int current) {
+	if (mc != NULL && current && fcb->extent_count > MY_INLINE_EXTENTS) {
+		myextent *room = realloc(ext, (fcb->extent_count + 1) * sizeof(myextent));
+		if (room != NULL) {
+			mc->ext = room;
+			mc->ext_count = fcb->extent_count;
+			return;
+		}
+	}
+	if (mc != NULL && mc->ext == ext) {
+		mc->ext = NULL;
+	}
+	free(ext);
+}
+
+//Keys for an extent being started: those of its blocks with sequential ids, which follow on from
+//each other anyway, otherwise a fresh run
+void extent_new_key(myfcb *fcb, myextent *e) {
+	if (the_super.flags & MY_SUPER_SEQIDS) {
+		block_key(fcb, e->block, e->key);
+	}
+	else {
+		uuid_generate(e->key);		//A run of keys, the free list only has single ones
+		memset(&(e->key[12]), 0, 4);
+	}
+}
+
+//bmap for the extent layout. A new block extends the extent ending just before it when it can,
+//otherwise it starts an extent of its own.
+int extent_map(myfcb *fcb, mymap *mc, unsigned long long idx, int alloc, uuid_t *out) {
+	int rc = 0, i;
+	unsigned int count;
+	myextent *ext;
+
+	if ((rc = load_extents(fcb, mc, &ext, &count)) != 0) {
+		return rc;
+	}
+	i = extent_find(ext, count, idx);
+	if (i >= 0 && idx < ext[i].block + ext[i].count) {
+		extent_key(&ext[i], idx, *out);
+	}
+	else if (alloc) {
+		if (i >= 0 && idx == ext[i].block + ext[i].count && ext[i].count < MY_MAX_EXTENT) {
+			ext[i].count++;
+		}
+		else {
+			i++;
+			memmove(&ext[i + 1], &ext[i], (count - i) * sizeof(myextent));
+			ext[i].block = idx;
+			ext[i].count = 1;
+			extent_new_key(fcb, &ext[i]);
+			count++;
+		}
+		extent_key(&ext[i], idx, *out);
+		rc = store_extents(fcb, ext, count);
+	}
+	release_extents(fcb, mc, ext, rc == 0);
+	return rc;
+}
+
+//Give each block from first to end - 1 which has no key one, without storing anything under it.
+//A hole in the range becomes a single extent, or lengthens the extent ending just before it.
+int extent_reserve(myfcb *fcb, mymap *mc, unsigned long long first, unsigned long long end) {
+	int rc, i;
+	unsigned int count, room;
+	unsigned long long b = first;
+	myextent *ext;
+
+	if ((rc = load_extents(fcb, mc, &ext, &count)) != 0) {
+		return rc;
+	}
+	room = count + 1;
+	while (b < end) {
+		i = extent_find(ext, count, b);
+		if (i >= 0 && b < ext[i].block + ext[i].count) {
+			b = ext[i].block + ext[i].count;	//Mapped already
+			continue;
+		}
+		unsigned long long hole = end;
+		if (i + 1 < (int) count && ext[i + 1].block < hole) {
+			hole = ext[i + 1].block;
+		}
+		if (hole - b > MY_MAX_EXTENT) {
+			hole = b + MY_MAX_EXTENT;
+		}
+		if (i >= 0 && b == ext[i].block + ext[i].count && ext[i].count <= MY_MAX_EXTENT - (hole - b)) {
+			ext[i].count += hole - b;
+		}
+		else {
+			if (count == room) {
+				myextent *grown = realloc(ext, room * 2 * sizeof(myextent));
+				if (grown == NULL) {
+					release_extents(fcb, mc, ext, 0);
+					return -ENOMEM;
+				}
+				if (mc != NULL && mc->ext == ext) {
+					mc->ext = grown;
+				}
+				ext = grown;
+				room *= 2;
+			}
+			i++;
+			memmove(&ext[i + 1], &ext[i], (count - i) * sizeof(myextent));
+			ext[i].block = b;
+			ext[i].count = hole - b;
+			extent_new_key(fcb, &ext[i]);
+			count++;
+		}
+		b = hole;
+	}
+	rc = store_extents(fcb, ext, count);
+	release_extents(fcb, mc, ext, rc == 0);
+	return rc;
+}
+
+//free_blocks for the extent layout
+int extent_free(myfcb *fcb, mymap *mc, unsigned long long first) {
+	int rc = 0;
+	unsigned int count, kept = 0;
+	myextent *ext;
+	uuid_t key;
+
+	if ((rc = load_extents(fcb, mc, &ext, &count)) != 0) {
+		return rc;
+	}
+	for (unsigned int i = 0; i < count; i++) {
+		unsigned long long from = ext[i].block > first ? ext[i].block : first;
+		for (unsigned long long b = from; b < ext[i].block + ext[i].count; b++) {
+			extent_key(&ext[i], b, key);
+			if ((rc = kv_delete(key, key_size(key))) == 0) {
+				fcb->blocks--;
+			}
+			else if (rc != UNQLITE_NOTFOUND) {
+				log_error("extent_free: delete block failed with %i\n", rc);
+				release_extents(fcb, mc, ext, 0);
+				return rc;
+			}
+		}
+		if (from > ext[i].block) {
+			if (from < ext[i].block + ext[i].count) {
+				ext[i].count = from - ext[i].block;
+			}
+			ext[kept++] = ext[i];
+		}
+	}
+	rc = store_extents(fcb, ext, kept);
+	release_extents(fcb, mc, ext, rc == 0);
+	return rc;
+}
+
+//Key for a data block about to be created: derived from the inode number with sequential ids,
+//an id of its own otherwise
+void new_block_key(myfcb *fcb, unsigned long long idx, uuid_t out) {
+	if (the_super.flags & MY_SUPER_SEQIDS) {
+		block_key(fcb, idx, out);
+	}
+	else {
+		id_alloc(out);
+	}
+}
+
+//Find the key of block idx of a file. A block which does not exist comes back as a null key,
+//unless alloc is set, in which case it and any indirect blocks leading to it are created. The
+//fcb is changed when a direct key or a tree root is created; the caller stores it.
+//With a map cache, the indirect blocks on the way are kept in it so that the next lookup nearby
+//does not fetch them again.
+int bmap(myfcb *fcb, mymap *mc, unsigned long long idx, int alloc, uuid_t *out) {
+	int rc, depth, fresh = 0;
+	unsigned long long span = 1, block = idx;
+	uuid_t *root, key;
+	ind local, *blk = &local;
+
+	uuid_clear(*out);
+	if (fcb->layout == MY_LAYOUT_EXTENTS) {
+		return extent_map(fcb, mc, idx, alloc, out);
+	}
+	if (fcb->layout == MY_LAYOUT_INLINE) {
+		return alloc ? -EINVAL : 0;		//inline data has no blocks, it is moved out first
+	}
+	if (idx < MY_MAX_DIRECT) {
+		if (uuid_is_null(fcb->direct[idx]) && alloc) {
+			new_block_key(fcb, idx, fcb->direct[idx]);
+		}
+		uuid_copy(*out, fcb->direct[idx]);
+		return 0;
+	}
+	idx -= MY_MAX_DIRECT;
+	for (depth = 1; depth <= 3; depth++) {
+		span *= MY_MAX_INDIRECT;
+		if (idx < span) {
+			break;
+		}
+		idx -= span;
+	}
+	if (depth > 3) {
+		return -EFBIG;
+	}
+	root = bmap_root(fcb, depth);
+	if (uuid_is_null(*root)) {
+		if (!alloc) {
+			return 0;
+		}
+		id_alloc(*root);
+		fresh = 1;
+	}
+	uuid_copy(key, *root);
+	for (; depth > 0; depth--) {
+		span /= MY_MAX_INDIRECT;
+		if (mc != NULL) {
+			blk = &(mc->ind_blk[depth - 1]);
+		}
+		if (fresh) {
+			memset(blk, 0, sizeof(ind));
+		}
+		else if (mc == NULL || uuid_compare(mc->ind_key[depth - 1], key) != 0) {
+			if (mc != NULL) {
+				uuid_clear(mc->ind_key[depth - 1]);
+			}
+			if ((rc = fetch_ind(&key, blk)) != 0) {
+				log_error("bmap: fetch_ind failed with %i\n", rc);
+				return rc;
+			}
+		}
+		if (mc != NULL) {
+			uuid_copy(mc->ind_key[depth - 1], key);
+		}
+		uuid_t *slot = &(blk->indirect[idx / span]);
+		idx %= span;
+		fresh = 0;
+		if (uuid_is_null(*slot)) {
+			if (!alloc) {
+				return 0;
+			}
+			if (depth == 1) {
+				new_block_key(fcb, block, *slot);
+			}
+			else {
+				id_alloc(*slot);
+			}
+			fresh = 1;
+			if ((rc = store_ind(&key, blk)) != 0) {
+				if (mc != NULL) {
+					uuid_clear(mc->ind_key[depth - 1]);
+				}
+				return rc;
+			}
+		}
+		uuid_copy(key, *slot);
+	}
+	uuid_copy(*out, key);
+	return 0;
+}
+
+//Delete the blocks from index first on in the tree under key, which covers span blocks at the
+//given depth (0 is a data block). Indirect blocks left empty are deleted too and key is cleared.
+//The data block records deleted are taken off *blocks.
+int free_tree(uuid_t *key, int depth, unsigned long long first, unsigned long long span, uint64_t *blocks) {
+	int rc, keep = 0;
+	ind blk;
+
+	if (uuid_is_null(*key)) {
+		return 0;
+	}
+	if (depth > 0) {
+		unsigned long long child = span / MY_MAX_INDIRECT;
+		if ((rc = fetch_ind(key, &blk)) != 0) {
+			log_error("free_tree: fetch_ind failed with %i\n", rc);
+			return rc;
+		}
+		for (unsigned long long i = 0; i < MY_MAX_INDIRECT; i++) {
+			unsigned long long start = i * child;
+			if (start + child > first &&
+				(rc = free_tree(&(blk.indirect[i]), depth - 1, first > start ? first - start : 0, child, blocks)) != 0) {
+				return rc;
+			}
+			if (!uuid_is_null(blk.indirect[i])) {
+				keep = 1;
+			}
+		}
+		if (keep) {
+			return store_ind(key, &blk);
+		}
+	}
+	if ((rc = kv_delete(key, key_size(*key))) == 0 && depth == 0) {
+		(*blocks)--;
+	}
+	else if (rc != 0 && rc != UNQLITE_NOTFOUND) {
+		log_error("free_tree: delete block failed with %i\n", rc);
+		return rc;
+	}
+	id_free(*key);
+	uuid_clear(*key);
+	return 0;
+}
+
+//Position of block idx among the dirty blocks of mc, or of the first one after it
+unsigned int buf_find(mymap *mc, unsigned long long idx) {
+	unsigned int lo = 0, hi = mc->ndirty;
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (mc->dirty[mid].idx < idx) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+//Dirty buffer of block idx, NULL if the block is not held
+mybuf *buf_lookup(mymap *mc, unsigned long long idx) {
+	unsigned int i = buf_find(mc, idx);
+	return i < mc->ndirty && mc->dirty[i].idx == idx ? &(mc->dirty[i]) : NULL;
+}
+
+//Dirty buffer for block idx, filled from the stored block unless the block is not held yet and
+//its used bytes are all about to be overwritten
+int buf_get(myfcb *fcb, mymap *mc, unsigned long long idx, size_t used, int overwrite, mybuf **out) {
+	int rc;
+	unsigned int i = buf_find(mc, idx);
+	char *data;
+	uuid_t key;
+
+	if (i < mc->ndirty && mc->dirty[i].idx == idx) {
+		*out = &(mc->dirty[i]);
+		return 0;
+	}
+	if (mc->ndirty == mc->dirty_room) {
+		unsigned int room = mc->dirty_room ? mc->dirty_room * 2 : 16;
+		mybuf *grown = realloc(mc->dirty, room * sizeof(mybuf));
+		if (grown == NULL) {
+			return -ENOMEM;
+		}
+		mc->dirty = grown;
+		mc->dirty_room = room;
+	}
+	if ((data = calloc(1, the_super.block_size)) == NULL) {
+		return -ENOMEM;
+	}
+	if (!overwrite && used > 0) {
+		if ((rc = bmap(fcb, mc, idx, 0, &key)) != 0 ||
+			(!uuid_is_null(key) && (rc = fetch_block(&key, data)) != 0)) {
+			free(data);
+			return rc;
+		}
+	}
+	memmove(&(mc->dirty[i + 1]), &(mc->dirty[i]), (mc->ndirty - i) * sizeof(mybuf));
+	mc->dirty[i].idx = idx;
+	mc->dirty[i].used = used;
+	mc->dirty[i].data = data;
+	mc->ndirty++;
+	*out = &(mc->dirty[i]);
+	return 0;
+}
+
+//Forget the dirty blocks from index first to end - 1, their data is being thrown away
+void buf_drop(mymap *mc, unsigned long long first, unsigned long long end) {
+	unsigned int i = buf_find(mc, first), j;
+	for (j = i; j < mc->ndirty && mc->dirty[j].idx < end; j++) {
+		free(mc->dirty[j].data);
+	}
+	memmove(&(mc->dirty[i]), &(mc->dirty[j]), (mc->ndirty - j) * sizeof(mybuf));
+	mc->ndirty -= j - i;
+}
+
+//Forget the blocks read ahead, the data is about to change
+void ra_drop(mymap *mc) {
+	mc->ra_count = 0;
+}
+
+//Note that blocks first to end - 1 may have a key with nothing stored under it. The fcb keeps one
+//range covering all such blocks, outside of which a key always has a record, so that a seek for
+//data or holes only has to look for records inside it.
+void mark_unwritten(myfcb *fcb, unsigned long long first, unsigned long long end) {
+	if (first >= end) {
+		return;
+	}
+	if (fcb->unwritten_first >= fcb->unwritten_end) {
+		fcb->unwritten_first = first;
+		fcb->unwritten_end = end;
+		return;
+	}
+	if (first < fcb->unwritten_first) {
+		fcb->unwritten_first = first;
+	}
+	if (end > fcb->unwritten_end) {
+		fcb->unwritten_end = end;
+	}
+}
+
+//Store the dirty blocks of mc in block order, so that blocks written next to each other get
+//neighbouring keys. A block of zeros is left a hole instead: it is given no key, and one it has
+//loses its record. Blocks which could not be stored stay dirty. The fcb is changed when keys
+//are allocated or records come and go; the caller stores it.
+int flush_blocks(myfcb *fcb, mymap *mc) {
+	int rc = 0, had;
+	unsigned int i;
+	uuid_t key;
+
+	for (i = 0; i < mc->ndirty; i++) {
+		mybuf *b = &(mc->dirty[i]);
+		if ((rc = bmap(fcb, mc, b->idx, 0, &key)) != 0) {
+			log_error("flush_blocks: mapping block %llu failed with %i\n", b->idx, rc);
+			break;
+		}
+		had = !uuid_is_null(key) && block_recorded(fcb, b->idx, &key);
+		if (block_is_zero(b->data, b->used)) {
+			if (!uuid_is_null(key) && (rc = delete_block(&key)) != 0) {
+				log_error("flush_blocks: leaving block %llu a hole failed with %i\n", b->idx, rc);
+				break;
+			}
+			if (!uuid_is_null(key)) {
+				mark_unwritten(fcb, b->idx, b->idx + 1);
+			}
+			fcb->blocks -= had;
+		}
+		else if ((uuid_is_null(key) && (rc = bmap(fcb, mc, b->idx, 1, &key)) != 0) ||
+			(rc = store_block(&key, b->data, b->used)) != 0) {
+			log_error("flush_blocks: storing block %llu failed with %i\n", b->idx, rc);
+			break;
+		}
+		else {
+			fcb->blocks += !had;
+		}
+		free(b->data);
+	}
+	memmove(mc->dirty, &(mc->dirty[i]), (mc->ndirty - i) * sizeof(mybuf));
+	mc->ndirty -= i;
+	return rc;
+}
+
+//Delete every block of a file from index first on. The caller stores the fcb.
+int free_blocks(myfcb *fcb, mymap *mc, unsigned long long first) {
+	int rc;
+	unsigned long long base = MY_MAX_DIRECT, span = 1;
+
+	if (mc != NULL) {
+		buf_drop(mc, first, ULLONG_MAX);
+		ra_drop(mc);
+	}
+	if (first <= fcb->unwritten_first) {
+		fcb->unwritten_first = fcb->unwritten_end = 0;	//no key is left past first
+	}
+	else if (first < fcb->unwritten_end) {
+		fcb->unwritten_end = first;
+	}
+	if (fcb->layout == MY_LAYOUT_EXTENTS) {
+		return extent_free(fcb, mc, first);
+	}
+	if (fcb->layout == MY_LAYOUT_INLINE) {
+		if (first * the_super.block_size < MY_INLINE_DATA) {
+			memset(fcb->data + first * the_super.block_size, 0, MY_INLINE_DATA - first * the_super.block_size);
+		}
+		return 0;
+	}
+	if (mc != NULL) {
+		memset(mc->ind_key, 0, sizeof(mc->ind_key));	//the indirect blocks are about to change
+	}
+	for (unsigned long long i = first; i < MY_MAX_DIRECT; i++) {
+		if ((rc = free_tree(&(fcb->direct[i]), 0, 0, 1, &(fcb->blocks))) != 0) {
+			return rc;
+		}
+	}
+	for (int depth = 1; depth <= 3; depth++) {
+		span *= MY_MAX_INDIRECT;
+		if (first < base + span &&
+			(rc = free_tree(bmap_root(fcb, depth), depth, first > base ? first - base : 0, span, &(fcb->blocks))) != 0) {
+			return rc;
+		}
+		base += span;
+	}
+	return 0;
+}
+
+//Readahead. A sequential reader whose reads are not made of whole blocks has the blocks ahead of
+//it fetched into the map cache a window at a time, so that each block is fetched once instead of
+//once for every read which touches a part of it. Any change to the data throws the window away.
+
+//Block idx as read ahead, NULL if it is not held
+char *ra_lookup(mymap *mc, unsigned long long idx) {
+	if (idx < mc->ra_first || idx - mc->ra_first >= mc->ra_count) {
+		return NULL;
+	}
+	return mc->ra + (idx - mc->ra_first) * the_super.block_size;
+}
+
+//Make sure the blocks from offset to offset + size are held, reading window bytes past them
+//ahead. Nothing is fetched while the last block wanted is still in the window, and a refill keeps
+//the blocks of the old window it still wants, fetching only those past its end.
+int ra_fill(myfcb *fcb, mymap *mc, off_t offset, size_t size, size_t window) {
+	int rc;
+	size_t bs = the_super.block_size;
+	unsigned long long first = offset / bs;
+	unsigned long long last = (offset + size + window - 1) / bs;
+	uuid_t key;
+
+	if (fcb->layout == MY_LAYOUT_INLINE || offset >= fcb->size || ra_lookup(mc, (offset + size - 1) / bs) != NULL) {
+		return 0;
+	}
+	if (last > (fcb->size - 1) / bs) {
+		last = (fcb->size - 1) / bs;
+	}
+	unsigned int count = last - first + 1;
+	if (count > mc->ra_room) {
+		char *grown = realloc(mc->ra, (size_t) count * bs);
+		if (grown == NULL) {
+			return -ENOMEM;
+		}
+		mc->ra = grown;
+		mc->ra_room = count;
+	}
+	unsigned int kept = 0;
+	if (first >= mc->ra_first && first - mc->ra_first < mc->ra_count) {
+		kept = mc->ra_first + mc->ra_count - first;
+		if (kept > count) {
+			kept = count;
+		}
+		memmove(mc->ra, mc->ra + (size_t) (first - mc->ra_first) * bs, (size_t) kept * bs);
+	}
+	mc->ra_first = first;
+	for (mc->ra_count = kept; mc->ra_count < count; mc->ra_count++) {
+		char *data = mc->ra + (size_t) mc->ra_count * bs;
+		mybuf *b = buf_lookup(mc, first + mc->ra_count);
+		if (b != NULL) {
+			memcpy(data, b->data, bs);	//Still current once the dirty block is stored
+		}
+		else if ((rc = bmap(fcb, mc, first + mc->ra_count, 0, &key)) != 0) {
+			return rc;
+		}
+		else if (uuid_is_null(key)) {
+			memset(data, 0, bs);
+		}
+		else if ((rc = fetch_block(&key, data)) != 0) {
+			return rc;
+		}
+	}
+	return 0;
+}
+
+//Read up to size bytes at offset, returns the number of bytes read. Blocks covered completely are
+//fetched straight into buf, only the partial blocks at either end go through a bounce buffer.
+int read_blocks(myfcb *fcb, mymap *mc, char *buf, size_t size, off_t offset) {
+	int rc;
+	size_t done = 0, bs = the_super.block_size;
+	char *bounce = NULL;
+	uuid_t key;
+
+	if (offset >= fcb->size) {
+		return 0;
+	}
+	if (offset + size > fcb->size) {
+		size = fcb->size - offset;
+	}
+	if (fcb->layout == MY_LAYOUT_INLINE) {
+		memcpy(buf, fcb->data + offset, size);
+		return size;
+	}
+	while (done < size) {
+		unsigned long long idx = (offset + done) / bs;
+		size_t boff = (offset + done) % bs;
+		size_t n = bs - boff < size - done ? bs - boff : size - done;
+		mybuf *b = mc == NULL ? NULL : buf_lookup(mc, idx);
+		char *ra = mc == NULL ? NULL : ra_lookup(mc, idx);
+
+		if (b != NULL) {
+			memcpy(buf + done, b->data + boff, n);
+		}
+		else if (ra != NULL) {
+			memcpy(buf + done, ra + boff, n);
+		}
+		else if ((rc = bmap(fcb, mc, idx, 0, &key)) != 0) {
+			break;
+		}
+		else if (uuid_is_null(key)) {
+			memset(buf + done, 0, n);
+		}
+		else if (n == bs) {
+			if ((rc = fetch_block(&key, buf + done)) != 0) {
+				break;
+			}
+		}
+		else {
+			if (bounce == NULL && (bounce = malloc(bs)) == NULL) {
+				rc = -ENOMEM;
+				break;
+			}
+			if ((rc = fetch_block(&key, bounce)) != 0) {
+				break;
+			}
+			memcpy(buf + done, bounce + boff, n);
+		}
+		done += n;
+	}
+	free(bounce);
+	if (done < size) {
+		log_error("read_blocks: failed with %i\n", rc);
+		return done > 0 ? done : (rc < 0 ? rc : -EIO);
+	}
+	return size;
+}
+
+//Copy the next n bytes of src to dst, src moving on past them. The data may be in memory or in a
+//pipe fuse spliced the request into, which is read straight into dst.
+int bufvec_take(struct fuse_bufvec *src, char *dst, size_t n) {
+	struct fuse_bufvec d = FUSE_BUFVEC_INIT(n);
+	ssize_t got;
+	d.buf[0].mem = dst;
+	if ((got = fuse_buf_copy(&d, src, 0)) != (ssize_t) n) {
+		return got < 0 ? (int) got : -EIO;
+	}
+	return 0;
+}
+
+//Inline data. A regular file starts out with its data in the fcb, so that a small file costs one
+//record. The first write or truncate that takes it past MY_INLINE_DATA bytes moves the data out
+//to block 0 and gives the file the layout of the filesystem.
+
+//Move the inline data of a file out to its first block. The caller stores the fcb.
+int inline_promote(myfcb *fcb) {
+	int rc;
+	myfcb old = *fcb;
+	uuid_t key;
+
+	memset(fcb->data, 0, MY_INLINE_DATA);
+	fcb->layout = myfs_options.extents ? MY_LAYOUT_EXTENTS : MY_LAYOUT_BLOCKS;
+	if (old.size == 0) {
+		return 0;
+	}
+	if ((rc = bmap(fcb, NULL, 0, 1, &key)) != 0 || (rc = store_block(&key, old.data, old.size)) != 0) {
+		log_error("inline_promote: storing the data failed with %i\n", rc);
+		*fcb = old;
+		return rc;
+	}
+	fcb->blocks = 1;
+	return 0;
+}
+
+//Write the data of src at offset, allocating blocks as needed, returns the number of bytes
+//written. A partial block is read, modified and written back. With a map cache the data is only
+//copied into its dirty buffers, which are stored once they reach MY_DIRTY_LIMIT or the inode is
+//written back. The caller stores the fcb.
+int write_blocks(myfcb *fcb, mymap *mc, struct fuse_bufvec *src, off_t offset) {
+	int rc = 0;
+	size_t done = 0, bs = the_super.block_size;
+	size_t size = fuse_buf_size(src);
+	char *bounce = NULL;
+	uuid_t key;
+
+	if (mc != NULL) {
+		ra_drop(mc);
+	}
+	if (fcb->layout == MY_LAYOUT_INLINE) {
+		if (offset + size <= MY_INLINE_DATA) {
+			if ((rc = bufvec_take(src, fcb->data + offset, size)) != 0) {
+				log_error("write_blocks: failed with %i\n", rc);
+				return rc;
+			}
+			if (offset + size > fcb->size) {
+				fcb->size = offset + size;
+			}
+			return size;
+		}
+		if ((rc = inline_promote(fcb)) != 0) {
+			return rc;
+		}
+	}
+	while (done < size) {
+		unsigned long long idx = (offset + done) / bs;
+		size_t boff = (offset + done) % bs;
+		size_t n = bs - boff < size - done ? bs - boff : size - done;
+		off_t start = (off_t) idx * bs;
+		size_t used = fcb->size <= start ? 0 : (fcb->size - start < bs ? fcb->size - start : bs);
+
+		if (mc != NULL) {
+			mybuf *b;
+			if ((rc = buf_get(fcb, mc, idx, used, boff == 0 && used <= n, &b)) != 0 ||
+				(rc = bufvec_take(src, b->data + boff, n)) != 0) {
+				break;
+			}
+			if (boff + n > b->used) {
+				b->used = boff + n;
+			}
+		}
+		else if ((rc = bmap(fcb, mc, idx, 0, &key)) != 0) {
+			break;
+		}
+		else {
+			int had = !uuid_is_null(key) && block_recorded(fcb, idx, &key);
+			if (uuid_is_null(key) && (rc = bmap(fcb, mc, idx, 1, &key)) != 0) {
+				break;
+			}
+			if (bounce == NULL && (bounce = malloc(bs)) == NULL) {
+				rc = -ENOMEM;
+				break;
+			}
+			//a block whose old contents are all overwritten is not read first
+			if (!(boff == 0 && used <= n) && (rc = fetch_block(&key, bounce)) != 0) {
+				break;
+			}
+			if ((rc = bufvec_take(src, bounce + boff, n)) != 0) {
+				break;
+			}
+			if ((rc = store_block(&key, bounce, boff + n > used ? boff + n : used)) == 0) {
+				fcb->blocks += !had;
+			}
+		}
+		if (rc != 0) {
+			break;
+		}
+		done += n;
+		if (offset + done > fcb->size) {
+			fcb->size = offset + done;
+		}
+		if (mc != NULL && (size_t) mc->ndirty * bs >= MY_DIRTY_LIMIT && (rc = flush_blocks(fcb, mc)) != 0) {
+			break;
+		}
+	}
+	free(bounce);
+	if (done < size) {
+		log_error("write_blocks: failed with %i\n", rc);
+		return done > 0 ? done : (rc < 0 ? rc : -EIO);
+	}
+	return size;
+}
+
+//Change the size of a file. Blocks past the new end are deleted and the last block is cut short,
+//so that the file reads as zeros if it grows again. Growing only changes the size. The caller
+//stores the fcb.
+int truncate_blocks(myfcb *fcb, mymap *mc, off_t newsize) {
+	int rc;
+	size_t bs = the_super.block_size;
+	uuid_t key;
+
+	if (fcb->layout == MY_LAYOUT_INLINE) {
+		if (newsize <= MY_INLINE_DATA) {
+			if (newsize < fcb->size) {
+				memset(fcb->data + newsize, 0, fcb->size - newsize);
+			}
+			fcb->size = newsize;
+			return 0;
+		}
+		if ((rc = inline_promote(fcb)) != 0) {
+			return rc;
+		}
+	}
+	if (newsize < fcb->size) {
+		if ((rc = free_blocks(fcb, mc, (newsize + bs - 1) / bs)) != 0) {
+			return rc;
+		}
+		if (newsize % bs != 0) {
+			char *bounce;
+			mybuf *b = mc == NULL ? NULL : buf_lookup(mc, newsize / bs);
+			if (b != NULL) {
+				memset(b->data + newsize % bs, 0, bs - newsize % bs);
+				if (b->used > newsize % bs) {
+					b->used = newsize % bs;
+				}
+			}
+			if ((rc = bmap(fcb, mc, newsize / bs, 0, &key)) != 0) {
+				return rc;
+			}
+			if (!uuid_is_null(key)) {
+				int had = block_recorded(fcb, newsize / bs, &key);
+				if ((bounce = malloc(bs)) == NULL) {
+					return -ENOMEM;
+				}
+				if ((rc = fetch_block(&key, bounce)) == 0 && (rc = store_block(&key, bounce, newsize % bs)) == 0) {
+					fcb->blocks += !had;
+				}
+				free(bounce);
+				if (rc != 0) {
+					return rc;
+				}
+			}
+		}
+	}
+	fcb->size = newsize;
+	return 0;
+}
+
+//Preallocation. fallocate gives the blocks of a range keys ahead of the writes to come, without
+//storing anything under them, so they read as zeros until written and a write into them finds
+//its block already mapped. With the extent layout each hole in the range becomes one extent.
+//Punching a hole deletes the block records of the range and leaves their keys reserved.
+
+//Give the blocks from first to end - 1 keys. The caller stores the fcb.
+int reserve_blocks(myfcb *fcb, mymap *mc, unsigned long long first, unsigned long long end) {
+	int rc;
+	uuid_t key;
+
+	mark_unwritten(fcb, first, end);
+	if (fcb->layout == MY_LAYOUT_EXTENTS) {
+		return extent_reserve(fcb, mc, first, end);
+	}
+	for (unsigned long long idx = first; idx < end; idx++) {
+		if ((rc = bmap(fcb, mc, idx, 1, &key)) != 0) {
+			return rc;
+		}
+	}
+	return 0;
+}
+
+//Zero n bytes at boff in block idx, which the file holds data in
+int zero_in_block(myfcb *fcb, mymap *mc, unsigned long long idx, size_t boff, size_t n) {
+	int rc;
+	size_t bs = the_super.block_size;
+	off_t start = (off_t) idx * bs;
+	size_t used = fcb->size - start < bs ? fcb->size - start : bs;
+	mybuf *b = mc == NULL ? NULL : buf_lookup(mc, idx);
+	char *bounce;
+	uuid_t key;
+
+	if (b != NULL) {
+		memset(b->data + boff, 0, n);	//The dirty block is all there is to it until it is stored
+		return 0;
+	}
+	if ((rc = bmap(fcb, mc, idx, 0, &key)) != 0 || uuid_is_null(key)) {
+		return rc;
+	}
+	int had = block_recorded(fcb, idx, &key);
+	if ((bounce = malloc(bs)) == NULL) {
+		return -ENOMEM;
+	}
+	if ((rc = fetch_block(&key, bounce)) == 0) {
+		memset(bounce + boff, 0, n);
+		if ((rc = store_block(&key, bounce, used)) == 0) {
+			fcb->blocks += !had;
+		}
+	}
+	free(bounce);
+	return rc;
+}
+
+//Delete the records of blocks first to end - 1, keeping their keys
+int forget_blocks(myfcb *fcb, mymap *mc, unsigned long long first, unsigned long long end) {
+	int rc = 0;
+	uuid_t key;
+
+	for (unsigned long long idx = first; idx < end; idx++) {
+		if ((rc = bmap(fcb, mc, idx, 0, &key)) != 0) {
+			return rc;
+		}
+		if (uuid_is_null(key)) {
+			continue;
+		}
+		int had = block_recorded(fcb, idx, &key);
+		if ((rc = delete_block(&key)) != 0) {
+			return rc;
+		}
+		fcb->blocks -= had;
+		mark_unwritten(fcb, idx, idx + 1);
+	}
+	return 0;
+}
+
+//Make the bytes from offset to end read as zeros, freeing the blocks they cover whole. Nothing
+//past the end of the file has data to free.
+int punch_blocks(myfcb *fcb, mymap *mc, off_t offset, off_t end) {
+	int rc;
+	size_t bs = the_super.block_size;
+
+	if (end > fcb->size) {
+		end = fcb->size;
+	}
+	if (offset >= end) {
+		return 0;
+	}
+	if (fcb->layout == MY_LAYOUT_INLINE) {
+		memset(fcb->data + offset, 0, end - offset);
+		return 0;
+	}
+	if (mc != NULL) {
+		ra_drop(mc);
+	}
+	//The partial blocks at either end, unless the last one ends the file and goes whole
+	unsigned long long first = (offset + bs - 1) / bs;
+	unsigned long long last = end == fcb->size ? (end + bs - 1) / bs : end / bs;
+	if (offset % bs != 0) {
+		size_t n = bs - offset % bs < (size_t) (end - offset) ? bs - offset % bs : (size_t) (end - offset);
+		if ((rc = zero_in_block(fcb, mc, offset / bs, offset % bs, n)) != 0) {
+			return rc;
+		}
+	}
+	if (last < first) {
+		return 0;	//All within one block
+	}
+	if (end % bs != 0 && last == end / bs && (rc = zero_in_block(fcb, mc, last, 0, end % bs)) != 0) {
+		return rc;
+	}
+	if (mc != NULL) {
+		buf_drop(mc, first, last);
+	}
+	return forget_blocks(fcb, mc, first, last);
+}
+
+//fallocate on the data of a file: reserve the blocks of the range, growing the file to cover it
+//unless FALLOC_FL_KEEP_SIZE is given, or with FALLOC_FL_PUNCH_HOLE free them. The caller stores
+//the fcb.
+int fallocate_blocks(myfcb *fcb, mymap *mc, int mode, off_t offset, off_t length) {
+	int rc;
+	size_t bs = the_super.block_size;
+	off_t end = offset + length;
+
+	if (offset < 0 || length <= 0) {
+		return -EINVAL;
+	}
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) {
+		return -EOPNOTSUPP;
+	}
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		return mode & FALLOC_FL_KEEP_SIZE ? punch_blocks(fcb, mc, offset, end) : -EOPNOTSUPP;
+	}
+	if (end > max_file_size()) {
+		return -EFBIG;
+	}
+	if (fcb->layout == MY_LAYOUT_INLINE && end > MY_INLINE_DATA && (rc = inline_promote(fcb)) != 0) {
+		return rc;
+	}
+	if (fcb->layout != MY_LAYOUT_INLINE && (rc = reserve_blocks(fcb, mc, offset / bs, (end + bs - 1) / bs)) != 0) {
+		return rc;
+	}
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > fcb->size) {
+		fcb->size = end;
+	}
+	return 0;
+}
+
+//Holes. A block with no key reads as zeros and takes no space, and flush_blocks gives a block of
+//zeros none. A block with a key holds data unless it lies in the unwritten range of the fcb,
+//where fallocate reserves keys and punching a hole or storing zeros leaves them, so seeking for
+//data or holes walks the block map once and only looks for records inside that range.
+
+//First block from *idx on in the tree under key, which covers span blocks at the given depth (0
+//is a data block), which has a key if mapped is set or has none if it is not; ULLONG_MAX if there
+//is none. Null subtrees are taken or skipped whole.
+int tree_find(uuid_t *key, int depth, unsigned long long span, unsigned long long *idx, int mapped) {
+	int rc;
+	ind blk;
+
+	if (uuid_is_null(*key) || depth == 0) {
+		if (uuid_is_null(*key) == mapped) {
+			*idx = ULLONG_MAX;
+		}
+		return 0;
+	}
+	if ((rc = fetch_ind(key, &blk)) != 0) {
+		log_error("tree_find: fetch_ind failed with %i\n", rc);
+		return rc;
+	}
+	unsigned long long child = span / MY_MAX_INDIRECT;
+	for (unsigned long long i = *idx / child; i < MY_MAX_INDIRECT; i++) {
+		unsigned long long start = i * child, sub = *idx > start ? *idx - start : 0;
+		if ((rc = tree_find(&(blk.indirect[i]), depth - 1, child, &sub, mapped)) != 0) {
+			return rc;
+		}
+		if (sub != ULLONG_MAX) {
+			*idx = start + sub;
+			return 0;
+		}
+	}
+	*idx = ULLONG_MAX;
+	return 0;
+}
+
+//First block from *idx on which has a key if mapped is set, or has none if it is not; ULLONG_MAX
+//if there is none. Dirty buffers are not looked at.
+int next_block(myfcb *fcb, mymap *mc, unsigned long long *idx, int mapped) {
+	int rc, i;
+	unsigned long long next = ULLONG_MAX, base = MY_MAX_DIRECT, span = 1;
+
+	if (fcb->layout == MY_LAYOUT_EXTENTS) {
+		myextent *ext;
+		unsigned int count;
+		if ((rc = load_extents(fcb, mc, &ext, &count)) != 0) {
+			return rc;
+		}
+		next = *idx;
+		i = extent_find(ext, count, next);
+		if (mapped && (i < 0 || next >= ext[i].block + ext[i].count)) {
+			next = i + 1 < (int) count ? ext[i + 1].block : ULLONG_MAX;
+		}
+		//Runs of extents may follow on from each other
+		for (; !mapped && i >= 0 && i < (int) count && next >= ext[i].block && next < ext[i].block + ext[i].count; i++) {
+			next = ext[i].block + ext[i].count;
+		}
+		release_extents(fcb, mc, ext, 1);
+		*idx = next;
+		return 0;
+	}
+	for (unsigned long long b = *idx; b < MY_MAX_DIRECT && next == ULLONG_MAX; b++) {
+		if (uuid_is_null(fcb->direct[b]) != mapped) {
+			next = b;
+		}
+	}
+	for (int depth = 1; depth <= 3 && next == ULLONG_MAX; depth++) {
+		span *= MY_MAX_INDIRECT;
+		if (*idx < base + span) {
+			unsigned long long sub = *idx > base ? *idx - base : 0;
+			if ((rc = tree_find(bmap_root(fcb, depth), depth, span, &sub, mapped)) != 0) {
+				return rc;
+			}
+			if (sub != ULLONG_MAX) {
+				next = base + sub;
+			}
+		}
+		base += span;
+	}
+	*idx = next;
+	return 0;
+}
+
+//Whether block idx holds data, in has: a dirty buffer which is not all zeros, or a key with a
+//record under it. Only a key in the unwritten range needs its record looked for.
+int block_has_data(myfcb *fcb, mymap *mc, unsigned long long idx, int *has) {
+	int rc;
+	uuid_t key;
+	mybuf *b = mc == NULL ? NULL : buf_lookup(mc, idx);
+
+	if (b != NULL) {
+		*has = !block_is_zero(b->data, b->used);
+		return 0;
+	}
+	if ((rc = bmap(fcb, mc, idx, 0, &key)) != 0) {
+		return rc;
+	}
+	*has = !uuid_is_null(key) && (idx < fcb->unwritten_first || idx >= fcb->unwritten_end || block_stored(&key));
+	return 0;
+}
+
+//First block from idx on which holds data, ULLONG_MAX if there is none
+int seek_data_block(myfcb *fcb, mymap *mc, unsigned long long idx, unsigned long long *out) {
+	int rc, has;
+	unsigned long long next;
+	unsigned int d = mc == NULL ? 0 : buf_find(mc, idx);
+
+	for (;;) {
+		next = idx;
+		if ((rc = next_block(fcb, mc, &next, 1)) != 0) {
+			return rc;
+		}
+		//A dirty buffer ahead of the next key may be data, and a buffer of zeros is not
+		for (; mc != NULL && d < mc->ndirty && mc->dirty[d].idx < next; d++) {
+			if (mc->dirty[d].idx >= idx && !block_is_zero(mc->dirty[d].data, mc->dirty[d].used)) {
+				*out = mc->dirty[d].idx;
+				return 0;
+			}
+		}
+		if (next == ULLONG_MAX) {
+			*out = ULLONG_MAX;
+			return 0;
+		}
+		if ((rc = block_has_data(fcb, mc, next, &has)) != 0) {
+			return rc;
+		}
+		if (has) {
+			*out = next;
+			return 0;
+		}
+		//A reserved or punched key: the unwritten range is looked through a key at a time
+		idx = next + 1;
+		if (mc != NULL) {
+			d = buf_find(mc, idx);
+		}
+	}
+}
+
+//First block from idx on which holds no data: past the end of the run of keys and dirty buffers
+//starting at idx, unless the run has a buffer of zeros or a key with no record in it
+int seek_hole_block(myfcb *fcb, mymap *mc, unsigned long long idx, unsigned long long *out) {
+	int rc, has;
+	unsigned long long end = idx;
+	unsigned int d = mc == NULL ? 0 : buf_find(mc, idx);
+
+	//The end of the run: the first block with neither a key nor a dirty buffer
+	for (;;) {
+		if ((rc = next_block(fcb, mc, &end, 0)) != 0) {
+			return rc;
+		}
+		for (; mc != NULL && d < mc->ndirty && mc->dirty[d].idx < end; d++);
+		if (mc == NULL || d >= mc->ndirty || mc->dirty[d].idx != end) {
+			break;
+		}
+		for (; d + 1 < mc->ndirty && mc->dirty[d + 1].idx == mc->dirty[d].idx + 1; d++);
+		end = mc->dirty[d].idx + 1;
+	}
+	//Holes within the run: buffers of zeros, and keys without records in the unwritten range
+	if (mc != NULL) {
+		for (d = buf_find(mc, idx); d < mc->ndirty && mc->dirty[d].idx < end; d++) {
+			if (block_is_zero(mc->dirty[d].data, mc->dirty[d].used)) {
+				end = mc->dirty[d].idx;
+				break;
+			}
+		}
+	}
+	unsigned long long b = idx > fcb->unwritten_first ? idx : fcb->unwritten_first;
+	for (; b < end && b < fcb->unwritten_end; b++) {
+		if ((rc = block_has_data(fcb, mc, b, &has)) != 0) {
+			return rc;
+		}
+		if (!has) {
+			end = b;
+		}
+	}
+	*out = end;
+	return 0;
+}
+
+//lseek with SEEK_DATA or SEEK_HOLE on the data of a file: the offset of the first byte from
+//offset on that is data, or that is in a hole. The end of the file counts as a hole.
+off_t seek_blocks(myfcb *fcb, mymap *mc, off_t offset, int whence) {
+	int rc;
+	size_t bs = the_super.block_size;
+	unsigned long long idx, nblocks = (fcb->size + bs - 1) / bs;
+
+	if (offset < 0 || offset >= fcb->size) {
+		return -ENXIO;
+	}
+	if (fcb->layout == MY_LAYOUT_INLINE) {
+		return whence == SEEK_DATA ? offset : fcb->size;
+	}
+	rc = whence == SEEK_DATA ? seek_data_block(fcb, mc, offset / bs, &idx) : seek_hole_block(fcb, mc, offset / bs, &idx);
+	if (rc != 0) {
+		return rc;
+	}
+	if (idx >= nblocks) {
+		return whence == SEEK_DATA ? -ENXIO : fcb->size;
+	}
+	return (off_t) (idx * bs) > offset ? (off_t) (idx * bs) : offset;
+}
+
+//Drop the pin of a handle being closed. The last handle of a file deleted while open frees the
+//blocks written through it since; otherwise the map cache goes once its dirty blocks are stored,
+//so a file which is not open never has data held back from the store. The cache lock is only
+//held to drop the pin: an inode with a map is never evicted and a detached one is out of the
+//cache, so neither goes away during the store calls. The caller holds the inode lock.
+void icache_close(myinode *n) {
+	int rc;
+	pthread_mutex_lock(&icache_lock);
+	int last = --n->refs == 0;
+	pthread_mutex_unlock(&icache_lock);
+	if (!last) {
+		return;
+	}
+	if (n->detached) {
+		if ((rc = free_blocks(&(n->fcb), n->map, 0)) != 0) {
+			log_error("icache_close: free_blocks failed with %i\n", rc);
+		}
+		if (!node_held(n->id)) {
+			id_free(n->id);
+		}
+		icache_free(n);
+	}
+	else if (inode_write_back(n) == 0) {
+		pthread_mutex_lock(&icache_lock);
+		map_free(n->map);
+		n->map = NULL;
+		pthread_mutex_unlock(&icache_lock);
+	}
+	orphan_kick();
+}
+
+//Delete an fcb along with whatever data it has left. The caller holds its lock.
+int delete_fcb(uuid_t id, myfcb *fcb) {
+	int rc;
+
+	//delete all data blocks, with the indirect blocks leading to them
+	if ((rc = free_blocks(fcb, icache_map(id), 0)) != 0) {
+		log_error("deletion: delete file failed.");
+		return rc;
+	}
+
+	//delete the (empty) buckets of a directory
+	if (S_ISDIR(fcb->mode)) {
+		for (unsigned int i = 0; i < dir_buckets(fcb); i++) {
+			if ((rc = store_bucket(id, i, NULL, 0)) != 0) {
+				log_error("deletion: delete bucket failed with %i\n", rc);
+				return rc;
+			}
+		}
+	}
+
+	//delete fcb, which may never have been written back. A handle still open on it is left with
+	//the emptied block map, and the id is only freed with the last handle. Nor is it freed while
+	//the kernel knows an inode number by it, which would then find another file.
+	store_fcb((uuid_t *) id, fcb);
+	int open = icache_forget(id);
+	if ((rc = kv_delete(id, key_size(id))) != 0 && rc != UNQLITE_NOTFOUND) {
+		log_error("deletion: delete entrance failed.");
+		return rc;
+	}
+	if (!open && !node_held(id)) {
+		id_free(id);
+	}
+	return 0;
+}
+
+//functions on delete. id is the fcb id of the entry, which the caller removes from its directory.
+//A file with blocks goes on the orphan list for the reclaimer to delete, so that the caller does
+//not wait for its data to be freed; anything else is deleted at once.
+int deletion(uuid_t id) {
+	int rc;
+	myfcb fcb;
+
+	if ((rc = fetch_fcb((uuid_t *) id, &fcb)) != 0) {
+		log_error("deletion: fetch fcb failed with %i\n", rc);
+		return rc;
+	}
+	if (S_ISREG(fcb.mode) && fcb.layout != MY_LAYOUT_INLINE) {
+		return orphan_add(id);
+	}
+	return delete_fcb(id, &fcb);
+}
+
+//Link count of an fcb. Those written before links were counted have none stored.
+nlink_t fcb_links(myfcb *fcb) {
+	if (fcb->nlink == 0) {
+		return S_ISDIR(fcb->mode) ? 2 : 1;
+	}
+	return fcb->nlink;
+}
+
+//Drop a link to the fcb id, deleting it along with its last one. A directory only ever has one.
+//The caller holds its lock.
+int drop_link(uuid_t id, myfcb *fcb) {
+	if (!S_ISDIR(fcb->mode) && fcb_links(fcb) > 1) {
+		fcb->nlink = fcb_links(fcb) - 1;
+		fcb->ctime = time(NULL);
+		return store_fcb((uuid_t *) id, fcb);
+	}
+	return deletion(id);
+}
+
+//A subdirectory of dir went away, taking its ".." link with it
+void drop_subdir_link(myfcb *dirfcb) {
+	if (fcb_links(dirfcb) > 2) {
+		dirfcb->nlink = fcb_links(dirfcb) - 1;
+	}
+}
+
+//Functions on entrance finding
+//Look name up in the directory dir, replacing fcb (the directory) with the fcb of the entrance
+int find_entrance_with_name(char* path, uuid_t dir, myfcb *fcb, myent *ent) {
+	int rc;
+	if (!S_ISDIR(fcb->mode)) {
+		return -ENOTDIR;
+	}
+	if ((rc = dir_lookup(dir, fcb, path, ent)) != 0) {
+		if (rc != -ENOENT) {
+			log_error("find_path_with_name: dir_lookup failed with %i\n", rc);
+		}
+		return rc;
+	}
+	if((rc = fetch_fcb(&(ent->fcb_id), fcb)) != 0) {
+		log_error("find_entrance_with_name: file control block fetch failed with %i\n", rc);
+		return rc;
+	}
+	return 0;
+}
+
+//Look name up in the directory parent, replacing fcb with the fcb of the entrance. The dentry
+//cache is tried first and the store is only scanned on a miss, with the directory locked for
+//reading so that the result cached is not overtaken by a change to it.
+int lookup_name(uuid_t parent, const char *name, myfcb *fcb, myent *ent) {
+	int negative;
+	int rc;
+
+	if (dcache_get(parent, name, ent, &negative)) {
+		if (negative) {
+			return -ENOENT;
+		}
+		if (fetch_fcb(&(ent->fcb_id), fcb) == 0) {
+			return 0;
+		}
+		//Deleted since it was cached, look again with the directory locked
+	}
+	lock_inode(parent, 0);
+	if ((rc = fetch_fcb((uuid_t *) parent, fcb)) != 0) {
+		log_error("lookup_component: fetch_fcb of the directory failed with code %i\n", rc);
+		rc = -ENOENT;
+	}
+	else if ((rc = find_entrance_with_name((char *) name, parent, fcb, ent)) == 0) {
+		dcache_insert(parent, name, ent);
+	}
+	else if (rc == -ENOENT) {
+		dcache_insert(parent, name, NULL);
+	}
+	unlock_inode(parent);
+	return rc;
+}
+
+//lookup_name, timed into the lookup phase of the operation
+int lookup_component(uuid_t parent, const char *name, myfcb *fcb, myent *ent) {
+	uint64_t start = now_ns();
+	int rc = lookup_name(parent, name, fcb, ent);
+	op_phase_add(MY_PHASE_LOOKUP, start);
+	return rc;
+}
+
+//Find entrance does works for find the entrance of fcb required and return the fcb and the entrance node
+//Each component is looked up in the dentry cache first and only scanned for in the store on a miss.
+int find_entrance(const char *path, myfcb* fcb, myent *ent) {
+	char* s_path = strdup(path); 		//Copy path itself to prevent interrupt const value
+	char* save;
+	char* token = strtok_r(s_path, "/", &save);  //Divide the path into tokens, strtok is not thread safe
+	uuid_t parent;
+	int rc = fetch_fcb(&zero_uuid, fcb);
+
+	uuid_clear(parent);
+	while (token != NULL) {
+		if ((rc = lookup_component(parent, token, fcb, ent)) != 0) {
+			write_log("find_entrance: find entrance with name failed with code %i\n", rc);
+			break;
+		}
+		// write_log("find_ent: %s - expect %s\n", ent->name, token);
+		uuid_copy(parent, ent->fcb_id);
+		token = strtok_r(NULL, "/", &save);
+	}
+	free(s_path);
+	return rc;
+}
+
+//functions on creative
+//Split path into its directory and last component. Both point into the copy returned, which the
+//caller frees; NULL if there is no memory for it.
+char *get_path_filename(const char *path, char ** file, char ** directory) {
+	char *pathdup = strdup(path);
+	if (pathdup == NULL) {
+		return NULL;
+	}
+	char *last = strrchr(pathdup, '/');
+	*last = '\0';
+	*file = last + 1;
+	if (last == pathdup) {
+		*directory = "/";
+	}
+	else {
+		*directory = pathdup;  //<= changed
+	}
+	return pathdup;
+}
+
+//This will create a fcb and a ent and generate a new uuid. Write back should be done outside the function
+int create_fcb_with_ent(mode_t mode, uid_t uid, gid_t gid, const char* name, myfcb *newFCB, myent* newENT) {
+	memset(newFCB, 0, sizeof(myfcb));			//Memory init
+	memset(newENT, 0, sizeof(myent));			//Memory init
+
+	//Set the information of new fcb
+	newFCB->uid = uid;
+	newFCB->gid = gid;
+	newFCB->mode = mode; 
+	newFCB->size = S_ISDIR(mode) ? sizeof(myfcb) : 0;
+	newFCB->nlink = S_ISDIR(mode) ? 2 : 1;		//A directory is also linked from its own "."
+	newFCB->layout = S_ISREG(mode) ? MY_LAYOUT_INLINE : MY_LAYOUT_BLOCKS;
+	time_t now = time(NULL);
+	newFCB->mtime=now;
+	newFCB->ctime=now;
+	//setup entrance
+	strcpy(newENT->name, name);
+	id_alloc(newENT->fcb_id);
+	if (the_super.flags & MY_SUPER_SEQIDS) {
+		newFCB->ino = key_hi(newENT->fcb_id);
+	}
+	return 0;
+}
+
+//Find the fcb at path and lock it for writing, returning its id (zero_uuid for the root). The fcb
+//is fetched again once the lock is held, so it is the current one. The caller unlocks id.
+int lock_path(const char *path, uuid_t id, myfcb *fcb) {
+	int rc;
+	myent ent;
+	uuid_clear(id);
+	if ((rc = find_entrance(path, fcb, &ent)) != 0) {
+		return rc;
+	}
+	if (strcmp(path, "/") != 0) {
+		uuid_copy(id, ent.fcb_id);
+	}
+	lock_inode(id, 1);
+	if (fetch_fcb((uuid_t *) id, fcb) != 0) {
+		unlock_inode(id);
+		return -ENOENT;		//Deleted before the lock was had
+	}
+	return 0;
+}
+
+//Find the directory at path, returning its fcb id (zero_uuid for the root) and its fcb
+int find_directory(const char *path, uuid_t dir, myfcb *dirfcb) {
+	int rc;
+	myent ent;
+	uuid_clear(dir);
+	if ((rc = find_entrance(path, dirfcb, &ent)) != 0) {
+		write_log("find_directory: find_entrance failed with %i\n", rc);
+		return rc;
+	}
+	if (strcmp(path, "/") != 0) {
+		uuid_copy(dir, ent.fcb_id);
+	}
+	if (!S_ISDIR(dirfcb->mode)) {
+		return -ENOTDIR;
+	}
+	return 0;
+}
+
+//Unlink name from the directory dir, deleting what it refers to with its last link. The caller
+//holds the locks of the directory and of id, the fcb it found under name; -EAGAIN if name refers
+//to another by now.
+int remove_in(uuid_t dir, myfcb *dirfcb, const char *filename, uuid_t id) {
+	int rc;
+	//Following will be used for storing the removed node
+	myfcb fcb;
+	myent ent;
+
+	if ((rc = dir_lookup(dir, dirfcb, filename, &ent)) != 0) {
+		write_log("remove_in: dir_lookup failed: %i\n", rc);
+		return rc;
+	}
+	if (uuid_compare(ent.fcb_id, id) != 0) {
+		return -EAGAIN;
+	}
+	if ((rc = fetch_fcb(&(ent.fcb_id), &fcb)) != 0) {
+		log_error("remove_in: fetch_fcb failed: %i\n", rc);
+		return rc;
+	}
+	if (S_ISDIR(fcb.mode) && fcb.dir_count != 0) {
+		return -ENOTEMPTY;
+	}
+	if ((rc = drop_link(ent.fcb_id, &fcb)) != 0) {
+		log_error("remove_in: drop_link failed with %i\n", rc);
+		return rc;
+	}
+	dcache_invalidate(dir, filename);
+	if (S_ISDIR(fcb.mode)) {
+		dcache_purge_parent(ent.fcb_id);
+		drop_subdir_link(dirfcb);
+	}
+	if ((rc = dir_remove(dir, dirfcb, filename)) != 0) {
+		log_error("remove_in: dir_remove failed with %i\n", rc);
+		return rc;
+	}
+	dirfcb->ctime = time(NULL);
+	dirfcb->mtime = time(NULL);
+	if ((rc = store_fcb((uuid_t *) dir, dirfcb)) != 0) {
+		log_error("remove_in: write_back failed with %i\n", rc);
+		return rc;
+	}
+	return 0;
+}
+
+//Unlink name from the directory dir. Both the directory and the fcb to delete are locked, which
+//takes looking the name up first; it is looked up again under the locks in case it changed.
+int remove_at(uuid_t dir, const char *name) {
+	int rc;
+	myfcb dirfcb;
+	myfcb fcb;
+	myent ent;
+
+	do {
+		if ((rc = lookup_component(dir, name, &fcb, &ent)) != 0) {
+			return rc;
+		}
+		lock_inode_pair(dir, ent.fcb_id);
+		if (fetch_fcb((uuid_t *) dir, &dirfcb) != 0) {
+			rc = -ENOENT;
+		}
+		else {
+			rc = remove_in(dir, &dirfcb, name, ent.fcb_id);
+		}
+		unlock_inode_pair(dir, ent.fcb_id);
+	} while (rc == -EAGAIN);
+	return rc;
+}
+
+//find the path, unlink the entrance
+//add to free list(Extension)
+int remove_node(char* filepath, char* filename) {
+	int rc;
+	myfcb dirfcb;
+	uuid_t dir;
+
+	if ((rc = find_directory(filepath, dir, &dirfcb)) != 0) {
+		write_log("remove_node: find_directory failed: %i\n", rc);
+		return rc;
+	}
+	return remove_at(dir, filename);
+}
+
+//Move the entry name in the directory from to newname in the directory to, replacing what is
+//there already. Only the entries change, whatever it refers to stays where it is. The caller
+//holds the locks of both directories, of id, the fcb found under name, and of target, the one
+//found under newname if there was one; -EAGAIN if either name refers to another by now. fromfcb
+//and tofcb are the same fcb when the directories are.
+int rename_in(uuid_t from, myfcb *fromfcb, const char *name, uuid_t to, myfcb *tofcb, const char *newname, uuid_t id, uuid_t target) {
+	int rc, replace;
+	myfcb fcb, tfcb;
+	myent ent, tent;
+
+	if (strlen(newname) >= MY_MAX_PATH) {
+		return -ENAMETOOLONG;
+	}
+	if (!S_ISDIR(tofcb->mode)) {
+		return -ENOTDIR;
+	}
+	if ((rc = dir_lookup(from, fromfcb, name, &ent)) != 0) {
+		return rc;
+	}
+	if ((rc = dir_lookup(to, tofcb, newname, &tent)) != 0 && rc != -ENOENT) {
+		log_error("rename_in: dir_lookup failed: %i\n", rc);
+		return rc;
+	}
+	replace = rc == 0;
+	if (uuid_compare(ent.fcb_id, id) != 0 || (replace ? uuid_compare(tent.fcb_id, target) != 0 : !uuid_is_null(target))) {
+		return -EAGAIN;
+	}
+	if (replace && uuid_compare(tent.fcb_id, id) == 0) {
+		return 0;	//Two links to the same file, rename(2) leaves both
+	}
+	if ((rc = fetch_fcb((uuid_t *) id, &fcb)) != 0) {
+		log_error("rename_in: fetch_fcb failed: %i\n", rc);
+		return rc;
+	}
+	if (replace) {
+		if ((rc = fetch_fcb((uuid_t *) target, &tfcb)) != 0) {
+			log_error("rename_in: fetch_fcb of the target failed: %i\n", rc);
+			return rc;
+		}
+		if (S_ISDIR(fcb.mode) && !S_ISDIR(tfcb.mode)) {
+			return -ENOTDIR;
+		}
+		if (!S_ISDIR(fcb.mode) && S_ISDIR(tfcb.mode)) {
+			return -EISDIR;
+		}
+		if (S_ISDIR(tfcb.mode) && tfcb.dir_count != 0) {
+			return -ENOTEMPTY;
+		}
+		if ((rc = drop_link(target, &tfcb)) != 0) {
+			log_error("rename_in: drop_link of the target failed with %i\n", rc);
+			return rc;
+		}
+		if (S_ISDIR(tfcb.mode)) {
+			dcache_purge_parent(target);
+			drop_subdir_link(tofcb);
+		}
+		if ((rc = dir_remove(to, tofcb, newname)) != 0) {
+			log_error("rename_in: dir_remove of the target failed with %i\n", rc);
+			return rc;
+		}
+	}
+	if ((rc = dir_add(to, tofcb, newname, id, fcb.mode)) != 0 || (rc = dir_remove(from, fromfcb, name)) != 0) {
+		log_error("rename_in: moving the entry failed with %i\n", rc);
+		return rc;
+	}
+	dcache_invalidate(from, name);
+	dcache_invalidate(to, newname);
+	if (S_ISDIR(fcb.mode) && fromfcb != tofcb) {
+		drop_subdir_link(fromfcb);
+		tofcb->nlink = fcb_links(tofcb) + 1;	//Its ".." now links the new parent
+	}
+	time_t now = time(NULL);
+	fromfcb->mtime = tofcb->mtime = now;
+	fromfcb->ctime = tofcb->ctime = now;
+	fcb.ctime = now;
+	if ((rc = store_fcb((uuid_t *) id, &fcb)) != 0 || (rc = store_fcb((uuid_t *) from, fromfcb)) != 0 ||
+		(fromfcb != tofcb && (rc = store_fcb((uuid_t *) to, tofcb)) != 0)) {
+		log_error("rename_in: store_fcb failed with %i\n", rc);
+		return rc;
+	}
+	return 0;
+}
+
+//Move name in the directory from to newname in the directory to. The directories and the fcbs
+//under both names are locked, which takes looking the names up first; they are looked up again
+//under the locks in case they changed. Moving a directory below itself is left to the caller to
+//rule out, the kernel does before either frontend is asked.
+int rename_at(uuid_t from, const char *name, uuid_t to, const char *newname) {
+	int rc, n;
+	myfcb fromfcb, tofcb, fcb;
+	myent ent;
+	uuid_t ids[MY_LOCK_SET];
+
+	do {
+		if ((rc = lookup_component(from, name, &fcb, &ent)) != 0) {
+			return rc;
+		}
+		uuid_copy(ids[0], from);
+		uuid_copy(ids[1], to);
+		uuid_copy(ids[2], ent.fcb_id);
+		if ((rc = lookup_component(to, newname, &fcb, &ent)) == 0) {
+			uuid_copy(ids[3], ent.fcb_id);
+		}
+		else if (rc == -ENOENT) {
+			uuid_clear(ids[3]);
+		}
+		else {
+			return rc;
+		}
+		n = uuid_is_null(ids[3]) ? 3 : 4;
+		lock_inodes(ids, n);
+		if (fetch_fcb(&(ids[0]), &fromfcb) != 0 || fetch_fcb(&(ids[1]), &tofcb) != 0) {
+			rc = -ENOENT;
+		}
+		else {
+			myfcb *dst = uuid_compare(from, to) == 0 ? &fromfcb : &tofcb;
+			rc = rename_in(from, &fromfcb, name, to, dst, newname, ids[2], ids[3]);
+		}
+		unlock_inodes(ids, n);
+	} while (rc == -EAGAIN);
+	return rc;
+}
+
+//Link the fcb id, which is not a directory, as name in the directory dir. The new entrance is
+//copied to newent unless it is NULL. The caller holds the locks of the directory and of id.
+int link_in(uuid_t dir, myfcb *dirfcb, const char *name, uuid_t id, myent *newent) {
+	int rc;
+	myfcb fcb;
+	myent ent;
+
+	if (strlen(name) >= MY_MAX_PATH) {
+		return -ENAMETOOLONG;
+	}
+	if (!S_ISDIR(dirfcb->mode)) {
+		return -ENOTDIR;
+	}
+	if (dir_lookup(dir, dirfcb, name, &ent) == 0) {
+		return -EEXIST;
+	}
+	if (fetch_fcb((uuid_t *) id, &fcb) != 0 || orphan_has(id)) {
+		return -ENOENT;		//Deleted, even if still open
+	}
+	if (S_ISDIR(fcb.mode)) {
+		return -EPERM;
+	}
+	fcb.nlink = fcb_links(&fcb) + 1;
+	fcb.ctime = time(NULL);
+	if ((rc = store_fcb((uuid_t *) id, &fcb)) != 0) {
+		log_error("link_in: store_fcb failed: %i\n", rc);
+		return rc;
+	}
+	if ((rc = dir_add(dir, dirfcb, name, id, fcb.mode)) != 0) {
+		log_error("link_in: dir_add failed: %i\n", rc);
+		return rc;
+	}
+	dirfcb->mtime = fcb.ctime;
+	dirfcb->ctime = fcb.ctime;
+	if ((rc = store_fcb((uuid_t *) dir, dirfcb)) != 0) {
+		log_error("link_in: store directory fcb failed: %i\n", rc);
+		return rc;
+	}
+	dcache_invalidate(dir, name);
+	if (newent != NULL) {
+		memset(newent, 0, sizeof(myent));
+		uuid_copy(newent->fcb_id, id);
+		strcpy(newent->name, name);
+	}
+	return 0;
+}
+
+//Link the fcb id as name in the directory dir, locking both
+int link_at(uuid_t dir, const char *name, uuid_t id, myent *newent) {
+	int rc;
+	myfcb dirfcb;
+
+	lock_inode_pair(dir, id);
+	if (fetch_fcb((uuid_t *) dir, &dirfcb) != 0) {
+		rc = -ENOENT;
+	}
+	else {
+		rc = link_in(dir, &dirfcb, name, id, newent);
+	}
+	unlock_inode_pair(dir, id);
+	return rc;
+}
+
+//Create name in the directory dir, owned by uid and gid. The new entrance is copied to newent
+//unless it is NULL.
+int create_in(uuid_t dir, myfcb *dirfcb, const char *name, mode_t mode, uid_t uid, gid_t gid, myent *newent) {
+	int rc; 
+
+	myfcb fcb;
+	myent ent;
+	if (dir_lookup(dir, dirfcb, name, &ent) == 0) {
+		return -EEXIST;
+	}
+	if (strlen(name) >= MY_MAX_PATH) {
+		return -ENAMETOOLONG;
+	}
+	if ((rc = create_fcb_with_ent(mode, uid, gid, name, &fcb, &ent)) != 0) {
+		log_error("create_dir - Create Directory with error: %i", rc);
+		return rc;
+	}
+	if ((rc = store_fcb(&(ent.fcb_id), &fcb)) != 0) {
+		log_error("create_dir - Store fcb failed: %i\n", rc);
+		return rc;
+	}
+	if ((rc = dir_add(dir, dirfcb, name, ent.fcb_id, mode)) != 0) {
+		log_error("create_dir - dir_add failed: %i\n", rc);
+		return rc;
+	}
+	if (S_ISDIR(mode)) {
+		dirfcb->nlink = fcb_links(dirfcb) + 1;	//The ".." of the new directory
+	}
+	dirfcb->mtime = time(NULL);
+	dirfcb->ctime = time(NULL);
+	if ((rc = store_fcb((uuid_t *) dir, dirfcb)) != 0) {
+		log_error("create_dir - store directory fcb failed: %i\n", rc);
+		return rc;
+	}
+	//The name may have been cached as missing
+	dcache_invalidate(dir, name);
+	if (newent != NULL) {
+		*newent = ent;
+	}
+	return 0;
+}
+
+//create all path does not exist. The new entrance is copied to newent unless it is NULL.
+int create_new(char* path, char* name, mode_t mode, myent *newent) {
+	int rc;
+	myfcb dirfcb;
+	uuid_t dir;
+	struct fuse_context *context = fuse_get_context();
+
+	if ((rc = lock_path(path, dir, &dirfcb)) != 0) {
+		write_log("create_directory - lock_path failed with %i\n", rc);
+		return rc;
+	}
+	if (!S_ISDIR(dirfcb.mode)) {
+		rc = -ENOTDIR;
+	}
+	else {
+		rc = create_in(dir, &dirfcb, name, mode, context->uid, context->gid, newent);
+	}
+	unlock_inode(dir);
+	return rc;
+}
+
+// The functions which follow are handler functions for various things a filesystem needs to do:
+// reading, getting attributes, truncating, etc. They will be called by FUSE whenever it needs
+// your filesystem to do something, so this is where functionality goes.
+
+// Inode number reported for the fcb id. It only depends on the id, so it stays the same across
+// lookups and mounts, and a listing can give it without fetching the fcb: the root is FUSE_ROOT_ID,
+// a sequential id is its number moved past the root, and a uuid is folded into 64 bits.
+ino_t stat_ino(uuid_t id) {
+	if (uuid_is_null(id)) {
+		return FUSE_ROOT_ID;
+	}
+	if (the_super.flags & MY_SUPER_SEQIDS) {
+		return key_hi(id) + FUSE_ROOT_ID;
+	}
+	ino_t ino = key_hi(id) ^ key_lo(id);
+	return ino <= FUSE_ROOT_ID ? ino + FUSE_ROOT_ID + 1 : ino;
+}
+
+// Attributes of the fcb id, as both frontends report them
+void fill_stat(uuid_t id, myfcb *fcb, struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf -> st_ino = stat_ino(id);
+	stbuf -> st_gid = fcb->gid;
+	stbuf -> st_mode = fcb->mode;
+	stbuf -> st_nlink = fcb_links(fcb);
+	stbuf -> st_mtime = fcb->mtime;
+	stbuf -> st_ctime = fcb->ctime;
+	stbuf -> st_size = fcb->size;
+	stbuf -> st_uid = fcb->uid;
+	stbuf -> st_blksize = the_super.block_size;
+	//Stored data blocks in 512-byte units; blocks still buffered by an open file count once they
+	//are flushed, at the latest by the next group commit. Inline data is counted as it is.
+	if (fcb->layout == MY_LAYOUT_INLINE) {
+		stbuf -> st_blocks = (fcb->size + 511) / 512;
+	}
+	else {
+		stbuf -> st_blocks = fcb->blocks * (the_super.block_size / 512);
+	}
+}
+
+// Get file and directory attributes (meta-data).
+// Read 'man 2 stat' and 'man 2 chmod'.
 static int myfs_getattr(const char *path, struct stat *stbuf) {
 
-	write_log("myfs_getattr(path=\"%s\", statbuf=0x%08x)\n", path, stbuf);
-	myfcb myfcb;
-	myent myent;
+	write_log("myfs_getattr(path=\"%s\", statbuf=0x%08x)\n", path, stbuf);
+	myfcb myfcb;
+	myent myent;
+
+	if(strcmp(path, "/") ==0){
+		fetch_fcb(&zero_uuid, &myfcb);
+		uuid_clear(myent.fcb_id);
+	}else{
+		int rc;
+		if ((rc = find_entrance(path, &myfcb, &myent)) != 0) {
+			write_log("myfs_getattr: find entrance: failed with %i\n", rc);
+			return rc;
+		}
+	}
+	
+	fill_stat(myent.fcb_id, &myfcb, stbuf);
+	return 0;
+}
+
+// Get the attributes of an open file from its handle, without walking the path. The inode is
+// pinned while the file is open, so this is a copy out of the inode cache.
+static int myfs_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+	write_log("myfs_fgetattr(path=\"%s\", statbuf=0x%08x)\n", path, stbuf);
+
+	myhandle *h = fi == NULL ? NULL : (myhandle *) (uintptr_t) fi->fh;
+	if (h == NULL) {
+		return myfs_getattr(path, stbuf);
+	}
+	myfcb fcb;
+	inode_get(h->inode, &fcb);
+	fill_stat(h->inode->id, &fcb, stbuf);
+	return 0;
+}
+
+// Open a directory. The handle holds the bucket a listing is currently walking.
+static int myfs_opendir(const char *path, struct fuse_file_info *fi) {
+	write_log("myfs_opendir(path=\"%s\", fi=0x%08x)\n", path, fi);
+
+	myfcb fcb;
+	mydirhandle *dh;
+	int rc;
+	if ((dh = calloc(1, sizeof(mydirhandle))) == NULL) {
+		return -ENOMEM;
+	}
+	if ((rc = find_directory(path, dh->dir, &fcb)) != 0) {
+		write_log("opendir(): find_directory failed with %i\n", rc);
+		free(dh);
+		return rc;
+	}
+	fi->fh = (uint64_t) (uintptr_t) dh;
+	return 0;
+}
+
+// Get bucket b of the directory into the handle, in place of the one it holds. Every readdir call
+// reads its buckets afresh, so that a listing resumed at a cookie, or rewound to the start, sees
+// the directory as it is now rather than as it was when the bucket was first read.
+int readdir_bucket(mydirhandle *dh, unsigned int b) {
+	free(dh->recs);
+	dh->recs = NULL;
+	return fetch_bucket(dh->dir, b, &(dh->recs), &(dh->len));
+}
+
+//Bits of a name hash in reverse order. A bucket holds the names whose hashes end in the bucket's
+//bits, so reversed they are one run of values, which a split only cuts in two.
+unsigned int hash_reverse(unsigned int h) {
+	unsigned int r = 0;
+	for (int i = 0; i < 32; i++, h >>= 1) {
+		r = (r << 1) | (h & 1);
+	}
+	return r;
+}
+
+//Order of the entries of a bucket in a listing: by reversed name hash, then by name
+int dirpos_compare(const void *a, const void *b) {
+	const mydirpos *x = a, *y = b;
+	if (x->rev != y->rev) {
+		return x->rev < y->rev ? -1 : 1;
+	}
+	int c = memcmp(x->rec->name, y->rec->name, x->rec->len < y->rec->len ? x->rec->len : y->rec->len);
+	return c != 0 ? c : (int) x->rec->len - (int) y->rec->len;
+}
+
+// List the directory of dh, whose fcb is fcb, from the cookie offset on.
+// Every entry is passed to filler with the cookie of the entry after it, so a listing stops as soon
+// as the kernel buffer is full and the next call resumes at the cookie it is given. Entries are
+// listed in the order of their reversed name hashes, and a cookie is the reversed hash to go on
+// from and how many entries of that very hash were listed already; the buckets are walked in the
+// order of the runs of hashes they hold. A cookie so names no position in a bucket, and an entry
+// which is in the directory for the whole listing is listed once, whatever is added, removed or
+// split meanwhile. Only removing an entry whose name has the same 32-bit hash as the last one
+// listed can make the next of that hash be passed over. Only one bucket is held in memory at a
+// time. The type and inode number of each entry are passed on in st_mode and st_ino, from the
+// bucket, without fetching its fcb.
+int readdir_fill(mydirhandle *dh, myfcb *fcb, void *buf, fuse_fill_dir_t filler, off_t offset) {
+	char name[MY_MAX_PATH];
+	struct stat st;
+	mydirpos *order = NULL;
+	uint64_t at = 0;	//reversed hash the listing goes on from
+	unsigned int skip = 0, dup = 0;
+	size_t count, room = 0;
+	int rc = 0, full = 0;
+
+    // We always output . and .. first, by convention. See documentation for more info on filler()
+	if (offset < 1 && filler(buf, ".", NULL, 1) != 0) {
+		return 0;
+	}
+	if (offset < 2 && filler(buf, "..", NULL, 2) != 0) {
+		return 0;
+	}
+	if (offset > 2) {
+		at = MY_DIR_COOKIE_HASH(offset);
+		skip = MY_DIR_COOKIE_DUP(offset);
+	}
+
+	memset(&st, 0, sizeof(st));
+	while (at <= UINT32_MAX && !full) {
+		//The bucket of the hash at, and the end of the run of reversed hashes it holds
+		unsigned int h = hash_reverse((unsigned int) at);
+		int bits = fcb->dir_level + ((h & ((1u << fcb->dir_level) - 1)) < fcb->dir_split);
+		uint64_t end = ((at >> (32 - bits)) + 1) << (32 - bits);
+		if ((rc = readdir_bucket(dh, dir_bucket_of(fcb, h))) != 0) {
+			log_error("readdir(): fetch bucket: fetch failed.\n");
+			break;
+		}
+		count = 0;
+		for (size_t pos = 0; pos < dh->len; pos += MY_DIR_REC_SIZE(((mydirrec *) (dh->recs + pos))->len), count++) {
+			if (count == room) {
+				mydirpos *grown = realloc(order, (room = room * 2 + 64) * sizeof(mydirpos));
+				if (grown == NULL) {
+					rc = -ENOMEM;
+					break;
+				}
+				order = grown;
+			}
+			order[count].rec = (mydirrec *) (dh->recs + pos);
+			order[count].rev = hash_reverse(name_hash(order[count].rec->name, order[count].rec->len));
+		}
+		if (rc != 0) {
+			break;
+		}
+		qsort(order, count, sizeof(mydirpos), dirpos_compare);
+		for (size_t i = 0; i < count; i++) {
+			mydirrec *r = order[i].rec;
+			dup = i > 0 && order[i - 1].rev == order[i].rev ? dup + 1 : 0;
+			if (order[i].rev < at || (order[i].rev == at && dup < skip)) {
+				continue;	//Listed before the cookie
+			}
+			memcpy(name, r->name, r->len);
+			name[r->len] = '\0';
+			st.st_mode = (mode_t) r->type << 12;
+			st.st_ino = stat_ino(r->fcb_id);
+			if (filler(buf, name, &st, MY_DIR_COOKIE(order[i].rev, dup + 1)) != 0) {
+				full = 1;	//Buffer full, the kernel comes back with the cookie
+				break;
+			}
+		}
+		at = end;
+		skip = 0;
+	}
+	free(order);
+	return rc;
+}
+
+// Read a directory.
+// Read 'man 2 readdir'.
+static int myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+
+	write_log("write_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n", path, buf, filler, offset, fi);
+
+	myfcb fcb;
+	mydirhandle tmp;
+	mydirhandle *dh = (mydirhandle *) (uintptr_t) fi->fh;
+	int rc;
+	// write_log("pointer - %s\n", path);
+
+	if (dh == NULL) {	//Not opened through opendir, fall back to a one-off handle
+		memset(&tmp, 0, sizeof(tmp));
+		dh = &tmp;
+		if ((rc = find_directory(path, dh->dir, &fcb)) != 0) {
+			write_log("readdir(): find_directory: read the directory failed in find_path\n");
+			return rc;
+		}
+	}
+	lock_inode(dh->dir, 0);
+	if ((rc = fetch_fcb(&(dh->dir), &fcb)) != 0) {
+		log_error("readdir(): fetch_fcb failed with %i\n", rc);
+	}
+	else {
+		rc = readdir_fill(dh, &fcb, buf, filler, offset);
+	}
+	unlock_inode(dh->dir);
+	if (dh == &tmp) {
+		free(tmp.recs);
+	}
+	return rc;
+}
+
+// Close a directory opened by opendir.
+static int myfs_releasedir(const char *path, struct fuse_file_info *fi) {
+	write_log("myfs_releasedir(path=\"%s\", fi=0x%08x)\n", path, fi);
+
+	mydirhandle *dh = (mydirhandle *) (uintptr_t) fi->fh;
+	if (dh != NULL) {
+		free(dh->recs);
+		free(dh);
+		fi->fh = 0;
+	}
+	return 0;
+}
+
+// Readahead window of a handle for a read of size bytes at offset. A read starting where the last
+// one ended doubles it, up to MY_READAHEAD_MAX; any other read halves it, down to nothing.
+size_t ra_window(myhandle *h, off_t offset, size_t size) {
+	if (offset == h->ra_next) {
+		h->ra_window = h->ra_window == 0 ? MY_READAHEAD_MIN : h->ra_window * 2;
+		if (h->ra_window > MY_READAHEAD_MAX) {
+			h->ra_window = MY_READAHEAD_MAX;
+		}
+	}
+	else {
+		h->ra_window /= 2;
+		if (h->ra_window < MY_READAHEAD_MIN) {
+			h->ra_window = 0;
+		}
+	}
+	h->ra_next = offset + size;
+	return h->ra_window;
+}
+
+// Read through a file handle. Reading fills the block map cache, so it takes the inode lock for
+// writing all the same. Only a read which starts or ends inside a block reads ahead: one made of
+// whole blocks fetches each of them once, straight into buf, and fetching them earlier under the
+// lock would only hold up the other readers of the file.
+int handle_read(myhandle *h, char *buf, size_t size, off_t offset) {
+	myinode *n = h->inode;
+	myfcb fcb;
+	lock_inode(n->id, 1);
+	inode_get(n, &fcb);
+	size_t window = ra_window(h, offset, size);
+	size_t bs = the_super.block_size;
+	int partial = offset % bs != 0 || (offset + size) % bs != 0;
+	int rc;
+	if (window > 0 && partial && n->map != NULL && size > 0 && (rc = ra_fill(&fcb, n->map, offset, size, window)) != 0) {
+		log_error("handle_read: readahead failed with %i\n", rc);	//The read fetches what is missing
+	}
+	rc = read_blocks(&fcb, n->map, buf, size, offset);
+	unlock_inode(n->id);
+	return rc;
+}
+
+// Read a file.
+// Read 'man 2 read'.
+static int myfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
+	write_log("myfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
+	
+	myhandle *h = (myhandle *) (uintptr_t) fi->fh;
+	if (h != NULL) {
+		return handle_read(h, buf, size, offset);
+	}
+
+	myfcb ptrfcb;
+	uuid_t id;
+	int rc;
+	if ((rc = lock_path(path, id, &ptrfcb)) != 0) {
+		write_log("myfs_read: lock_path: Find entrance failed.\n");
+		return rc;
+	}
+	rc = read_blocks(&ptrfcb, icache_map(id), buf, size, offset);
+	unlock_inode(id);
+	return rc;
+}
+
+// Read a file into a buffer vector of our own, which fuse sends on and frees. The blocks are
+// fetched straight into it.
+static int myfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi){
+	struct fuse_bufvec *dst;
+	char *mem;
+	int rc;
+	if ((dst = malloc(sizeof(struct fuse_bufvec))) == NULL) {
+		return -ENOMEM;
+	}
+	if ((mem = malloc(size)) == NULL) {
+		free(dst);
+		return -ENOMEM;
+	}
+	if ((rc = myfs_read(path, mem, size, offset, fi)) < 0) {
+		free(mem);
+		free(dst);
+		return rc;
+	}
+	*dst = FUSE_BUFVEC_INIT(rc);
+	dst->buf[0].mem = mem;
+	*bufp = dst;
+	return 0;
+}
+
+//Give fi a handle on the file of ent, pinning its inode
+int open_handle(myent *ent, struct fuse_file_info *fi) {
+	int rc;
+	myhandle *h;
+	if ((h = malloc(sizeof(myhandle))) == NULL) {
+		return -ENOMEM;
+	}
+	lock_inode(ent->fcb_id, 1);
+	rc = icache_open(&(ent->fcb_id), &(h->inode));
+	unlock_inode(ent->fcb_id);
+	if (rc != 0) {
+		log_error("open_handle: icache_open failed with %i\n", rc);
+		free(h);
+		return rc;
+	}
+	h->ent = *ent;
+	h->ra_next = 0;
+	h->ra_window = 0;
+	fi->fh = (uint64_t) (uintptr_t) h;
+	return 0;
+}
+
+// This file system only supports one file. Create should fail if a file has been created. Path must be '/<something>'.
+// Read 'man 2 creat'.
+static int myfs_create(const char *path, mode_t mode, struct fuse_file_info *fi){   
+    write_log("myfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n", path, mode, fi);
+	char* file;
+	char* dir;
+	char* pathdup;
+	myent ent;
+	int rc;
+	if ((pathdup = get_path_filename(path, &file, &dir)) == NULL) {
+		return -ENOMEM;
+	}
+	
+	int pathlen = strlen(file);
+	if(pathlen>=MY_MAX_PATH){
+		write_log("myfs_create - ENAMETOOLONG\n");
+		free(pathdup);
+		return -ENAMETOOLONG;
+	}
+
+	rc = create_new(dir, file, mode | S_IFREG, &ent);
+	free(pathdup);
+	if (rc != 0) {
+		return rc;
+	}
+	return open_handle(&ent, fi);
+}
+
+// Set update the times (actime, modtime) for a file. This FS only supports modtime.
+// Read 'man 2 utime'.
+static int myfs_utime(const char *path, struct utimbuf *ubuf){
+    write_log("myfs_utime(path=\"%s\", ubuf=0x%08x)\n", path, ubuf);
+
+	int rc;
+	myfcb fcb;
+	uuid_t id;
+	if ((rc = lock_path(path, id, &fcb)) != 0) {
+		write_log("myfs_utime: lock_path: error for %i\n", rc);
+		return rc;
+	}
+	fcb.mtime = ubuf->modtime;
+	if ((rc = store_fcb(&id, &fcb)) != 0) {
+		log_error("myfs_mtime: store_fcb: error for %i\n", rc);
+	}
+	unlock_inode(id);
+    return rc;
+}
+
+// Write through a file handle. An open file is written into its pinned fcb, which is written back
+// on flush.
+int handle_write(myhandle *h, struct fuse_bufvec *src, off_t offset) {
+	myinode *n = h->inode;
+	if (offset + fuse_buf_size(src) > max_file_size()) {
+		return -EFBIG;
+	}
+	myfcb fcb;
+	lock_inode(n->id, 1);
+	inode_get(n, &fcb);
+	int written = write_blocks(&fcb, n->map, src, offset);
+	if (written > 0) {
+		fcb.mtime = time(NULL);
+		fcb.ctime = fcb.mtime;
+	}
+	else {
+		log_error("write: write_blocks failed with error %i.\n", written);
+	}
+	inode_put(n, &fcb);	//even a failed write may have allocated blocks
+	unlock_inode(n->id);
+	return written;
+}
+
+// fallocate through an open handle, for either frontend
+int handle_fallocate(myhandle *h, int mode, off_t offset, off_t length) {
+	myinode *n = h->inode;
+	myfcb fcb;
+	lock_inode(n->id, 1);
+	inode_get(n, &fcb);
+	off_t size = fcb.size;
+	int rc = fallocate_blocks(&fcb, n->map, mode, offset, length);
+	if (rc != 0) {
+		log_error("fallocate: fallocate_blocks failed with error %i.\n", rc);
+	}
+	else if (fcb.size != size || (mode & FALLOC_FL_PUNCH_HOLE)) {
+		fcb.mtime = time(NULL);
+		fcb.ctime = fcb.mtime;
+	}
+	inode_put(n, &fcb);	//even a failed call may have reserved blocks
+	unlock_inode(n->id);
+	return rc;
+}
+
+// lseek with SEEK_DATA or SEEK_HOLE through an open handle, for either frontend
+off_t handle_seek(myhandle *h, off_t offset, int whence) {
+	myinode *n = h->inode;
+	myfcb fcb;
+	lock_inode(n->id, 1);
+	inode_get(n, &fcb);
+	off_t found = seek_blocks(&fcb, n->map, offset, whence);
+	unlock_inode(n->id);
+	return found;
+}
+
+// The lseek whence an ioctl of ours stands for, or the error to give for any other
+int ioctl_whence(int cmd, unsigned int flags) {
+	if (flags & FUSE_IOCTL_COMPAT) {
+		return -ENOSYS;
+	}
+	switch ((unsigned int) cmd) {
+	case MYFS_IOC_SEEK_DATA: return SEEK_DATA;
+	case MYFS_IOC_SEEK_HOLE: return SEEK_HOLE;
+	default: return -ENOTTY;
+	}
+}
+
+// Write to a file from a buffer vector, which fuse may have spliced the data into.
+// Read 'man 2 write'
+static int myfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi){
+	size_t size = fuse_buf_size(buf);
+    write_log("myfs_write_buf(path=\"%s\", size=%d, offset=%lld, fi=0x%08x)\n", path, size, offset, fi);
+    
+	if(offset + size > max_file_size()){
+		write_log("myfs_write - EFBIG");
+		return -EFBIG;
+	}
+	int rc;
+
+	myhandle *h = (myhandle *) (uintptr_t) fi->fh;
+	if (h != NULL) {
+		return handle_write(h, buf, offset);
+	}
+
+	//create a new file with filename
+	myfcb newfcb;
+	uuid_t id;
+
+	if ((rc = lock_path(path, id, &newfcb)) != 0) {
+		char* filename;
+		char* pathname;
+		char* pathdup;
+		mode_t mode = S_IFREG|S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH;
+		if ((pathdup = get_path_filename(path, &filename, &pathname)) == NULL) {
+			log_error("myfs_write - get_path_file_name failed\n");
+			return -ENOMEM;
+		}
+		rc = create_new(pathname, filename, mode, NULL);
+		free(pathdup);
+		if (rc != 0) {
+			log_error("myfs_write: create_new failed with %i\n", rc);
+			return rc;
+		}
+		if ((rc = lock_path(path, id, &newfcb)) != 0) {
+			write_log("myfs_write: lock_path failed with %i\n", rc);
+			return rc;
+		}
+	}	//now the fcb is the fcb of the new file
+
+	// Write the data blocks covered by the write.
+	int written = write_blocks(&newfcb, icache_map(id), buf, offset);
+	if (written <= 0) {
+		log_error("write: write_blocks failed with error %i.\n", written);
+		unlock_inode(id);
+		return written;
+	}
+
+	// Update the fcb in-memory.
+	time_t now = time(NULL);
+	newfcb.mtime=now;
+	newfcb.ctime=now;
+
+	// Write the fcb to the store.
+	if ((rc = store_fcb(&id, &newfcb)) != 0) {
+		log_error("write: store file failed with %i.\n", rc);
+		written = rc;
+	}
+	unlock_inode(id);
+    return written;
+}
+
+// Write to a file.
+// Read 'man 2 write'
+static int myfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+	src.buf[0].mem = (void *) buf;
+	return myfs_write_buf(path, &src, offset, fi);
+}
+
+// Set the size of a file.
+// Read 'man 2 truncate'.
+int myfs_truncate(const char *path, off_t newsize){    
+    write_log("myfs_truncate(path=\"%s\", newsize=%lld)\n", path, newsize);
+    
+    // Check that the size is acceptable
+	if(newsize > max_file_size()){
+		write_log("myfs_truncate - EFBIG");
+		return -EFBIG;
+	}
+	
+    myfcb fcb;
+	uuid_t id;
+	int rc;
+	if((rc = lock_path(path, id, &fcb)) != 0) {
+		write_log("truncate: lock_path: error with code %i", rc);
+		return rc;
+	}
+	if (S_ISDIR(fcb.mode)) {
+		rc = -EISDIR;
+	}
+	else if ((rc = truncate_blocks(&fcb, icache_map(id), newsize)) != 0) {
+		log_error("truncate: truncate_blocks: error with code %i", rc);
+	}
+	else {
+		fcb.mtime = time(NULL);
+		fcb.ctime = fcb.mtime;
+		if ((rc = store_fcb(&id, &fcb)) != 0) {
+			log_error("truncate: store_fcb: error with code %i", rc);
+		}
+	}
+	unlock_inode(id);
+	return rc;
+}
+
+// Preallocate the blocks of a range of a file, or punch a hole in it.
+// Read 'man 2 fallocate'.
+int myfs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi){
+	write_log("myfs_fallocate(path=\"%s\", mode=0x%x, offset=%lld, length=%lld)\n", path, mode, offset, length);
+
+	myhandle *h = fi == NULL ? NULL : (myhandle *) (uintptr_t) fi->fh;
+	if (h != NULL) {
+		return handle_fallocate(h, mode, offset, length);
+	}
+
+	myfcb fcb;
+	uuid_t id;
+	int rc;
+	if ((rc = lock_path(path, id, &fcb)) != 0) {
+		write_log("fallocate: lock_path: error with code %i", rc);
+		return rc;
+	}
+	off_t size = fcb.size;
+	if (S_ISDIR(fcb.mode)) {
+		rc = -EISDIR;
+	}
+	else {
+		if ((rc = fallocate_blocks(&fcb, icache_map(id), mode, offset, length)) != 0) {
+			log_error("fallocate: fallocate_blocks: error with code %i", rc);
+		}
+		else if (fcb.size != size || (mode & FALLOC_FL_PUNCH_HOLE)) {
+			fcb.mtime = time(NULL);
+			fcb.ctime = fcb.mtime;
+		}
+		if (store_fcb(&id, &fcb) != 0) {	//even a failed call may have reserved blocks
+			log_error("fallocate: store_fcb failed\n");
+		}
+	}
+	unlock_inode(id);
+	return rc;
+}
+
+// Set permissions.
+// Read 'man 2 chmod'.
+int myfs_chmod(const char *path, mode_t mode){
+    write_log("myfs_chmod(fpath=\"%s\", mode=0%03o)\n", path, mode);
+    uuid_t id;
+	myfcb fcb;
+	int rc;
+	if (strcmp(path, "/") == 0) {
+		return -EIO;
+	}
+	if ((rc = lock_path(path, id, &fcb)) != 0) {
+		write_log("chmod: lock_path: permission change failed.\n");
+		return rc;
+	}
+	if ((fcb.mode & S_IFDIR) == S_IFDIR) {
+		fcb.mode = mode | S_IFDIR;
+	}
+	else
+	{
+		fcb.mode = mode | S_IFREG;
+	}
+	time_t now = time(NULL);
+	fcb.mtime=now;
+	fcb.ctime=now;
+	if((rc = store_fcb(&id, &fcb)) != 0) {
+		log_error("chmod: store_FCB: permission change failed\n");
+	}
+	unlock_inode(id);
+    return rc;
+}
+
+// Set ownership.
+// Read 'man 2 chown'.
+int myfs_chown(const char *path, uid_t uid, gid_t gid){   
+    write_log("myfs_chown(path=\"%s\", uid=%d, gid=%d)\n", path, uid, gid);
+   	uuid_t id;
+	myfcb fcb;
+	int rc;
+	if (strcmp(path, "/") == 0) {
+		return -EIO;
+	}
+	if ((rc = lock_path(path, id, &fcb)) != 0) {
+		write_log("chown: lock_path: Permission change failed.\n");
+		return rc;
+	}
+	fcb.uid = uid;
+	fcb.gid = gid;
+	time_t now = time(NULL);
+	fcb.mtime=now;
+	fcb.ctime=now;
+	if((rc = store_fcb(&id, &fcb)) != 0) {
+		log_error("chown: store_fcb: permission change failed\n");
+	}
+	unlock_inode(id);
+    return rc;
+}
+
+// Create a directory.
+// Read 'man 2 mkdir'.
+int myfs_mkdir(const char *path, mode_t mode){
+	write_log("myfs_mkdir: %s\n",path);	
+	
+	char* file;
+	char* dir;
+	char* pathdup;
+	int rc;
+	if ((pathdup = get_path_filename(path, &file, &dir)) == NULL) {
+		return -ENOMEM;
+	}
+
+	int pathlen = strlen(file);
+	if(pathlen>=MY_MAX_PATH){
+		write_log("myfs_create - ENAMETOOLONG\n");
+		free(pathdup);
+		return -ENAMETOOLONG;
+	}
+
+	rc = create_new(dir, file, mode | S_IFDIR, NULL);
+	free(pathdup);
+	return rc;
+}
+
+// Delete a file.
+// Read 'man 2 unlink'.
+int myfs_unlink(const char *path){
+	write_log("myfs_unlink: %s\n",path);	
+	char* filepath;
+	char* filename;
+	char* pathdup;
+	int rc;
+	if ((pathdup = get_path_filename(path, &filename, &filepath)) == NULL) {
+		return -ENOMEM;
+	}
+	rc = remove_node(filepath, filename);
+	free(pathdup);
+	return rc;
+}
+
+// Delete a directory.
+// Read 'man 2 rmdir'.
+int myfs_rmdir(const char *path){
+    write_log("myfs_rmdir: %s\n",path);	
+	char* filepath;
+	char* filename;
+	char* pathdup;
+	int rc;
+	if ((pathdup = get_path_filename(path, &filename, &filepath)) == NULL) {
+		return -ENOMEM;
+	}
+	rc = remove_node(filepath, filename);
+	free(pathdup);
+	return rc;
+}
+
+// Rename a file or directory, moving its entry from one directory to another.
+// Read 'man 2 rename'.
+int myfs_rename(const char *from, const char *to){
+	write_log("myfs_rename(from=\"%s\", to=\"%s\")\n", from, to);
+	char *fromname, *frompath, *fromdup;
+	char *toname, *topath, *todup;
+	myfcb dirfcb;
+	uuid_t fromdir, todir;
+	size_t len = strlen(from);
+	int rc;
+
+	if (strncmp(from, to, len) == 0 && to[len] == '/') {
+		return -EINVAL;		//Below itself
+	}
+	if ((fromdup = get_path_filename(from, &fromname, &frompath)) == NULL) {
+		return -ENOMEM;
+	}
+	if ((todup = get_path_filename(to, &toname, &topath)) == NULL) {
+		free(fromdup);
+		return -ENOMEM;
+	}
+	if ((rc = find_directory(frompath, fromdir, &dirfcb)) == 0 && (rc = find_directory(topath, todir, &dirfcb)) == 0) {
+		rc = rename_at(fromdir, fromname, todir, toname);
+	}
+	free(fromdup);
+	free(todup);
+	return rc;
+}
+
+// Make a hard link to a file: another entry for the same fcb.
+// Read 'man 2 link'.
+int myfs_link(const char *from, const char *to){
+	write_log("myfs_link(from=\"%s\", to=\"%s\")\n", from, to);
+	char *toname, *topath, *todup;
+	myfcb fcb;
+	myent ent;
+	uuid_t todir;
+	int rc;
+
+	if ((rc = find_entrance(from, &fcb, &ent)) != 0) {
+		return rc;
+	}
+	if (strcmp(from, "/") == 0 || S_ISDIR(fcb.mode)) {
+		return -EPERM;
+	}
+	if ((todup = get_path_filename(to, &toname, &topath)) == NULL) {
+		return -ENOMEM;
+	}
+	if ((rc = find_directory(topath, todir, &fcb)) == 0) {
+		rc = link_at(todir, toname, ent.fcb_id, NULL);
+	}
+	free(todup);
+	return rc;
+}
+
+// Write the cached fcb of a path back to the store
+int flush_path(const char *path) {
+	myfcb fcb;
+	uuid_t id;
+	int rc;
+	if (strcmp(path, "/") == 0) {
+		return 0;	//The root fcb is written through
+	}
+	if ((rc = lock_path(path, id, &fcb)) != 0) {
+		write_log("flush_path: lock_path failed with %i\n", rc);
+		return rc;
+	}
+	if ((rc = icache_flush(id)) != 0) {
+		log_error("flush_path: icache_flush failed with %i\n", rc);
+		rc = -EIO;
+	}
+	unlock_inode(id);
+	return rc;
+}
+
+// Write the cached fcb of an open file back to the store, falling back to its path when it has
+// no handle. The cache lock is only held to copy the fcb, not through the store calls.
+int flush_handle(const char *path, struct fuse_file_info *fi) {
+	myhandle *h = (myhandle *) (uintptr_t) fi->fh;
+	if (h == NULL) {
+		return flush_path(path);
+	}
+	lock_inode(h->inode->id, 1);
+	int rc = inode_write_back(h->inode) != 0 ? -EIO : 0;
+	unlock_inode(h->inode->id);
+	return rc;
+}
+
+// Flush any cached data.
+int myfs_flush(const char *path, struct fuse_file_info *fi){
+    write_log("myfs_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
+	
+    return flush_handle(path, fi);
+}
+
+// Write back and close the handle of an open file
+int release_handle(const char *path, struct fuse_file_info *fi) {
+	myhandle *h = (myhandle *) (uintptr_t) fi->fh;
+	int rc = flush_handle(path, fi);
+	if (h != NULL) {
+		uuid_t id;
+		uuid_copy(id, h->inode->id);	//The inode may be freed by the close
+		lock_inode(id, 1);
+		icache_close(h->inode);
+		unlock_inode(id);
+		free(h);
+		fi->fh = 0;
+	}
+	return rc;
+}
+
+// Release the file. There will be one call to release for each call to open.
+int myfs_release(const char *path, struct fuse_file_info *fi){
+    write_log("myfs_release(path=\"%s\", fi=0x%08x)\n", path, fi);
+    
+    return release_handle(path, fi);
+}
+
+// Synchronise a file's cached state with the store.
+// Read 'man 2 fsync'.
+int myfs_fsync(const char *path, int datasync, struct fuse_file_info *fi){
+    write_log("myfs_fsync(path=\"%s\", datasync=%d, fi=0x%08x)\n", path, datasync, fi);
+
+    return flush_handle(path, fi);
+}
+
+// OPTIONAL - included as an example
+// Open a file. Open should check if the operation is permitted for the given flags (fi->flags).
+// Read 'man 2 open'.
+static int myfs_open(const char *path, struct fuse_file_info *fi){
+	// if (strcmp(path, the_root_fcb.path) != 0)
+	// 	return -ENOENT;
+		
+	write_log("myfs_open(path\"%s\", fi=0x%08x)\n", path, fi);
+	
+	//return -EACCES if the access is not permitted.
+
+	//Resolve the path once; read, write, flush and release then work on the handle
+	myfcb fcb;
+	myent ent;
+	int rc;
+	if ((rc = find_entrance(path, &fcb, &ent)) != 0) {
+		write_log("myfs_open: find_entrance failed with %i\n", rc);
+		return rc;
+	}
+	if (S_ISDIR(fcb.mode)) {
+		return 0;	//Directories are read through opendir/readdir, they get no file handle
+	}
+	return open_handle(&ent, fi);
+}
+
+// Group commit. Every operation holds fs_lock shared and a commit holds it exclusive, so commits
+// only happen between operations and a crash rolls the store back, through the journal, to the
+// end of some operation. The operations which change anything are counted; commit_ops of them, or
+// whatever has waited commit_ms, are committed together with a single journal sync. fsync commits
+// straight away. commit_lock guards the state below.
+pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+pthread_t commit_thread;
+int commit_running;                 //commit_thread is running
+int commit_open;                    //a transaction has been begun
+unsigned int commit_pending;        //changing operations since the last commit
+struct timespec commit_since;       //when the first of them ended
+
+long elapsed_ms(struct timespec *since) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+//Write the cached fcbs and data back and commit everything done since the last commit. The
+//caller holds fs_lock exclusive.
+int group_commit() {
+	int rc;
+	if (commit_pending == 0) {
+		return 0;
+	}
+	if ((rc = icache_flush_all()) != 0) {
+		log_error("group_commit: icache_flush_all failed with %i\n", rc);
+		return rc;
+	}
+	if ((rc = free_list_store()) != 0) {
+		log_error("group_commit: free_list_store failed with %i\n", rc);
+		return rc;
+	}
+	if ((rc = orphan_store()) != 0) {
+		log_error("group_commit: orphan_store failed with %i\n", rc);
+		return rc;
+	}
+	if ((rc = unqlite_commit(pDb)) != UNQLITE_OK) {
+		log_error("group_commit: unqlite_commit failed with %i\n", rc);
+		return rc;
+	}
+	pthread_mutex_lock(&commit_lock);
+	commit_open = 0;
+	commit_pending = 0;
+	pthread_mutex_unlock(&commit_lock);
+	return 0;
+}
+
+//Commit once the operations running have finished
+int commit_now() {
+	pthread_rwlock_wrlock(&fs_lock);
+	uint64_t start = now_ns();
+	int pending = commit_pending > 0;	//no operation runs to change it
+	int rc = group_commit();
+	if (pending) {
+		hist_add(&op_hist[MY_OP_COMMIT][MY_PHASE_TOTAL], now_ns() - start);
+	}
+	pthread_rwlock_unlock(&fs_lock);
+	return rc;
+}
 
-	memset(stbuf, 0, sizeof(struct stat));
+//Start an operation, timed as op. One which may change something joins the open transaction,
+//or begins one.
+void op_begin(int op, int changes) {
+	int rc;
+	op_timer_start(op);
+	pthread_rwlock_rdlock(&fs_lock);
+	if (changes) {
+		pthread_mutex_lock(&commit_lock);
+		if (!commit_open) {
+			if ((rc = unqlite_begin(pDb)) != UNQLITE_OK) {
+				log_error("op_begin: unqlite_begin failed with %i\n", rc);
+			}
+			commit_open = 1;
+		}
+		pthread_mutex_unlock(&commit_lock);
+	}
+}
 
-	if(strcmp(path, "/") ==0){
-		myfcb = the_root_fcb;
-	}else{
+//Finish an operation, committing the group if it is big or old enough
+void op_finish(int changed) {
+	int due = 0;
+	if (changed) {
+		pthread_mutex_lock(&commit_lock);
+		if (commit_pending++ == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &commit_since);
+		}
+		due = commit_pending >= myfs_options.commit_ops || elapsed_ms(&commit_since) >= myfs_options.commit_ms;
+		pthread_mutex_unlock(&commit_lock);
+	}
+	pthread_rwlock_unlock(&fs_lock);
+	if (due) {
+		commit_now();
+	}
+}
+
+//Finish an operation and stop its timer. A commit it sets off counts towards it, the caller
+//waits for it after all, as well as towards the commits.
+void op_end(int changed) {
+	op_finish(changed);
+	op_timer_stop();
+}
+
+//Finish an operation which has to reach the store before it returns, as fsync does
+int op_end_sync() {
+	op_finish(1);
+	int rc = commit_now();
+	op_timer_stop();
+	return rc;
+}
+
+//Commit a group which has waited commit_ms, even when no further operation comes along
+void *commit_loop(void *arg) {
+	(void) arg;
+	pthread_mutex_lock(&commit_lock);
+	while (commit_running) {
+		struct timespec deadline;
+		long wait = myfs_options.commit_ms;
+		if (commit_pending > 0) {
+			wait -= elapsed_ms(&commit_since);
+		}
+		if (wait < 1) {
+			wait = 1;
+		}
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += wait / 1000;
+		deadline.tv_nsec += (wait % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&commit_cond, &commit_lock, &deadline);
+		if (commit_pending > 0 && elapsed_ms(&commit_since) >= myfs_options.commit_ms) {
+			pthread_mutex_unlock(&commit_lock);
+			commit_now();
+			pthread_mutex_lock(&commit_lock);
+		}
+	}
+	pthread_mutex_unlock(&commit_lock);
+	return NULL;
+}
+
+//Start the commit thread. This has to wait until fuse has daemonized, a thread started before
+//that would not survive the fork.
+void commit_start() {
+	commit_running = 1;
+	if (pthread_create(&commit_thread, NULL, commit_loop, NULL) != 0) {
+		log_info("commit_start: no commit thread, groups are committed by operations only\n");
+		commit_running = 0;
+	}
+}
+
+//Stop the commit thread and commit whatever is left
+void commit_stop() {
+	pthread_mutex_lock(&commit_lock);
+	int running = commit_running;
+	commit_running = 0;
+	pthread_cond_signal(&commit_cond);
+	pthread_mutex_unlock(&commit_lock);
+	if (running) {
+		pthread_join(commit_thread, NULL);
+	}
+	commit_now();
+}
+
+//Reclaimer. A thread which works through the orphan list, freeing the blocks of one orphan at a
+//time from its end, MY_RECLAIM_BATCH of them per operation so that no commit waits long for it,
+//and the fcb last. An orphan with handles still open is passed over until they are closed.
+pthread_t reclaim_thread;
+int reclaim_running;                //reclaim_thread is running, guarded by orphan_lock
+
+//Free the last MY_RECLAIM_BATCH blocks of an orphan, or the orphan itself once that is all it
+//has left. 1 if it is still open.
+int reclaim_batch(uuid_t id) {
+	int rc;
+	myfcb fcb;
+	size_t bs = the_super.block_size;
+
+	op_begin(MY_OP_RECLAIM, 1);
+	lock_inode(id, 1);
+	if (icache_is_open(id)) {
+		rc = 1;
+	}
+	else if ((rc = fetch_fcb((uuid_t *) id, &fcb)) == UNQLITE_NOTFOUND) {
+		orphan_remove(id);		//Nothing left of it
+		rc = 0;
+	}
+	else if (rc != 0) {
+		log_error("reclaim_batch: fetch_fcb failed with %i\n", rc);
+	}
+	else {
+		unsigned long long blocks = (fcb.size + bs - 1) / bs;
+		unsigned long long first = blocks > MY_RECLAIM_BATCH ? blocks - MY_RECLAIM_BATCH : 0;
+		if (first == 0) {
+			if ((rc = delete_fcb(id, &fcb)) == 0) {
+				orphan_remove(id);
+			}
+		}
+		else if ((rc = free_blocks(&fcb, icache_map(id), first)) == 0) {
+			fcb.size = first * bs;
+			rc = store_fcb((uuid_t *) id, &fcb);
+		}
+		if (rc != 0) {
+			log_error("reclaim_batch: freeing blocks failed with %i\n", rc);
+		}
+	}
+	unlock_inode(id);
+	op_end(rc == 0);
+	return rc;
+}
+
+void *reclaim_loop(void *arg) {
+	unsigned int i = 0;
+	uuid_t id;
+	(void) arg;
+	pthread_mutex_lock(&orphan_lock);
+	while (reclaim_running) {
+		if (i >= orphan_count) {
+			i = 0;
+			pthread_cond_wait(&orphan_cond, &orphan_lock);
+			continue;
+		}
+		uuid_copy(id, orphans[i]);
+		pthread_mutex_unlock(&orphan_lock);
+		int rc = reclaim_batch(id);
+		pthread_mutex_lock(&orphan_lock);
+		if (rc != 0) {
+			i++;	//Open or failing, try the next one; this one is tried again on the next round
+		}
+	}
+	pthread_mutex_unlock(&orphan_lock);
+	return NULL;
+}
+
+//Start the reclaimer, after fuse has daemonized as the commit thread is. Without it orphans are
+//left on the list for the next mount.
+void reclaim_start() {
+	reclaim_running = 1;
+	if (pthread_create(&reclaim_thread, NULL, reclaim_loop, NULL) != 0) {
+		log_info("reclaim_start: no reclaimer thread, orphans are kept until the next mount\n");
+		reclaim_running = 0;
+	}
+}
+
+//Stop the reclaimer. What it has not got to yet stays on the orphan list.
+void reclaim_stop() {
+	pthread_mutex_lock(&orphan_lock);
+	int running = reclaim_running;
+	reclaim_running = 0;
+	pthread_cond_signal(&orphan_cond);
+	pthread_mutex_unlock(&orphan_lock);
+	if (running) {
+		pthread_join(reclaim_thread, NULL);
+	}
+}
+
+// Settle what the connection is to do, for either frontend
+void init_conn(struct fuse_conn_info *conn) {
+	//Have the data of writes spliced into a pipe, write_buf reads it from there into the blocks
+	if (conn->capable & FUSE_CAP_SPLICE_READ) {
+		conn->want |= FUSE_CAP_SPLICE_READ;
+	}
+	//Writes of more than a page at a time, in whole blocks: a sequential writer then hands over
+	//each block in one piece and no block is read back to be modified
+	if (conn->capable & FUSE_CAP_BIG_WRITES) {
+		conn->want |= FUSE_CAP_BIG_WRITES;
+	}
+	conn->max_write = MY_MAX_WRITE / the_super.block_size * the_super.block_size;
+	//Reads may be sent while others are still being served, handle_read locks what it needs.
+	//max_readahead comes in as the most the kernel will do and is left there.
+	if (conn->capable & FUSE_CAP_ASYNC_READ) {
+		conn->want |= FUSE_CAP_ASYNC_READ;
+		conn->async_read = 1;
+	}
+	log_info("init_conn: want 0x%x, max_write %u, max_readahead %u\n", conn->want, conn->max_write, conn->max_readahead);
+}
+
+static void *myfs_init(struct fuse_conn_info *conn) {
+	write_log("myfs_init()\n");
+
+	log_start();
+	init_conn(conn);
+	commit_start();
+	reclaim_start();
+	return NEWFS_PRIVATE_DATA;
+}
+
+static void myfs_destroy(void *private_data) {
+	(void) private_data;
+	write_log("myfs_destroy()\n");
+
+	reclaim_stop();
+	commit_stop();
+}
+
+// The stats tree, served by the wrappers below before any operation begins, so reading it
+// takes no lock and touches no store. Nothing in it can be changed.
+int stats_getattr(const char *path, struct stat *stbuf) {
+	fuse_ino_t ino = stats_path(path);
+	if (ino != MY_STATS_DIR_INO && ino != MY_STATS_INO) {
+		return -ENOENT;
+	}
+	stats_stat(ino, stbuf);
+	return 0;
+}
+
+int stats_opendir(const char *path, struct fuse_file_info *fi) {
+	fuse_ino_t ino = stats_path(path);
+	fi->fh = 0;
+	return ino == MY_STATS_DIR_INO ? 0 : ino == MY_STATS_INO ? -ENOTDIR : -ENOENT;
+}
+
+int stats_open_path(const char *path, struct fuse_file_info *fi) {
+	fuse_ino_t ino = stats_path(path);
+	return ino == MY_STATS_INO ? stats_open(fi) : ino == MY_STATS_DIR_INO ? -EISDIR : -ENOENT;
+}
+
+int stats_read_buf(struct fuse_file_info *fi, struct fuse_bufvec **bufp, size_t size, off_t offset) {
+	struct fuse_bufvec *dst;
+	char *mem;
+	if ((dst = malloc(sizeof(struct fuse_bufvec))) == NULL) {
+		return -ENOMEM;
+	}
+	if ((mem = malloc(size)) == NULL) {
+		free(dst);
+		return -ENOMEM;
+	}
+	*dst = FUSE_BUFVEC_INIT(stats_read(fi, mem, size, offset));
+	dst->buf[0].mem = mem;
+	*bufp = dst;
+	return 0;
+}
+
+// Each handler as one unit of a group commit
+static int tx_getattr(const char *path, struct stat *stbuf) {
+	if (stats_path(path)) {
+		return stats_getattr(path, stbuf);
+	}
+	op_begin(MY_OP_GETATTR, 0);
+	int rc = myfs_getattr(path, stbuf);
+	op_end(0);
+	return rc;
+}
+static int tx_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+	if (stats_path(path)) {
+		return stats_getattr(path, stbuf);
+	}
+	op_begin(MY_OP_FGETATTR, 0);
+	int rc = myfs_fgetattr(path, stbuf, fi);
+	op_end(0);
+	return rc;
+}
+static int tx_opendir(const char *path, struct fuse_file_info *fi) {
+	if (stats_path(path)) {
+		return stats_opendir(path, fi);
+	}
+	op_begin(MY_OP_OPENDIR, 0);
+	int rc = myfs_opendir(path, fi);
+	op_end(0);
+	return rc;
+}
+static int tx_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+	if (stats_path(path)) {
+		return stats_readdir(buf, filler, offset);
+	}
+	op_begin(MY_OP_READDIR, 0);
+	int rc = myfs_readdir(path, buf, filler, offset, fi);
+	op_end(0);
+	return rc;
+}
+static int tx_releasedir(const char *path, struct fuse_file_info *fi) {
+	if (stats_path(path)) {
+		return 0;
+	}
+	op_begin(MY_OP_RELEASEDIR, 0);
+	int rc = myfs_releasedir(path, fi);
+	op_end(0);
+	return rc;
+}
+static int tx_open(const char *path, struct fuse_file_info *fi) {
+	if (stats_path(path)) {
+		return stats_open_path(path, fi);
+	}
+	op_begin(MY_OP_OPEN, 0);
+	int rc = myfs_open(path, fi);
+	op_end(0);
+	return rc;
+}
+static int tx_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	if (stats_path(path)) {
+		return stats_read(fi, buf, size, offset);
+	}
+	op_begin(MY_OP_READ, 0);
+	int rc = myfs_read(path, buf, size, offset, fi);
+	op_end(0);
+	return rc;
+}
+static int tx_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+	if (stats_path(path)) {
+		return stats_read_buf(fi, bufp, size, offset);
+	}
+	op_begin(MY_OP_READ, 0);
+	int rc = myfs_read_buf(path, bufp, size, offset, fi);
+	op_end(0);
+	return rc;
+}
+static int tx_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	if (stats_path(path)) {
+		return -EROFS;
+	}
+	op_begin(MY_OP_CREATE, 1);
+	int rc = myfs_create(path, mode, fi);
+	op_end(1);
+	return rc;
+}
+static int tx_utime(const char *path, struct utimbuf *ubuf) {
+	if (stats_path(path)) {
+		return -EROFS;
+	}
+	op_begin(MY_OP_UTIME, 1);
+	int rc = myfs_utime(path, ubuf);
+	op_end(1);
+	return rc;
+}
+static int tx_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	if (stats_path(path)) {
+		return -EBADF;
+	}
+	op_begin(MY_OP_WRITE, 1);
+	int rc = myfs_write(path, buf, size, offset, fi);
+	op_end(1);
+	return rc;
+}
+static int tx_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+	if (stats_path(path)) {
+		return -EBADF;
+	}
+	op_begin(MY_OP_WRITE, 1);
+	int rc = myfs_write_buf(path, buf, offset, fi);
+	op_end(1);
+	return rc;
+}
+// Find data or holes in a file. fuse 2 passes no lseek through, so SEEK_DATA and SEEK_HOLE come
+// as the MYFS_IOC_SEEK_DATA and MYFS_IOC_SEEK_HOLE ioctls: data holds the offset to start from and
+// gets back the one found. Read 'man 2 lseek'.
+int myfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data){
+	write_log("myfs_ioctl(path=\"%s\", cmd=0x%x, flags=0x%x)\n", path, cmd, flags);
+
+	int whence = ioctl_whence(cmd, flags);
+	if (whence < 0) {
+		return whence;
+	}
+	if (flags & FUSE_IOCTL_DIR) {
+		return -ENXIO;
+	}
+	off_t found;
+	myhandle *h = fi == NULL ? NULL : (myhandle *) (uintptr_t) fi->fh;
+	if (h != NULL) {
+		found = handle_seek(h, *(off_t *) data, whence);
+	}
+	else {
+		myfcb fcb;
+		uuid_t id;
 		int rc;
-		if ((rc = find_entrance(path, &myfcb, &myent)) != 0) {
-			write_log("myfs_getattr: find entrance: failed with %i\n", rc);
+		if ((rc = lock_path(path, id, &fcb)) != 0) {
+			write_log("ioctl: lock_path: error with code %i", rc);
 			return rc;
 		}
+		found = seek_blocks(&fcb, icache_map(id), *(off_t *) data, whence);
+		unlock_inode(id);
 	}
-	
-	stbuf -> st_gid = myfcb.gid;
-	stbuf -> st_mode = myfcb.mode;
-	stbuf -> st_nlink = myfcb.nlink;
-	stbuf -> st_mtime = myfcb.mtime;
-	stbuf -> st_ctime = myfcb.ctime;
-	stbuf -> st_size = myfcb.size;
-	stbuf -> st_uid = myfcb.uid;
+	if (found < 0) {
+		return (int) found;
+	}
+	*(off_t *) data = found;
+	return 0;
+}
+static int tx_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+	if (stats_path(path)) {
+		return -ENOTTY;
+	}
+	op_begin(MY_OP_IOCTL, 0);
+	int rc = myfs_ioctl(path, cmd, arg, fi, flags, data);
+	op_end(0);
+	return rc;
+}
+static int tx_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	if (stats_path(path)) {
+		return -EROFS;
+	}
+	op_begin(MY_OP_FALLOCATE, 1);
+	int rc = myfs_fallocate(path, mode, offset, length, fi);
+	op_end(1);
+	return rc;
+}
+
+static int tx_truncate(const char *path, off_t newsize) {
+	if (stats_path(path)) {
+		return -EROFS;
+	}
+	op_begin(MY_OP_TRUNCATE, 1);
+	int rc = myfs_truncate(path, newsize);
+	op_end(1);
+	return rc;
+}
+static int tx_flush(const char *path, struct fuse_file_info *fi) {
+	if (stats_path(path)) {
+		return 0;
+	}
+	op_begin(MY_OP_FLUSH, 1);
+	int rc = myfs_flush(path, fi);
+	op_end(1);
+	return rc;
+}
+static int tx_release(const char *path, struct fuse_file_info *fi) {
+	if (stats_path(path)) {
+		stats_release(fi);
+		return 0;
+	}
+	op_begin(MY_OP_RELEASE, 1);
+	int rc = myfs_release(path, fi);
+	op_end(1);
+	return rc;
+}
+static int tx_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	if (stats_path(path)) {
+		return 0;
+	}
+	op_begin(MY_OP_FSYNC, 1);
+	int rc = myfs_fsync(path, datasync, fi);
+	if (op_end_sync() != 0 && rc == 0) {
+		rc = -EIO;
+	}
+	return rc;
+}
+static int tx_mkdir(const char *path, mode_t mode) {
+	if (stats_path(path)) {
+		return -EROFS;
+	}
+	op_begin(MY_OP_MKDIR, 1);
+	int rc = myfs_mkdir(path, mode);
+	op_end(1);
+	return rc;
+}
+static int tx_chmod(const char *path, mode_t mode) {
+	if (stats_path(path)) {
+		return -EROFS;
+	}
+	op_begin(MY_OP_CHMOD, 1);
+	int rc = myfs_chmod(path, mode);
+	op_end(1);
+	return rc;
+}
+static int tx_chown(const char *path, uid_t uid, gid_t gid) {
+	if (stats_path(path)) {
+		return -EROFS;
+	}
+	op_begin(MY_OP_CHOWN, 1);
+	int rc = myfs_chown(path, uid, gid);
+	op_end(1);
+	return rc;
+}
+static int tx_unlink(const char *path) {
+	if (stats_path(path)) {
+		return -EROFS;
+	}
+	op_begin(MY_OP_UNLINK, 1);
+	int rc = myfs_unlink(path);
+	op_end(1);
+	return rc;
+}
+static int tx_rename(const char *from, const char *to) {
+	if (stats_path(from) || stats_path(to)) {
+		return -EROFS;
+	}
+	op_begin(MY_OP_RENAME, 1);
+	int rc = myfs_rename(from, to);
+	op_end(1);
+	return rc;
+}
+static int tx_link(const char *from, const char *to) {
+	if (stats_path(from) || stats_path(to)) {
+		return -EROFS;
+	}
+	op_begin(MY_OP_LINK, 1);
+	int rc = myfs_link(from, to);
+	op_end(1);
+	return rc;
+}
+static int tx_rmdir(const char *path) {
+	if (stats_path(path)) {
+		return -EROFS;
+	}
+	op_begin(MY_OP_RMDIR, 1);
+	int rc = myfs_rmdir(path);
+	op_end(1);
+	return rc;
+}
+
+// This struct contains pointers to all the functions defined above
+// It is used to pass the function pointers to fuse
+// fuse will then execute the methods as required 
+static struct fuse_operations myfs_oper = {
+	.init		= myfs_init,
+	.destroy	= myfs_destroy,
+	.getattr	= tx_getattr,
+	.fgetattr	= tx_fgetattr,
+	.opendir	= tx_opendir,
+	.readdir	= tx_readdir,
+	.releasedir	= tx_releasedir,
+	.open		= tx_open,
+	.read		= tx_read,
+	.read_buf	= tx_read_buf,
+	.create		= tx_create,
+	.utime 		= tx_utime,
+	.write		= tx_write,
+	.write_buf	= tx_write_buf,
+	.truncate	= tx_truncate,
+	.fallocate	= tx_fallocate,
+	.ioctl		= tx_ioctl,
+	.flush		= tx_flush,
+	.release	= tx_release,
+	.fsync		= tx_fsync,
+	.mkdir 		= tx_mkdir,
+	.chmod  	= tx_chmod,
+	.chown 		= tx_chown,
+	.unlink 	= tx_unlink,
+	.rename		= tx_rename,
+	.link		= tx_link,
+	.rmdir		= tx_rmdir,
+};
+
 
+// The low-level frontend. The kernel addresses files by inode number instead of by path, so each
+// request costs a hash lookup from inode number to fcb id and no path walk at all; the kernel's
+// dentry cache does the walking. An inode number is handed out by lookup, create or mkdir and
+// stays bound to its fcb until the kernel forgets all the lookups on it.
+mynode *node_inos[MY_NODE_BUCKETS];
+mynode *node_ids[MY_NODE_BUCKETS];
+fuse_ino_t node_next = FUSE_ROOT_ID + 1;
+pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;
+
+mynode *node_by_ino(fuse_ino_t ino) {
+	mynode *n;
+	for (n = node_inos[ino % MY_NODE_BUCKETS]; n != NULL && n->ino != ino; n = n->ino_next);
+	return n;
+}
+
+//fcb id of an inode number, zero_uuid for the root
+int node_id(fuse_ino_t ino, uuid_t id) {
+	mynode *n;
+	if (ino == FUSE_ROOT_ID) {
+		uuid_clear(id);
+		return 0;
+	}
+	if (ino == MY_STATS_DIR_INO || ino == MY_STATS_INO) {
+		return -EROFS;	//never stored, nothing in the stats tree can be changed
+	}
+	pthread_mutex_lock(&node_lock);
+	if ((n = node_by_ino(ino)) != NULL) {
+		uuid_copy(id, n->id);
+	}
+	pthread_mutex_unlock(&node_lock);
+	if (n == NULL) {
+		log_info("node_id: unknown inode number %lu\n", ino);
+		return -ESTALE;
+	}
 	return 0;
 }
 
-// Read a directory.
-// Read 'man 2 readdir'.
-static int myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+//Inode number of an fcb, counting one more lookup on it. 0 if there is no memory for a node.
+fuse_ino_t node_get(uuid_t id) {
+	mynode *n;
+	unsigned int h = id_hash(id) % MY_NODE_BUCKETS;
 
-    (void) offset;  // This prevents compiler warnings
-	(void) fi;
+	if (uuid_is_null(id)) {
+		return FUSE_ROOT_ID;
+	}
+	pthread_mutex_lock(&node_lock);
+	for (n = node_ids[h]; n != NULL && uuid_compare(n->id, id) != 0; n = n->id_next);
+	if (n == NULL) {
+		if ((n = calloc(1, sizeof(mynode))) == NULL) {
+			pthread_mutex_unlock(&node_lock);
+			return 0;
+		}
+		n->ino = node_next++;
+		uuid_copy(n->id, id);
+		n->id_next = node_ids[h];
+		node_ids[h] = n;
+		n->ino_next = node_inos[n->ino % MY_NODE_BUCKETS];
+		node_inos[n->ino % MY_NODE_BUCKETS] = n;
+	}
+	n->nlookup++;
+	fuse_ino_t ino = n->ino;
+	pthread_mutex_unlock(&node_lock);
+	return ino;
+}
 
-	write_log("write_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n", path, buf, filler, offset, fi);
+//Whether the kernel holds lookups on the fcb id
+int node_held(uuid_t id) {
+	mynode *n;
+	pthread_mutex_lock(&node_lock);
+	for (n = node_ids[id_hash(id) % MY_NODE_BUCKETS]; n != NULL && uuid_compare(n->id, id) != 0; n = n->id_next);
+	pthread_mutex_unlock(&node_lock);
+	return n != NULL;
+}
 
-    // We always output . and .. first, by convention. See documentation for more info on filler()
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
+//The kernel dropped nlookup lookups on ino; the node goes with the last of them
+void node_forget(fuse_ino_t ino, uint64_t nlookup) {
+	mynode *n, **pp;
+	pthread_mutex_lock(&node_lock);
+	if ((n = node_by_ino(ino)) == NULL) {
+		pthread_mutex_unlock(&node_lock);
+		return;
+	}
+	if (n->nlookup > nlookup) {
+		n->nlookup -= nlookup;
+		pthread_mutex_unlock(&node_lock);
+		return;
+	}
+	for (pp = &node_inos[ino % MY_NODE_BUCKETS]; *pp != n; pp = &(*pp)->ino_next);
+	*pp = n->ino_next;
+	for (pp = &node_ids[id_hash(n->id) % MY_NODE_BUCKETS]; *pp != n; pp = &(*pp)->id_next);
+	*pp = n->id_next;
+	pthread_mutex_unlock(&node_lock);
+	free(n);
+}
 
+//Fill a reply to lookup, create or mkdir for the fcb of ent, counting the lookup it gives the kernel
+int node_entry(myent *ent, struct fuse_entry_param *e) {
+	int rc;
 	myfcb fcb;
-	myent ent;
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	if ((rc = fetch_fcb(&(ent->fcb_id), &fcb)) != 0) {
+		return rc;
+	}
+	if ((e->ino = node_get(ent->fcb_id)) == 0) {
+		return -ENOMEM;
+	}
+	fill_stat(ent->fcb_id, &fcb, &(e->attr));
+	e->attr_timeout = myfs_options.attr_timeout;
+	e->entry_timeout = myfs_options.entry_timeout;
+	return 0;
+}
+
+//The fcb of an inode number and its id
+int node_fcb(fuse_ino_t ino, uuid_t id, myfcb *fcb) {
 	int rc;
-	// write_log("pointer - %s\n", path);
+	if ((rc = node_id(ino, id)) != 0) {
+		return rc;
+	}
+	return fetch_fcb((uuid_t *) id, fcb);
+}
+
+static void myfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+	(void) userdata;
+	write_log("myfs_ll_init()\n");
+
+	log_start();
+	init_conn(conn);
+	commit_start();
+	reclaim_start();
+}
+
+static void myfs_ll_destroy(void *userdata) {
+	(void) userdata;
+	write_log("myfs_ll_destroy()\n");
+
+	reclaim_stop();
+	commit_stop();
+}
 
-	if (strcmp("/", path) == 0) {
-		fcb = the_root_fcb;
+static void myfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	write_log("myfs_ll_lookup(parent=%lu, name=\"%s\")\n", parent, name);
+
+	struct fuse_entry_param e;
+	myfcb fcb;
+	myent ent;
+	uuid_t dir;
+	int rc;
+	fuse_ino_t stats = stats_lookup(parent, name);
+	if (stats == MY_STATS_DIR_INO || stats == MY_STATS_INO) {
+		memset(&e, 0, sizeof(e));
+		e.ino = stats;
+		stats_stat(stats, &e.attr);
+		e.attr_timeout = myfs_options.attr_timeout;
+		e.entry_timeout = myfs_options.entry_timeout;
+		fuse_reply_entry(req, &e);
+		return;
 	}
-	else{
-		if ((rc = find_entrance(path, &fcb, &ent)) != 0) {
-			write_log("readdir(): find_entrance: read the directory failed in find_path\n");
-			return rc;
+	if (stats != 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	op_begin(MY_OP_LOOKUP, 0);
+	if ((rc = node_fcb(parent, dir, &fcb)) == 0) {
+		if (!S_ISDIR(fcb.mode)) {
+			rc = -ENOTDIR;
 		}
+		else if ((rc = lookup_component(dir, name, &fcb, &ent)) == 0) {
+			rc = node_entry(&ent, &e);
+		}
+	}
+	op_end(0);
+	if (rc == -ENOENT && myfs_options.negative_timeout > 0) {
+		//An entry with no inode has the kernel cache the name as missing
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = myfs_options.negative_timeout;
+		rc = 0;
 	}
+	if (rc != 0) {
+		fuse_reply_err(req, -rc);
+		return;
+	}
+	fuse_reply_entry(req, &e);
+}
 
-	for (int i = 0; i < MY_MAX_DIRECT; i++) {
-		if (uuid_compare(zero_uuid, fcb.direct[i]) != 0) {
-			if ((rc = fetch_ent(&(fcb.direct[i]), &ent)) != 0) {
-				write_log("readdir(): fetch entrance: fetch failed.\n");
-				return rc;
+static void myfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+	write_log("myfs_ll_forget(ino=%lu, nlookup=%lu)\n", ino, nlookup);
+
+	op_begin(MY_OP_FORGET, 0);
+	node_forget(ino, nlookup);
+	op_end(0);
+	fuse_reply_none(req);
+}
+
+static void myfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	write_log("myfs_ll_getattr(ino=%lu)\n", ino);
+
+	struct stat st;
+	myfcb fcb;
+	uuid_t id;
+	int rc;
+	if (ino == MY_STATS_DIR_INO || ino == MY_STATS_INO) {
+		stats_stat(ino, &st);
+		fuse_reply_attr(req, &st, myfs_options.attr_timeout);
+		return;
+	}
+	op_begin(MY_OP_GETATTR, 0);
+	if ((rc = node_fcb(ino, id, &fcb)) == 0) {
+		fill_stat(id, &fcb, &st);
+	}
+	op_end(0);
+	if (rc != 0) {
+		fuse_reply_err(req, -rc);
+		return;
+	}
+	fuse_reply_attr(req, &st, myfs_options.attr_timeout);
+}
+
+static void myfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+	write_log("myfs_ll_setattr(ino=%lu, to_set=0x%x)\n", ino, to_set);
+
+	struct stat st;
+	myfcb fcb;
+	uuid_t id;
+	int rc;
+	op_begin(MY_OP_SETATTR, 1);
+	if ((rc = node_id(ino, id)) != 0) {
+		op_end(0);
+		fuse_reply_err(req, -rc);
+		return;
+	}
+	lock_inode(id, 1);
+	if ((rc = fetch_fcb((uuid_t *) id, &fcb)) != 0) {
+		rc = -ENOENT;
+	}
+	else {
+		if (to_set & FUSE_SET_ATTR_MODE) {
+			fcb.mode = (fcb.mode & S_IFMT) | (attr->st_mode & 07777);
+		}
+		if (to_set & FUSE_SET_ATTR_UID) {
+			fcb.uid = attr->st_uid;
+		}
+		if (to_set & FUSE_SET_ATTR_GID) {
+			fcb.gid = attr->st_gid;
+		}
+		if (to_set & FUSE_SET_ATTR_MTIME) {
+			fcb.mtime = attr->st_mtime;
+		}
+#ifdef FUSE_SET_ATTR_MTIME_NOW
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+			fcb.mtime = time(NULL);
+		}
+#endif
+		if (to_set & FUSE_SET_ATTR_SIZE) {
+			if (S_ISDIR(fcb.mode)) {
+				rc = -EISDIR;
+			}
+			else if (attr->st_size > max_file_size()) {
+				rc = -EFBIG;
 			}
-			else
-			{
-				filler(buf, ent.name, NULL, 0);
+			else if ((rc = truncate_blocks(&fcb, icache_map(id), attr->st_size)) == 0) {
+				fcb.mtime = time(NULL);
 			}
 		}
+		fcb.ctime = time(NULL);
+		if (rc == 0 && (rc = store_fcb((uuid_t *) id, &fcb)) == 0) {
+			fill_stat(id, &fcb, &st);
+		}
+	}
+	unlock_inode(id);
+	op_end(1);
+	if (rc != 0) {
+		fuse_reply_err(req, -rc);
+		return;
+	}
+	fuse_reply_attr(req, &st, myfs_options.attr_timeout);
+}
+
+static void myfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	write_log("myfs_ll_open(ino=%lu)\n", ino);
+
+	myfcb fcb;
+	myent ent;
+	int rc;
+	memset(&ent, 0, sizeof(myent));
+	if (ino == MY_STATS_DIR_INO || ino == MY_STATS_INO) {
+		rc = ino == MY_STATS_INO ? stats_open(fi) : -EISDIR;
+	}
+	else {
+		op_begin(MY_OP_OPEN, 0);
+		if ((rc = node_fcb(ino, ent.fcb_id, &fcb)) == 0) {
+			rc = S_ISDIR(fcb.mode) ? -EISDIR : open_handle(&ent, fi);
+		}
+		op_end(0);
+	}
+	if (rc != 0) {
+		fuse_reply_err(req, -rc);
+		return;
 	}
-	return 0;
+	fuse_reply_open(req, fi);
 }
 
-// Read a file.
-// Read 'man 2 read'.
-static int myfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
-	size_t len;
-	(void) fi;
-	
-	write_log("myfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
-	
-	myfcb ptrfcb;
-	myent ptrent;
-	myfile file;
+static void myfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	write_log("myfs_ll_read(ino=%lu, size=%zu, off=%lld)\n", ino, size, off);
 
-	char* directory;
-	char* fileName;
+	myhandle *h = (myhandle *) (uintptr_t) fi->fh;
+	char *buf;
 	int rc;
-	get_path_filename(path, &fileName, &directory);
-	if ((rc = find_entrance(path, &ptrfcb, &ptrent)) != 0) {
-		write_log("myfs_read: find_entrance: Find entrance failed.\n");
-		return rc;
+	if ((buf = malloc(size)) == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
 	}
-	
-	if ((rc = fetch_file(&(ptrfcb.direct[0]), &file)) != 0) {
-		write_log("myfs_read: fetch file: No data inside. Read empty.\n");
-		memset(&file, 0, sizeof(myfile)); //If there is no file block, create one.
+	if (ino == MY_STATS_INO) {
+		rc = stats_read(fi, buf, size, off);
 	}
-	
-	len = file.size;
-
-	if (offset < len) {
-		if (offset + size > len)
-			size = len - offset;
-		memcpy(buf, &(file.data) + offset, size);
-	} else
-		size = 0;
-	
-	return size;
-}
-
-// This file system only supports one file. Create should fail if a file has been created. Path must be '/<something>'.
-// Read 'man 2 creat'.
-static int myfs_create(const char *path, mode_t mode, struct fuse_file_info *fi){   
-    write_log("myfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n", path, mode, fi);
-	char* file;
-	char* dir;
-    get_path_filename(path, &file, &dir);
-	
-	int pathlen = strlen(file);
-	if(pathlen>=MY_MAX_PATH){
-		write_log("myfs_create - ENAMETOOLONG\n");
-		return -ENAMETOOLONG;
+	else {
+		op_begin(MY_OP_READ, 0);
+		rc = handle_read(h, buf, size, off);
+		op_end(0);
 	}
-
-	return create_new(dir, file, mode | S_IFREG);
+	if (rc < 0) {
+		fuse_reply_err(req, -rc);
+	}
+	else {
+		fuse_reply_buf(req, buf, rc);
+	}
+	free(buf);
 }
 
-// Set update the times (actime, modtime) for a file. This FS only supports modtime.
-// Read 'man 2 utime'.
-static int myfs_utime(const char *path, struct utimbuf *ubuf){
-    write_log("myfs_utime(path=\"%s\", ubuf=0x%08x)\n", path, ubuf);
+static void myfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+	write_log("myfs_ll_write(ino=%lu, size=%zu, off=%lld)\n", ino, size, off);
 
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
 	int rc;
-	if(strcmp(path, "/") == 0) {
-		the_root_fcb.mtime=ubuf->modtime;
-		rc = unqlite_kv_store(pDb,ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE,&the_root_fcb,sizeof(myfcb));
-		if( rc != UNQLITE_OK ){
-			write_log("myfs_write - EIO");
-			return -EIO;
-		}
-	}
-	else{
-		myfcb fcb;
-		myent ent;
-		if ((rc = find_entrance(path, &fcb, &ent)) != 0) {
-			write_log("myfs_utime: find entrance: error for %i\n", rc);
-			return rc;
-		}
-		fcb.mtime = ubuf->modtime;
-		if ((rc = store_fcb(&(ent.fcb_id), &fcb)) != 0) {
-			write_log("myfs_mtime: store_fcb: error for %i\n", rc);
-			return rc;
-		}
+	src.buf[0].mem = (void *) buf;
+	op_begin(MY_OP_WRITE, 1);
+	rc = handle_write((myhandle *) (uintptr_t) fi->fh, &src, off);
+	op_end(1);
+	if (rc < 0) {
+		fuse_reply_err(req, -rc);
+		return;
 	}
-    return 0;
+	fuse_reply_write(req, rc);
 }
 
-// Write to a file.
-// Read 'man 2 write'
-static int myfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi){  //Debugging 
-    write_log("myfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
-    
-	if(size >= MY_MAX_FILE_SIZE){
-		write_log("myfs_write - EFBIG");
-		return -EFBIG;
-	}
+static void myfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
+	write_log("myfs_ll_write_buf(ino=%lu, size=%zu, off=%lld)\n", ino, fuse_buf_size(bufv), off);
+
 	int rc;
-	char* filename;
-	char* pathname;
-	if ((rc = get_path_filename(path, &filename, &pathname)) != 0) {
-		write_log("myfs_write - get_path_file_name failed\n", rc);
-		return 0;
+	op_begin(MY_OP_WRITE, 1);
+	rc = handle_write((myhandle *) (uintptr_t) fi->fh, bufv, off);
+	op_end(1);
+	if (rc < 0) {
+		fuse_reply_err(req, -rc);
+		return;
 	}
-	
-	//create a new file with filename
-	myfcb newfcb;
-	myent newent;
+	fuse_reply_write(req, rc);
+}
 
-	if ((rc = find_entrance(path, &newfcb, &newent)) != 0) {
-		mode_t mode = S_IFREG|S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH;
-		if ((rc = create_new(pathname, filename, mode)) != 0) {
-			write_log("myfs_write: create_new failed with %i\n", rc);
-			return rc;
-		}
-		if ((rc = find_entrance(path, &newfcb, &newent)) != 0) {
-			write_log("myfs_write: find entrance failed with %i\n", rc);
-			return rc;
-		}
-	}	//now the fcb is the fcb of the new file
-	
+static void myfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	write_log("myfs_ll_flush(ino=%lu)\n", ino);
 
-	myfile newFile;
-	//Check if the file has file entrance
-	if (uuid_compare(zero_uuid, newfcb.direct[0]) == 0) {
-		memset(&newFile, 0 ,sizeof(myfile));
-		uuid_generate(newfcb.direct[0]);
+	int rc;
+	if (ino == MY_STATS_INO) {
+		fuse_reply_err(req, 0);
+		return;
 	}
-	else {
-		if ((rc = fetch_file(&(newfcb.direct[0]), &newFile)) != 0) {
-			write_log("Write: fetch file: failed with %i\n", rc);
-			return rc;
-		}
+	op_begin(MY_OP_FLUSH, 1);
+	rc = flush_handle(NULL, fi);
+	op_end(1);
+	fuse_reply_err(req, -rc);
+}
+
+static void myfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	write_log("myfs_ll_release(ino=%lu)\n", ino);
 
+	int rc;
+	if (ino == MY_STATS_INO) {
+		stats_release(fi);
+		fuse_reply_err(req, 0);
+		return;
 	}
+	op_begin(MY_OP_RELEASE, 1);
+	rc = release_handle(NULL, fi);
+	op_end(1);
+	fuse_reply_err(req, -rc);
+}
 
-	// Write the data in-memory and into data struct
-    int written = snprintf(newFile.data, MY_MAX_FILE_SIZE, buf);
-	newFile.size = written;
+static void myfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	write_log("myfs_ll_fsync(ino=%lu, datasync=%d)\n", ino, datasync);
 
-	// Write the data block back to the store.
-	if ((rc = store_file(&(newfcb.direct[0]), &newFile)) != 0) {
-		write_log("write: store file failed with error %i.\n", rc);
-		return rc;
+	int rc;
+	if (ino == MY_STATS_INO) {
+		fuse_reply_err(req, 0);
+		return;
 	}
+	op_begin(MY_OP_FSYNC, 1);
+	rc = flush_handle(NULL, fi);
+	if (op_end_sync() != 0 && rc == 0) {
+		rc = -EIO;
+	}
+	fuse_reply_err(req, -rc);
+}
 
-	// Update the fcb in-memory.
-	newfcb.size=written;
-	time_t now = time(NULL);
-	newfcb.mtime=now;
-	newfcb.ctime=now;
+static void myfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	write_log("myfs_ll_fallocate(ino=%lu, mode=0x%x, offset=%lld, length=%lld)\n", ino, mode, offset, length);
 
-	// Write the fcb to the store.
-    // Write the data block to the store.
-	if ((rc = store_fcb(&(newent.fcb_id), &newfcb)) != 0) {
-		write_log("write: store file failed with %i.\n", rc);
-		return rc;
-	}
-	
-    return written;
+	int rc;
+	op_begin(MY_OP_FALLOCATE, 1);
+	rc = handle_fallocate((myhandle *) (uintptr_t) fi->fh, mode, offset, length);
+	op_end(1);
+	fuse_reply_err(req, -rc);
 }
+static void myfs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi, unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
+	write_log("myfs_ll_ioctl(ino=%lu, cmd=0x%x, flags=0x%x)\n", ino, cmd, flags);
 
-// Set the size of a file.
-// Read 'man 2 truncate'.
-int myfs_truncate(const char *path, off_t newsize){    
-    write_log("myfs_truncate(path=\"%s\", newsize=%lld)\n", path, newsize);
-    
-    // Check that the size is acceptable
-	if(newsize >= MY_MAX_FILE_SIZE){
-		write_log("myfs_truncate - EFBIG");
-		return -EFBIG;
+	int whence = ioctl_whence(cmd, flags);
+	if (whence < 0 || ino == MY_STATS_DIR_INO || ino == MY_STATS_INO) {
+		fuse_reply_err(req, whence < 0 ? -whence : ENOTTY);
+		return;
 	}
-	
-    myfcb fcb;
-	myent ent;
+	if ((flags & FUSE_IOCTL_DIR) || in_bufsz < sizeof(off_t) || out_bufsz < sizeof(off_t)) {
+		fuse_reply_err(req, (flags & FUSE_IOCTL_DIR) ? ENXIO : EINVAL);
+		return;
+	}
+	off_t found;
+	op_begin(MY_OP_IOCTL, 0);
+	found = handle_seek((myhandle *) (uintptr_t) fi->fh, *(const off_t *) in_buf, whence);
+	op_end(0);
+	if (found < 0) {
+		fuse_reply_err(req, (int) -found);
+	}
+	else {
+		fuse_reply_ioctl(req, 0, &found, sizeof(found));
+	}
+}
+
+static void myfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	write_log("myfs_ll_opendir(ino=%lu)\n", ino);
+
+	myfcb fcb;
+	mydirhandle *dh;
 	int rc;
-	if((rc = find_entrance(path, &fcb, &ent)) != 0) {
-		write_log("truncate: find_entrance: error with code %i", rc);
+	if (ino == MY_STATS_DIR_INO || ino == MY_STATS_INO) {
+		if (ino == MY_STATS_INO) {
+			fuse_reply_err(req, ENOTDIR);
+			return;
+		}
+		fi->fh = 0;	//nothing to page through
+		fuse_reply_open(req, fi);
+		return;
 	}
-	myfile oldfile;
-	myfile newfile;
-	memset(&newfile, 0, sizeof(newfile));
-	if ((rc = fetch_file(&fcb.direct[0], &oldfile))!=0) {
-		write_log("truncate: fetch_file: error with code %i", rc);
-		return rc;
+	if ((dh = calloc(1, sizeof(mydirhandle))) == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	op_begin(MY_OP_OPENDIR, 0);
+	if ((rc = node_fcb(ino, dh->dir, &fcb)) == 0 && !S_ISDIR(fcb.mode)) {
+		rc = -ENOTDIR;
 	}
-	memcpy(&newfile, &oldfile, oldfile.size);
-	newfile.size = newsize;
-	fcb.mtime = time(NULL);
+	op_end(0);
+	if (rc != 0) {
+		free(dh);
+		fuse_reply_err(req, -rc);
+		return;
+	}
+	fi->fh = (uint64_t) (uintptr_t) dh;
+	fuse_reply_open(req, fi);
+}
 
-	if ((rc = store_file(&fcb.direct[0], &newfile)) != 0) {
-		write_log("truncate: store_file: error with code %i", rc);
-		return rc;
+// A reply buffer being filled by readdir_fill
+typedef struct _ll_dirbuf {
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t used;
+} lldirbuf;
+
+// fuse_fill_dir_t for the low-level frontend: add one entry, 1 once the buffer is full
+int ll_filler(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+	lldirbuf *d = buf;
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	st.st_ino = 0xffffffff;		//unknown; the kernel looks the name up for the real one
+	if (stbuf != NULL) {
+		st.st_mode = stbuf->st_mode;	//the type, for d_type
+		st.st_ino = stbuf->st_ino;		//the one stat gives, for d_ino
 	}
-	if ((rc = store_fcb(&(ent.fcb_id), &fcb)) != 0) {
-		write_log("truncate: store_fcb: error with code %i", rc);
+	size_t len = fuse_add_direntry(d->req, NULL, 0, name, NULL, 0);
+	if (d->used + len > d->size) {
+		return 1;
 	}
+	fuse_add_direntry(d->req, d->buf + d->used, d->size - d->used, name, &st, off);
+	d->used += len;
 	return 0;
 }
 
-// Set permissions.
-// Read 'man 2 chmod'.
-int myfs_chmod(const char *path, mode_t mode){
-    write_log("myfs_chmod(fpath=\"%s\", mode=0%03o)\n", path, mode);
-    myent ent;
+static void myfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	write_log("myfs_ll_readdir(ino=%lu, size=%zu, off=%lld)\n", ino, size, off);
+
+	mydirhandle *dh = (mydirhandle *) (uintptr_t) fi->fh;
+	lldirbuf d = { req, NULL, size, 0 };
 	myfcb fcb;
 	int rc;
-	if (strcmp(path, "/") == 0) {
-		return -EIO;
+	if ((d.buf = malloc(size)) == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
 	}
-	if ((rc = find_entrance(path, &fcb, &ent)) != 0) {
-		write_log("chmod: find_entrance: permission change failed.\n");
-		return rc;
+	if (ino == MY_STATS_DIR_INO) {
+		rc = stats_readdir(&d, ll_filler, off);
 	}
-	if ((fcb.mode & S_IFDIR) == S_IFDIR) {
-		fcb.mode = mode | S_IFDIR;
+	else {
+		op_begin(MY_OP_READDIR, 0);
+		lock_inode(dh->dir, 0);
+		if ((rc = fetch_fcb(&(dh->dir), &fcb)) == 0) {
+			rc = readdir_fill(dh, &fcb, &d, ll_filler, off);
+		}
+		unlock_inode(dh->dir);
+		op_end(0);
 	}
-	else
-	{
-		fcb.mode = mode | S_IFREG;
+	if (rc != 0) {
+		fuse_reply_err(req, -rc);
 	}
-	time_t now = time(NULL);
-	fcb.mtime=now;
-	fcb.ctime=now;
-	if((rc = store_fcb(&(ent.fcb_id), &fcb)) != 0) {
-		write_log("chmod: store_FCB: permission change failed\n");
-		return rc;
+	else {
+		fuse_reply_buf(req, d.buf, d.used);
 	}
-    return 0;
+	free(d.buf);
 }
 
-// Set ownership.
-// Read 'man 2 chown'.
-int myfs_chown(const char *path, uid_t uid, gid_t gid){   
-    write_log("myfs_chown(path=\"%s\", uid=%d, gid=%d)\n", path, uid, gid);
-   	myent ent;
-	myfcb fcb;
+static void myfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	write_log("myfs_ll_releasedir(ino=%lu)\n", ino);
+
+	mydirhandle *dh = (mydirhandle *) (uintptr_t) fi->fh;
+	if (dh != NULL) {
+		free(dh->recs);
+		free(dh);
+		fi->fh = 0;
+	}
+	fuse_reply_err(req, 0);
+}
+
+// Create name under parent, shared by create and mkdir. e is filled for the reply.
+int ll_create_in(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, myent *ent, struct fuse_entry_param *e) {
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	myfcb dirfcb;
+	uuid_t dir;
 	int rc;
-	if (strcmp(path, "/") == 0) {
-		return -EIO;
+	if (strlen(name) >= MY_MAX_PATH) {
+		return -ENAMETOOLONG;
 	}
-	if ((rc = find_entrance(path, &fcb, &ent)) != 0) {
-		write_log("chown: find_entrance: Permission change failed.\n");
+	if (stats_lookup(parent, name)) {
+		return -EROFS;
+	}
+	if ((rc = node_id(parent, dir)) != 0) {
 		return rc;
 	}
-	fcb.uid = uid;
-	fcb.gid = gid;
-	time_t now = time(NULL);
-	fcb.mtime=now;
-	fcb.ctime=now;
-	if((rc = store_fcb(&(ent.fcb_id), &fcb)) != 0) {
-		write_log("chown: store_fcb: permission change failed\n");
+	lock_inode(dir, 1);
+	if (fetch_fcb((uuid_t *) dir, &dirfcb) != 0) {
+		rc = -ENOENT;
+	}
+	else if (!S_ISDIR(dirfcb.mode)) {
+		rc = -ENOTDIR;
+	}
+	else {
+		rc = create_in(dir, &dirfcb, name, mode, ctx->uid, ctx->gid, ent);
+	}
+	unlock_inode(dir);
+	if (rc != 0) {
 		return rc;
 	}
-    return 0;
+	return node_entry(ent, e);
 }
 
-// Create a directory.
-// Read 'man 2 mkdir'.
-int myfs_mkdir(const char *path, mode_t mode){
-	write_log("myfs_mkdir: %s\n",path);	
-	
-	char* file;
-	char* dir;
-    get_path_filename(path, &file, &dir);
+static void myfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+	write_log("myfs_ll_create(parent=%lu, name=\"%s\", mode=0%03o)\n", parent, name, mode);
 
-	int pathlen = strlen(file);
-	if(pathlen>=MY_MAX_PATH){
-		write_log("myfs_create - ENAMETOOLONG\n");
-		return -ENAMETOOLONG;
+	struct fuse_entry_param e;
+	myent ent;
+	int rc;
+	op_begin(MY_OP_CREATE, 1);
+	if ((rc = ll_create_in(req, parent, name, mode | S_IFREG, &ent, &e)) == 0 && (rc = open_handle(&ent, fi)) != 0) {
+		node_forget(e.ino, 1);
 	}
+	op_end(1);
+	if (rc != 0) {
+		fuse_reply_err(req, -rc);
+		return;
+	}
+	fuse_reply_create(req, &e, fi);
+}
 
-	return create_new(dir, file, mode | S_IFDIR);
+static void myfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+	write_log("myfs_ll_mkdir(parent=%lu, name=\"%s\", mode=0%03o)\n", parent, name, mode);
+
+	struct fuse_entry_param e;
+	myent ent;
+	int rc;
+	op_begin(MY_OP_MKDIR, 1);
+	rc = ll_create_in(req, parent, name, mode | S_IFDIR, &ent, &e);
+	op_end(1);
+	if (rc != 0) {
+		fuse_reply_err(req, -rc);
+		return;
+	}
+	fuse_reply_entry(req, &e);
 }
 
-// Delete a file.
-// Read 'man 2 unlink'.
-int myfs_unlink(const char *path){
-	write_log("myfs_unlink: %s\n",path);	
-	char* filepath;
-	char* filename;
-	get_path_filename(path, &filename, &filepath);
-    return remove_node(filepath, filename);
+// unlink and rmdir, timed as op
+void ll_remove(fuse_req_t req, fuse_ino_t parent, const char *name, int op) {
+	uuid_t dir;
+	int rc;
+	if (stats_lookup(parent, name)) {
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+	op_begin(op, 1);
+	if ((rc = node_id(parent, dir)) == 0) {
+		rc = remove_at(dir, name);
+	}
+	op_end(1);
+	fuse_reply_err(req, -rc);
 }
 
-// Delete a directory.
-// Read 'man 2 rmdir'.
-int myfs_rmdir(const char *path){
-    write_log("myfs_rmdir: %s\n",path);	
-	char* filepath;
-	char* filename;
-	get_path_filename(path, &filename, &filepath);
-    return remove_node(filepath, filename);
+static void myfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	write_log("myfs_ll_unlink(parent=%lu, name=\"%s\")\n", parent, name);
+
+	ll_remove(req, parent, name, MY_OP_UNLINK);
 }
 
-// OPTIONAL - included as an example
-// Flush any cached data.
-int myfs_flush(const char *path, struct fuse_file_info *fi){
-    int retstat = 0;
-    
-    write_log("myfs_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
-	
-    return retstat;
+static void myfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	write_log("myfs_ll_rmdir(parent=%lu, name=\"%s\")\n", parent, name);
+
+	ll_remove(req, parent, name, MY_OP_RMDIR);
 }
 
-// OPTIONAL - included as an example
-// Release the file. There will be one call to release for each call to open.
-int myfs_release(const char *path, struct fuse_file_info *fi){
-    int retstat = 0;
-    
-    write_log("myfs_release(path=\"%s\", fi=0x%08x)\n", path, fi);
-    
-    return retstat;
+static void myfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) {
+	write_log("myfs_ll_rename(parent=%lu, name=\"%s\", newparent=%lu, newname=\"%s\")\n", parent, name, newparent, newname);
+
+	uuid_t from, to;
+	int rc;
+	if (stats_lookup(parent, name) || stats_lookup(newparent, newname)) {
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+	op_begin(MY_OP_RENAME, 1);
+	if ((rc = node_id(parent, from)) == 0 && (rc = node_id(newparent, to)) == 0) {
+		rc = rename_at(from, name, to, newname);
+	}
+	op_end(1);
+	fuse_reply_err(req, -rc);
 }
 
-// OPTIONAL - included as an example
-// Open a file. Open should check if the operation is permitted for the given flags (fi->flags).
-// Read 'man 2 open'.
-static int myfs_open(const char *path, struct fuse_file_info *fi){
-	// if (strcmp(path, the_root_fcb.path) != 0)
-	// 	return -ENOENT;
-		
-	write_log("myfs_open(path\"%s\", fi=0x%08x)\n", path, fi);
-	
-	//return -EACCES if the access is not permitted.
+static void myfs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
+	write_log("myfs_ll_link(ino=%lu, newparent=%lu, newname=\"%s\")\n", ino, newparent, newname);
 
-	return 0;
+	struct fuse_entry_param e;
+	uuid_t id, dir;
+	myent ent;
+	int rc;
+	if (stats_lookup(newparent, newname)) {
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+	op_begin(MY_OP_LINK, 1);
+	if ((rc = node_id(ino, id)) == 0 && (rc = node_id(newparent, dir)) == 0) {
+		rc = uuid_is_null(id) ? -EPERM : link_at(dir, newname, id, &ent);
+	}
+	if (rc == 0) {
+		rc = node_entry(&ent, &e);
+	}
+	op_end(1);
+	if (rc != 0) {
+		fuse_reply_err(req, -rc);
+		return;
+	}
+	fuse_reply_entry(req, &e);
 }
 
-// This struct contains pointers to all the functions defined above
-// It is used to pass the function pointers to fuse
-// fuse will then execute the methods as required 
-static struct fuse_operations myfs_oper = {
-	.getattr	= myfs_getattr,
-	.readdir	= myfs_readdir,
-	.open		= myfs_open,
-	.read		= myfs_read,
-	.create		= myfs_create,
-	.utime 		= myfs_utime,
-	.write		= myfs_write,
-	.truncate	= myfs_truncate,
-	.flush		= myfs_flush,
-	.release	= myfs_release,
-	.mkdir 		= myfs_mkdir,
-	.chmod  	= myfs_chmod,
-	.chown 		= myfs_chown,
-	.unlink 	= myfs_unlink,
-	.rmdir		= myfs_rmdir,
+static struct fuse_lowlevel_ops myfs_ll_oper = {
+	.init		= myfs_ll_init,
+	.destroy	= myfs_ll_destroy,
+	.lookup		= myfs_ll_lookup,
+	.forget		= myfs_ll_forget,
+	.getattr	= myfs_ll_getattr,
+	.setattr	= myfs_ll_setattr,
+	.open		= myfs_ll_open,
+	.read		= myfs_ll_read,
+	.write		= myfs_ll_write,
+	.write_buf	= myfs_ll_write_buf,
+	.flush		= myfs_ll_flush,
+	.release	= myfs_ll_release,
+	.fsync		= myfs_ll_fsync,
+	.fallocate	= myfs_ll_fallocate,
+	.ioctl		= myfs_ll_ioctl,
+	.opendir	= myfs_ll_opendir,
+	.readdir	= myfs_ll_readdir,
+	.releasedir	= myfs_ll_releasedir,
+	.create		= myfs_ll_create,
+	.mkdir		= myfs_ll_mkdir,
+	.unlink		= myfs_ll_unlink,
+	.rmdir		= myfs_ll_rmdir,
+	.rename		= myfs_ll_rename,
+	.link		= myfs_ll_link,
 };
 
+// Mount and serve the low-level frontend until the filesystem is unmounted
+int ll_main(struct fuse_args *args, struct myfs_state *state) {
+	char *mountpoint = NULL;
+	int multithreaded, foreground, err = -1;
+	struct fuse_chan *ch;
+	struct fuse_session *se;
+
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) {
+		return 1;
+	}
+	if ((ch = fuse_mount(mountpoint, args)) != NULL) {
+		if ((se = fuse_lowlevel_new(args, &myfs_ll_oper, sizeof(myfs_ll_oper), state)) != NULL) {
+			if (fuse_set_signal_handlers(se) != -1) {
+				fuse_session_add_chan(se, ch);
+				fuse_daemonize(foreground);
+				err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	free(mountpoint);
+	return err ? 1 : 0;
+}
+
 
 // Initialise the in-memory data structures from the store. If the root object (from the store) is empty then create a root fcb (directory)
 // and write it to the store. Note that this code is executed outide of fuse. If there is a failure then we have failed toi initlaise the 
 // file system so exit with an error code.
 void init_fs(){
 	int rc;
+	pthread_rwlockattr_t attr;
 	printf("init_fs\n");
-	//Initialise the store.
+
+	//Commits wait for the operations running to finish; new ones must not keep them waiting
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&fs_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	for (int i = 0; i < MY_INODE_LOCKS; i++) {
+		pthread_rwlock_init(&inode_locks[i], NULL);
+	}
+
+	//Initialise the store. fuse runs handlers on several threads, so the handle is shared by
+	//them; UnQLite serialises the calls made on it.
+	rc = unqlite_lib_config(UNQLITE_LIB_CONFIG_THREAD_LEVEL_MULTI);
+	if( rc != UNQLITE_OK ) error_handler(rc);
     
 	uuid_clear(zero_uuid);
 	// Open the database.
 	rc = unqlite_open(&pDb,DATABASE_NAME,UNQLITE_OPEN_CREATE);
 	if( rc != UNQLITE_OK ) error_handler(rc);
 
-	unqlite_int64 nBytes;  // Data length
+	unqlite_int64 nBytes = sizeof(myfcb);  // Data length
 
 	// Try to fetch the root element
     // The last parameter is a pointer to a variable which will hold the number of bytes actually read
-	rc = unqlite_kv_fetch(pDb,ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE,&the_root_fcb,&nBytes);
+	rc = kv_fetch(ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE,&the_root_fcb,&nBytes);
 
     // if it doesn't exist, we need to create one and put it into the database. This will be the root
     // directory of our filesystem i.e. "/"
@@ -855,11 +5608,23 @@ void init_fs(){
 		the_root_fcb.uid = getuid();
 		the_root_fcb.gid = getgid();
 		the_root_fcb.nlink = 2;
-		the_root_fcb.nlink = sizeof(myfcb);
+		the_root_fcb.size = sizeof(myfcb);
 		
         // Write the root FCB
 		printf("init_fs: writing root fcb\n");
-		rc = unqlite_kv_store(pDb,ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE,&the_root_fcb,sizeof(myfcb));
+		rc = kv_store(ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE,&the_root_fcb,sizeof(myfcb));
+        if( rc != UNQLITE_OK ) error_handler(rc);
+
+        // Write the superblock, the block size is fixed from now on
+		memset(&the_super, 0, sizeof(mysuper));
+		the_super.magic = MY_MAGIC;
+		the_super.block_size = myfs_options.block_size;
+		if (myfs_options.seq_ids) {
+			the_super.flags |= MY_SUPER_SEQIDS;
+			the_super.seq_limit = seq_next;
+		}
+		printf("init_fs: writing superblock, block size %u%s\n", the_super.block_size, myfs_options.seq_ids ? ", sequential ids" : "");
+		rc = kv_store(SUPER_OBJECT_KEY,SUPER_OBJECT_KEY_SIZE,&the_super,sizeof(mysuper));
         if( rc != UNQLITE_OK ) error_handler(rc);
     } 
     else
@@ -871,16 +5636,59 @@ void init_fs(){
 			printf("Data object has unexpected size. Doing nothing.\n");
 			exit(-1);
         }
+		//A superblock from before sequential ids stops after block_size, the rest reads as zeros
+		nBytes = sizeof(mysuper);
+		memset(&the_super, 0, sizeof(mysuper));
+		rc = kv_fetch(SUPER_OBJECT_KEY,SUPER_OBJECT_KEY_SIZE,&the_super,&nBytes);
+		if(rc!=UNQLITE_OK || nBytes<offsetof(mysuper, flags) || nBytes>sizeof(mysuper) || the_super.magic!=MY_MAGIC) {
+			printf("Superblock is missing or has unexpected size. Doing nothing.\n");
+			exit(-1);
+		}
+		if(the_super.seq_limit>seq_next) {
+			seq_next = the_super.seq_limit;	//Past every id which may have been handed out
+		}
+		if(!(the_super.flags & MY_SUPER_SEQIDS)!=!myfs_options.seq_ids) {
+			printf("init_fs: the existing filesystem %s sequential ids\n", the_super.flags & MY_SUPER_SEQIDS ? "uses" : "does not use");
+		}
+		if(the_super.block_size!=myfs_options.block_size) {
+			printf("init_fs: using the block size of the existing filesystem, %u\n", the_super.block_size);
+		}
+		free_list_load();
+		orphan_load();
     }
 }
 
 void shutdown_fs(){
+	icache_flush_all();
+	free_list_store();
+	orphan_store();
 	unqlite_close(pDb);
+	log_stop();
+}
+
+//The high-level library keeps the attribute and entry caches itself, so our timeouts are handed on
+//to it, along with use_ino to have it report the inode numbers fill_stat gives
+int cache_args(struct fuse_args *args) {
+	char opt[128];
+	snprintf(opt, sizeof(opt), "-oattr_timeout=%g,entry_timeout=%g,negative_timeout=%g,use_ino",
+		myfs_options.attr_timeout, myfs_options.entry_timeout, myfs_options.negative_timeout);
+	return fuse_opt_add_arg(args, opt);
 }
 
 int main(int argc, char *argv[]){	
 	int fuserc;
 	struct myfs_state *myfs_internal_state;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+	//Pick out our own options, the rest are passed on to fuse
+	if (fuse_opt_parse(&args, &myfs_options, myfs_opts, NULL) == -1) {
+		return EXIT_FAILURE;
+	}
+	if (myfs_options.block_size < MY_MIN_BLOCK_SIZE || myfs_options.block_size > MY_MAX_BLOCK_SIZE ||
+		(myfs_options.block_size & (myfs_options.block_size - 1)) != 0) {
+		fprintf(stderr, "blocksize must be a power of two from %d to %d\n", MY_MIN_BLOCK_SIZE, MY_MAX_BLOCK_SIZE);
+		return EXIT_FAILURE;
+	}
 
 	//Setup the log file and store the FILE* in the private data object for the file system.	
 	myfs_internal_state = malloc(sizeof(struct myfs_state));
@@ -892,10 +5700,19 @@ int main(int argc, char *argv[]){
     // Now pass our function pointers over to FUSE, so they can be called whenever someone
     // tries to interact with our filesystem. The internal state contains a file handle
     // for the logging mechanism
-	fuserc = fuse_main(argc, argv, &myfs_oper, myfs_internal_state);
+	if (myfs_options.lowlevel) {
+		fuserc = ll_main(&args, myfs_internal_state);
+	}
+	else if (cache_args(&args) != 0) {
+		fuserc = EXIT_FAILURE;
+	}
+	else {
+		fuserc = fuse_main(args.argc, args.argv, &myfs_oper, myfs_internal_state);
+	}
 	
 	//Shutdown the file system.
 	shutdown_fs();
+	fuse_opt_free_args(&args);
 	
 	return fuserc;
 }
@@ -3,18 +3,65 @@
 #include <unqlite.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 
-#define MY_MAX_PATH 255
-#define MY_MAX_FILE_SIZE 1000
-#define MY_MAX_INDIRECT 15
+#define MY_MAX_PATH 256             /* a name of up to NAME_MAX bytes and its terminator */
+#define MY_MAX_INDIRECT 256         /* keys per indirect block */
 #define MY_MAX_DIRECT 13
 #define MY_MAX_FREE 14
+#define MY_DCACHE_BUCKETS 4096      /* hash buckets of the dentry cache */
+#define MY_DCACHE_SIZE 8192         /* memory budget of the dentry cache, in entries */
+#define MY_ICACHE_BUCKETS 1024      /* hash buckets of the inode cache */
+#define MY_ICACHE_SIZE 4096         /* memory budget of the inode cache, in fcbs */
+#define MY_NODE_BUCKETS 4096        /* hash buckets of the low-level inode number table */
+#define MY_INODE_LOCKS 256          /* reader/writer locks the fcbs are striped over */
+#define MY_LOCK_SET 4               /* fcbs locked together at most, by rename */
+#define MY_DIR_LOAD 64              /* entries per directory bucket before a split */
+#define MY_DEFAULT_BLOCK_SIZE 4096  /* data block size of a new filesystem */
+#define MY_MIN_BLOCK_SIZE 4096
+#define MY_MAX_BLOCK_SIZE (1 << 20)
+#define MY_MAGIC 0x6d796673         /* "myfs" */
+#define MY_INLINE_EXTENTS 7         /* extents held in the fcb before they move to their own record */
+#define MY_MAX_EXTENT 0xffffffffu   /* blocks in one extent */
+#define MY_DIRTY_LIMIT (8 << 20)    /* bytes of written data an inode holds before storing them */
+#define MY_READAHEAD_MIN (64 << 10) /* readahead window of a reader found to be sequential, in bytes */
+#define MY_READAHEAD_MAX (2 << 20)  /* largest the window grows to */
+#define MY_MAX_WRITE (1 << 20)      /* largest write asked of the kernel, fuse caps it to its buffers */
+#define MY_COMMIT_OPS 256           /* changing operations committed together */
+#define MY_COMMIT_MS 1000           /* longest a change waits for its commit, in milliseconds */
+#define MY_SEQ_BATCH 1024           /* sequential ids reserved in the superblock at a time */
+#define MY_RECLAIM_BATCH 1024       /* blocks of an orphan the reclaimer frees in one operation */
+#define MY_ATTR_TIMEOUT 30.0        /* seconds the kernel may cache attributes for */
+#define MY_ENTRY_TIMEOUT 30.0       /* seconds the kernel may cache a name lookup for */
+#define MY_NEGATIVE_TIMEOUT 10.0    /* seconds the kernel may cache a name as missing for */
+#define MY_LOG_RING (256 << 10)     /* bytes of log records a thread holds before they are dropped */
+#define MY_LOG_RECORD 1024          /* largest log record, longer strings are cut short */
+#define MY_LOG_FLUSH_MS 50          /* how often the log flusher drains the rings */
+#define MY_HIST_SUB_BITS 3          /* a latency histogram splits each power of two in 1 << this */
+#define MY_HIST_BUCKETS ((64 - MY_HIST_SUB_BITS + 1) << MY_HIST_SUB_BITS)
+
+#define MY_LAYOUT_BLOCKS 0          /* data found through direct and indirect block keys */
+#define MY_LAYOUT_EXTENTS 1         /* data found through a sorted list of extents */
+#define MY_LAYOUT_INLINE 2          /* data held in the fcb itself */
+#define MY_INLINE_DATA ((MY_MAX_DIRECT + 3) * 16)   /* bytes of data held in place of the block keys */
+
+#define MY_SUPER_SEQIDS 0x1         /* ids are sequential numbers instead of random uuids */
+
+//lseek SEEK_DATA and SEEK_HOLE as ioctls, since fuse 2 has no lseek operation. The argument is
+//the offset to search from, and gets back the offset found.
+#define MYFS_IOC_SEEK_DATA _IOWR('m', 1, off_t)
+#define MYFS_IOC_SEEK_HOLE _IOWR('m', 2, off_t)
 
 
 // This is a starting File Control Block for the 
@@ -28,13 +75,40 @@
 // more sensible FCB to implement a proper filesystem
 //directory access block
 
+//superblock: filesystem wide parameters, fixed when the filesystem is created
+typedef struct _superblock {
+    unsigned int magic;             /* MY_MAGIC */
+    unsigned int block_size;        /* size of a data block in bytes */
+    unsigned int flags;             /* MY_SUPER_SEQIDS */
+    uint64_t seq_limit;             /* sequential ids below this may have been handed out */
+} mysuper;
+
+//ids. By default every record is keyed by a random uuid. With sequential ids (-o seqids) a key is
+//two big-endian 64-bit numbers (hi, lo): a record of its own is (n, 0), n counting up from 1, and
+//block idx of the file with inode number ino is (ino, idx + 1). A key whose lo is 0 is stored as
+//its first 8 bytes only.
+
+//indirect block: keys of the next level of blocks, a null key is a block never written
 typedef struct _indirected {
     uuid_t indirect[MY_MAX_INDIRECT];
 } ind;
 
+//extent: a run of logical blocks whose keys are consecutive. The last four bytes of key count
+//the blocks of the run, so block i of the file is key + (i - block). With sequential ids the key
+//is that of the first block, whose followers come next anyway.
+typedef struct _extent {
+    uint64_t block;                 /* first logical block */
+    uint32_t count;                 /* number of blocks */
+    uuid_t key;                     /* key of the first block, its last four bytes are zero */
+} myextent;
+
 //file control block:
 //inode structure: first 13 with direct access, next three with single indirect access, double indirect access and triple indirect access
-//In basic I will only implement the direct access
+//Each pointer is the key of a data block record of up to block_size bytes; a record shorter than
+//the block, or a null key, reads as zeros past its end.
+//A file with the extent layout keeps a sorted list of extents in place of the block keys, and a
+//small file with the inline layout keeps its data there instead. Bytes of it past the end of the
+//file are always zero.
 typedef struct _myfcb {    
     // see 'man 2 stat' and 'man 2 chmod'
     //meta-data for the 'file'
@@ -45,27 +119,217 @@ typedef struct _myfcb {
     time_t ctime;                   /* time of last change to meta-data (status) */
     nlink_t nlink;                  /* Number of hard link associate with it */
     off_t size;                     /* size */
-    uuid_t direct[MY_MAX_DIRECT];   /* Direct access */
-    uuid_t single_indirect;         /* Single indirect access */
-    uuid_t double_indirect;         /* Double indirect access */
-    uuid_t triple_indirect;         /* Triple indirect access */
+    unsigned int layout;            /* MY_LAYOUT_BLOCKS, MY_LAYOUT_EXTENTS or MY_LAYOUT_INLINE */
+    uint64_t ino;                   /* inode number the block keys derive from, 0 without sequential ids */
+    uint64_t unwritten_first;       /* blocks from here to unwritten_end - 1 may have a key with */
+    uint64_t unwritten_end;         /* nothing stored under it, reserved by fallocate or punched */
+    uint64_t blocks;                /* data blocks with a record stored, for st_blocks */
+    union {
+        struct {
+            uuid_t direct[MY_MAX_DIRECT];   /* Direct access */
+            uuid_t single_indirect;         /* Single indirect access */
+            uuid_t double_indirect;         /* Double indirect access */
+            uuid_t triple_indirect;         /* Triple indirect access */
+        };
+        struct {
+            uuid_t extent_list;             /* record of the extents once there are too many to inline */
+            unsigned int extent_count;      /* number of extents */
+            myextent extent[MY_INLINE_EXTENTS];   /* inline extents, sorted by block */
+        };
+        char data[MY_INLINE_DATA];          /* inline data, the first size bytes of it */
+    };
+    unsigned int dir_level;         /* Directory index: 2^dir_level buckets before splitting */
+    unsigned int dir_split;         /* Directory index: next bucket to split */
+    unsigned long dir_count;        /* Directory index: number of entries */
 } myfcb;
 
+//entry of a directory as found by a lookup; it is stored packed in a bucket as a mydirrec
 typedef struct _entry {
     uuid_t fcb_id;
     char name[MY_MAX_PATH];
 } myent;
 
-typedef struct _file_data {
-    size_t size;
-    char data[MY_MAX_FILE_SIZE];
-} myfile;
+//directory index: a directory is a linear hash table of buckets, each bucket is one record
+//holding its entries packed one after the other
+typedef struct _dir_key {
+    uuid_t dir;                     /* fcb id of the directory, zero_uuid for root */
+    unsigned int bucket;
+} mydirkey;
+
+//packed directory entry: a name of len bytes, without its terminator, follows the header and the
+//next entry follows the name. Every field is bytes, so an entry needs no alignment.
+typedef struct _dir_rec {
+    uuid_t fcb_id;                  /* fcb of the entry */
+    unsigned char len;              /* length of the name */
+    unsigned char type;             /* file type, the S_IFMT bits of its mode shifted down by 12 */
+    char name[];
+} mydirrec;
+
+#define MY_DIR_REC_SIZE(len) (offsetof(mydirrec, name) + (len))
+
+//open directory state kept in fuse_file_info->fh, so that a listing continued at a cookie does
+//not look the directory up by path again
+typedef struct _dir_handle {
+    uuid_t dir;                     /* fcb id of the directory */
+    char *recs;                     /* copy of the bucket being listed, read by the current readdir call */
+    size_t len;                     /* bytes in recs */
+} mydirhandle;
 
+//readdir cookies: 1 and 2 follow "." and "..", an entry position is (reversed name hash, entries
+//of that hash listed before it) from 3 on
+#define MY_DIR_COOKIE(rev, dup) ((((off_t) (rev) << 16) | (off_t) ((dup) & 0xffff)) + 3)
+#define MY_DIR_COOKIE_HASH(off) ((unsigned int) (((off) - 3) >> 16))
+#define MY_DIR_COOKIE_DUP(off) ((unsigned int) (((off) - 3) & 0xffff))
+
+//an entry of a bucket being listed, with the reversed hash of its name
+typedef struct _dir_pos {
+    unsigned int rev;
+    mydirrec *rec;
+} mydirpos;
+
+//free list: ids of deleted records, handed out again before any new one is generated. The record
+//under FREE_OBJECT_KEY is the head of the list and is held in memory; the rest of the list is a
+//chain of full records, each stored under an id it gives back itself once it is taken off.
+//A null id is an empty slot, the ids in use come first.
 typedef struct _free_list {
     uuid_t free_node[MY_MAX_FREE];
-    uuid_t next;
+    uuid_t next;                    /* next record of the list, null at its end */
 } myfree;
 
+//dentry cache entry: resolves (parent fcb id, name) to the entrance found under that parent.
+//Negative entries remember names which are known not to exist.
+typedef struct _dentry {
+    uuid_t parent;                  /* fcb id of the parent directory, zero_uuid for root */
+    myent ent;                      /* cached entry, ent.name is the component name */
+    int negative;                   /* name does not exist under parent */
+    unsigned int hash;              /* hash of (parent, name) */
+    struct _dentry *hnext;          /* chain in the (parent, name) table */
+    struct _dentry *prev, *next;    /* lru list, most recently used first */
+} mydentry;
+
+//dirty data block: written but not stored yet. data holds a whole block, zeros past used.
+typedef struct _block_buf {
+    unsigned long long idx;         /* logical block */
+    size_t used;                    /* length of the record to store */
+    char *data;
+} mybuf;
+
+//block map cache of an inode: the indirect blocks on the path to the last block looked up, one
+//per depth, and the extent list of a file whose extents are not inline. It also holds the data
+//blocks written to the inode until they are stored, which allocates their keys in block order,
+//and a run of clean blocks read ahead of its sequential readers.
+typedef struct _map_cache {
+    uuid_t ind_key[3];              /* key of the indirect block held at each depth, null if none */
+    ind ind_blk[3];
+    myextent *ext;                  /* extent list with room for one more, NULL if not held */
+    unsigned int ext_count;
+    mybuf *dirty;                   /* dirty blocks, sorted by idx */
+    unsigned int ndirty;            /* number of dirty blocks */
+    unsigned int dirty_room;        /* slots allocated in dirty */
+    char *ra;                       /* blocks ra_first to ra_first + ra_count - 1, read ahead */
+    unsigned long long ra_first;
+    unsigned int ra_count;
+    unsigned int ra_room;           /* blocks allocated in ra */
+} mymap;
+
+//inode cache entry: an fcb held in memory. Dirty fcbs are written back to the store on
+//flush/release/fsync, on eviction and at shutdown.
+typedef struct _inode {
+    uuid_t id;                      /* key of the fcb */
+    myfcb fcb;
+    int dirty;                      /* fcb differs from the stored copy */
+    int refs;                       /* open file handles, a referenced inode is never evicted */
+    int detached;                   /* deleted while open, freed with its last handle */
+    mymap *map;                     /* block map cache, allocated on first open */
+    struct _inode *hnext;           /* chain in the id table */
+    struct _inode *prev, *next;     /* lru list, most recently used first */
+} myinode;
+
+//low-level frontend node: the inode number the kernel knows an fcb by, for as long as it holds
+//lookups on it. The root is FUSE_ROOT_ID and has no node.
+typedef struct _node {
+    fuse_ino_t ino;
+    uuid_t id;                      /* key of the fcb */
+    uint64_t nlookup;               /* lookups not forgotten by the kernel yet */
+    struct _node *ino_next;         /* chain in the inode number table */
+    struct _node *id_next;          /* chain in the fcb id table */
+} mynode;
+
+//open file state kept in fuse_file_info->fh, so that read, write, flush and release work
+//without looking the path up again
+typedef struct _file_handle {
+    myinode *inode;                 /* pinned inode cache entry of the file */
+    myent ent;                      /* entrance the file was opened through */
+    off_t ra_next;                  /* offset a sequential read would start at next */
+    size_t ra_window;               /* bytes read ahead of a sequential read, 0 for none */
+} myhandle;
+
+//Operations whose latency is kept. The frontends time each callback under one of these; the
+//reclaimer and group commits are timed too, as they hold up the callbacks.
+#define MY_OP_GETATTR 0
+#define MY_OP_FGETATTR 1
+#define MY_OP_LOOKUP 2
+#define MY_OP_FORGET 3
+#define MY_OP_SETATTR 4
+#define MY_OP_OPENDIR 5
+#define MY_OP_READDIR 6
+#define MY_OP_RELEASEDIR 7
+#define MY_OP_OPEN 8
+#define MY_OP_READ 9
+#define MY_OP_WRITE 10
+#define MY_OP_CREATE 11
+#define MY_OP_MKDIR 12
+#define MY_OP_UNLINK 13
+#define MY_OP_RMDIR 14
+#define MY_OP_RENAME 15
+#define MY_OP_LINK 16
+#define MY_OP_UTIME 17
+#define MY_OP_CHMOD 18
+#define MY_OP_CHOWN 19
+#define MY_OP_TRUNCATE 20
+#define MY_OP_FALLOCATE 21
+#define MY_OP_IOCTL 22
+#define MY_OP_FLUSH 23
+#define MY_OP_RELEASE 24
+#define MY_OP_FSYNC 25
+#define MY_OP_RECLAIM 26
+#define MY_OP_COMMIT 27
+#define MY_OP_COUNT 28
+
+//What an operation's time is split into: all of it, and the part of it spent looking path
+//components up, fetching from the store and storing into it. The parts overlap, a lookup
+//fetches the directory it looks in.
+#define MY_PHASE_TOTAL 0
+#define MY_PHASE_LOOKUP 1
+#define MY_PHASE_FETCH 2
+#define MY_PHASE_STORE 3
+#define MY_PHASE_COUNT 4
+
+//latency histogram, log-linear like HdrHistogram: values under 1 << MY_HIST_SUB_BITS
+//nanoseconds have a bucket each, every power of two above is split into 1 << MY_HIST_SUB_BITS
+//buckets, so a value is known to within an eighth. Updated without a lock by every thread.
+typedef struct _histogram {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum_ns;
+    atomic_uint_fast64_t max_ns;
+    atomic_uint_fast64_t bucket[MY_HIST_BUCKETS];
+} myhist;
+
+//The statistics are read through a directory of their own under the root, which is never
+//stored: its one file renders the histograms, the spread of the inode cache and the orphans
+//left to reclaim when it is opened and serves that text until it is released. The low-level frontend knows them by inode
+//numbers no node is ever given.
+#define MY_STATS_DIR ".myfs"
+#define MY_STATS_FILE "stats"
+#define MY_STATS_DIR_INO ((fuse_ino_t) -2)
+#define MY_STATS_INO ((fuse_ino_t) -3)
+
+//an open stats file, kept in fuse_file_info->fh
+typedef struct _stats_text {
+    char *text;
+    size_t len;
+} mystats;
+
 // Some other useful definitions we might need
 
 extern unqlite_int64 root_object_size_value;
@@ -74,6 +338,18 @@ extern unqlite_int64 root_object_size_value;
 #define ROOT_OBJECT_KEY "root"
 #define ROOT_OBJECT_KEY_SIZE 4
 
+// The superblock lives under its own well-known key
+#define SUPER_OBJECT_KEY "super"
+#define SUPER_OBJECT_KEY_SIZE 5
+
+// And so does the head of the free list
+#define FREE_OBJECT_KEY "free"
+#define FREE_OBJECT_KEY_SIZE 4
+
+// And so does the orphan list, the ids of the fcbs still to be reclaimed
+#define ORPHAN_OBJECT_KEY "orphans"
+#define ORPHAN_OBJECT_KEY_SIZE 7
+
 // This is the size of a regular key used to fetch things from the 
 // database. We use uuids as keys, so 16 bytes each
 #define KEY_SIZE 16
@@ -87,9 +363,33 @@ extern unqlite *pDb;
 
 extern void error_handler(int);
 void print_id(uuid_t *);
+int flush_blocks(myfcb *, mymap *);
+int node_held(uuid_t);
+void icache_spread(FILE *);
+unsigned int orphan_pending();
 
 extern FILE* init_log_file();
-extern void write_log(const char *, ...);
+extern void log_record(int, const char *, ...);
+void log_start();
+void log_stop();
+
+//Log levels. A line is recorded when its level is at most MY_LOG_LEVEL, fixed when compiling, and
+//at most myfs_options.log_level, given with -o loglevel=N. write_log traces operations.
+#define MY_LOG_OFF 0
+#define MY_LOG_ERROR 1
+#define MY_LOG_INFO 2
+#define MY_LOG_TRACE 3
+#ifndef MY_LOG_LEVEL
+#define MY_LOG_LEVEL MY_LOG_TRACE   /* -DMY_LOG_LEVEL=0 compiles every log call out */
+#endif
+#define log_at(level, ...) do { \
+        if ((level) <= MY_LOG_LEVEL && (level) <= myfs_options.log_level) { \
+            log_record((level), __VA_ARGS__); \
+        } \
+    } while (0)
+#define log_error(...) log_at(MY_LOG_ERROR, __VA_ARGS__)
+#define log_info(...) log_at(MY_LOG_INFO, __VA_ARGS__)
+#define write_log(...) log_at(MY_LOG_TRACE, __VA_ARGS__)
 
 extern uuid_t zero_uuid;
 
@@ -100,6 +400,21 @@ struct myfs_state {
 };
 #define NEWFS_PRIVATE_DATA ((struct myfs_state *) fuse_get_context()->private_data)
 
+// Options of our own, given with -o on the command line and parsed before fuse_main sees them
+struct myfs_options {
+    unsigned int block_size;        /* -o blocksize=N, only used when a new filesystem is created */
+    int extents;                    /* -o extents, new files use the extent layout */
+    unsigned int commit_ops;        /* -o commit_ops=N, operations per group commit */
+    unsigned int commit_ms;         /* -o commit_ms=T, age at which a group is committed anyway */
+    int lowlevel;                   /* -o lowlevel, serve the low-level (inode number) API */
+    int seq_ids;                    /* -o seqids, only used when a new filesystem is created */
+    double attr_timeout;            /* -o attr_timeout=T, seconds attributes are cached by the kernel */
+    double entry_timeout;           /* -o entry_timeout=T, seconds name lookups are cached */
+    double negative_timeout;        /* -o negative_timeout=T, seconds names are cached as missing */
+    int log_level;                  /* -o loglevel=N, MY_LOG_OFF to MY_LOG_TRACE */
+};
+extern struct myfs_options myfs_options;
+
 
 
 
@@ -120,16 +435,317 @@ FILE *init_log_file(){
 		perror("Unable to open log file. Life is not worth living.");
 		exit(EXIT_FAILURE);
     }
-    //Use line buffering
-    setvbuf(logfile, NULL, _IOLBF, 0);
+    //Only the flusher writes to it, a buffer at a time
+    setvbuf(logfile, NULL, _IOFBF, 1 << 16);
     return logfile;
 }
 
-// Write to the provided handle
-void write_log(const char *format, ...){
+// A log call whose level is off costs a compare, and nothing at all past MY_LOG_LEVEL. One that
+// is on copies its format pointer and its arguments, as they are, into a ring buffer of the
+// calling thread: no lock is taken and nothing is formatted. The flusher thread drains the rings,
+// formats the records in the order they were made and writes them out. A record which finds its
+// ring full is dropped and counted rather than wait, and a ring half full wakes the flusher early.
+// Formats are string literals, which outlive the record; strings passed with %s are copied in.
+typedef struct _mylogring {
+    char buf[MY_LOG_RING];              /* records, none of them wrapping around the end */
+    _Atomic uint64_t head;              /* bytes written, moved by the owning thread */
+    _Atomic uint64_t tail;              /* bytes formatted, moved by the flusher */
+    _Atomic unsigned long dropped;      /* records lost to a full ring since last reported */
+    _Atomic int dead;                   /* the thread exited, the ring goes once drained */
+    struct _mylogring *next;
+} mylogring;
+
+//Header of a record, followed by an 8 byte slot per argument. A string's slot holds its length
+//and its bytes follow, with a NUL, up to the next slot.
+typedef struct _mylogrec {
+    uint32_t size;                      /* bytes of the record, header included, a multiple of 8 */
+    uint32_t level;
+    uint64_t ns;                        /* when it was made, orders the records of the rings */
+    const char *format;                 /* NULL for padding up to the end of the ring */
+} mylogrec;
+
+mylogring *log_rings;                   //every ring, guarded by log_lock
+static __thread mylogring *log_ring;    //the ring of this thread
+pthread_key_t log_key;
+pthread_once_t log_once = PTHREAD_ONCE_INIT;
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+pthread_t log_thread;
+int log_running;
+int log_stopping;
+
+void log_ring_exit(void *ring) {
+    atomic_store_explicit(&(((mylogring *) ring)->dead), 1, memory_order_release);
+}
+
+void log_key_create() {
+    pthread_key_create(&log_key, log_ring_exit);
+}
+
+//The ring of this thread, made on its first record
+mylogring *log_ring_get() {
+    if (log_ring == NULL && (log_ring = calloc(1, sizeof(mylogring))) != NULL) {
+        pthread_once(&log_once, log_key_create);
+        pthread_setspecific(log_key, log_ring);
+        pthread_mutex_lock(&log_lock);
+        log_ring->next = log_rings;
+        log_rings = log_ring;
+        pthread_mutex_unlock(&log_lock);
+    }
+    return log_ring;
+}
+
+//Take apart the conversion at p, just past a '%': its length modifier, 'H' for hh, 'L' for ll and
+//otherwise the letter or 0, its conversion character, and where it ends
+char log_conv(const char *p, char *mod, const char **end) {
+    p += strspn(p, "-+ #0123456789.");
+    *mod = 0;
+    if (*p == 'h' || *p == 'l' || *p == 'z' || *p == 'j' || *p == 't') {
+        *mod = *p++;
+        if (*p == *mod && (*mod == 'h' || *mod == 'l')) {
+            *mod = *mod == 'h' ? 'H' : 'L';
+            p++;
+        }
+    }
+    *end = *p != '\0' ? p + 1 : p;
+    return *p;
+}
+
+//Record a line at level. Only called through the log macros, which check the level.
+void log_record(int level, const char *format, ...) {
+    uint64_t slots[MY_LOG_RECORD / 8];
+    mylogrec *rec = (mylogrec *) slots;
+    size_t used = sizeof(mylogrec);
+    mylogring *r;
+    struct timespec now;
     va_list ap;
+
+    if ((r = log_ring_get()) == NULL) {
+        return;
+    }
     va_start(ap, format);
-    vfprintf(NEWFS_PRIVATE_DATA->logfile, format, ap);
+    //Each argument takes a slot, and a string at least its terminator as well, so a slot is only
+    //taken while there is room for both
+    for (const char *p = strchr(format, '%'); p != NULL && used + 8 + 1 <= MY_LOG_RECORD; p = strchr(p, '%')) {
+        char mod, conv = log_conv(p + 1, &mod, &p);
+        uint64_t *slot = (uint64_t *) ((char *) slots + used);
+        if (conv == '%') {
+            continue;
+        }
+        used += 8;
+        if (conv == 'd' || conv == 'i' || conv == 'c') {
+            *slot = mod == 'L' || mod == 'j' ? (uint64_t) va_arg(ap, long long) :
+                mod == 'l' || mod == 'z' || mod == 't' ? (uint64_t) va_arg(ap, long) : (uint64_t) va_arg(ap, int);
+        }
+        else if (conv == 'u' || conv == 'x' || conv == 'X' || conv == 'o') {
+            *slot = mod == 'L' || mod == 'j' ? (uint64_t) va_arg(ap, unsigned long long) :
+                mod == 'l' || mod == 'z' || mod == 't' ? (uint64_t) va_arg(ap, unsigned long) : (uint64_t) va_arg(ap, unsigned int);
+        }
+        else if (conv == 'p') {
+            *slot = (uintptr_t) va_arg(ap, void *);
+        }
+        else if (conv == 'f' || conv == 'g' || conv == 'e' || conv == 'F' || conv == 'G' || conv == 'E') {
+            double d = va_arg(ap, double);
+            memcpy(slot, &d, 8);
+        }
+        else if (conv == 's') {
+            const char *s = va_arg(ap, const char *);
+            size_t n = strnlen(s != NULL ? s : "(null)", MY_LOG_RECORD - used - 1);	//used is past the slot, at most MY_LOG_RECORD - 1
+            memcpy((char *) slots + used, s != NULL ? s : "(null)", n);
+            ((char *) slots)[used + n] = '\0';
+            *slot = n;
+            used += (n + 8) & ~(size_t) 7;
+        }
+        else {
+            break;		//Not one we know, the rest of the format is written as it is
+        }
+    }
+    va_end(ap);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rec->size = used;
+    rec->level = level;
+    rec->ns = (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+    rec->format = format;
+
+    //Records do not wrap: one which would is put at the start, after padding out the end
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    size_t at = head & (MY_LOG_RING - 1), pad = MY_LOG_RING - at < used ? MY_LOG_RING - at : 0;
+    if (head + pad + used - tail > MY_LOG_RING) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    if (pad >= sizeof(mylogrec)) {
+        ((mylogrec *) (r->buf + at))->size = pad;
+        ((mylogrec *) (r->buf + at))->format = NULL;
+    }
+    memcpy(r->buf + ((head + pad) & (MY_LOG_RING - 1)), slots, used);
+    atomic_store_explicit(&r->head, head + pad + used, memory_order_release);
+    if (head - tail < MY_LOG_RING / 2 && head + pad + used - tail >= MY_LOG_RING / 2) {
+        pthread_cond_signal(&log_cond);		//Half full, wake the flusher early
+    }
+}
+
+//The next record of a ring, NULL if it has none. Only the flusher calls this.
+mylogrec *log_peek(mylogring *r) {
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    while (tail != head) {
+        size_t at = tail & (MY_LOG_RING - 1);
+        mylogrec *rec = (mylogrec *) (r->buf + at);
+        if (MY_LOG_RING - at < sizeof(mylogrec)) {
+            tail += MY_LOG_RING - at;		//Too short to hold a padding record
+        }
+        else if (rec->format == NULL) {
+            tail += rec->size;
+        }
+        else {
+            break;
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+    return tail == head ? NULL : (mylogrec *) (r->buf + (tail & (MY_LOG_RING - 1)));
+}
+
+//Write out a record, formatting each conversion of its format with the argument kept for it
+void log_format(mylogrec *rec, FILE *f) {
+    const char *p = rec->format, *end;
+    const char *slots = (const char *) rec, *stop = slots + rec->size;
+    size_t used = sizeof(mylogrec);
+    char spec[32];
+
+    while (*p != '\0') {
+        const char *pct = strchr(p, '%');
+        if (pct == NULL) {
+            fputs(p, f);
+            return;
+        }
+        fwrite(p, 1, pct - p, f);
+        char mod, conv = log_conv(pct + 1, &mod, &end);
+        uint64_t v;
+        if (conv == '%') {
+            fputc('%', f);
+            p = end;
+            continue;
+        }
+        if (slots + used + 8 > stop || (size_t) (end - pct) >= sizeof(spec)) {
+            fputs(pct, f);		//Past what was recorded
+            return;
+        }
+        memcpy(&v, slots + used, 8);
+        memcpy(spec, pct, end - pct);
+        spec[end - pct] = '\0';
+        used += 8;
+        if (conv == 'd' || conv == 'i' || conv == 'c') {
+            if (mod == 'L' || mod == 'j') fprintf(f, spec, (long long) v);
+            else if (mod == 'l' || mod == 'z' || mod == 't') fprintf(f, spec, (long) v);
+            else fprintf(f, spec, (int) v);
+        }
+        else if (conv == 'u' || conv == 'x' || conv == 'X' || conv == 'o') {
+            if (mod == 'L' || mod == 'j') fprintf(f, spec, (unsigned long long) v);
+            else if (mod == 'l' || mod == 'z' || mod == 't') fprintf(f, spec, (unsigned long) v);
+            else fprintf(f, spec, (unsigned int) v);
+        }
+        else if (conv == 'p') {
+            fprintf(f, spec, (void *) (uintptr_t) v);
+        }
+        else if (conv == 'f' || conv == 'g' || conv == 'e' || conv == 'F' || conv == 'G' || conv == 'E') {
+            double d;
+            memcpy(&d, &v, 8);
+            fprintf(f, spec, d);
+        }
+        else if (conv == 's') {
+            fprintf(f, spec, slots + used);
+            used += (v + 8) & ~(uint64_t) 7;
+        }
+        else {
+            fputs(pct, f);
+            return;
+        }
+        p = end;
+    }
+}
+
+//Write out what the rings hold, oldest record first, and free the rings of threads gone. The
+//caller holds log_lock.
+void log_drain() {
+    mylogring *r, **pp;
+    for (;;) {
+        mylogring *first = NULL;
+        mylogrec *rec, *oldest = NULL;
+        for (r = log_rings; r != NULL; r = r->next) {
+            if ((rec = log_peek(r)) != NULL && (oldest == NULL || rec->ns < oldest->ns)) {
+                first = r;
+                oldest = rec;
+            }
+        }
+        if (first == NULL) {
+            break;
+        }
+        if (logfile != NULL) {
+            log_format(oldest, logfile);
+        }
+        atomic_fetch_add_explicit(&first->tail, oldest->size, memory_order_release);
+    }
+    for (pp = &log_rings; (r = *pp) != NULL; ) {
+        unsigned long dropped = atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+        if (dropped > 0 && logfile != NULL) {
+            fprintf(logfile, "log: %lu lines dropped, the flusher fell behind\n", dropped);
+        }
+        if (atomic_load_explicit(&r->dead, memory_order_acquire) && log_peek(r) == NULL) {
+            *pp = r->next;
+            free(r);
+        }
+        else {
+            pp = &r->next;
+        }
+    }
+    if (logfile != NULL) {
+        fflush(logfile);
+    }
+}
+
+void *log_loop(void *arg) {
+    (void) arg;
+    struct timespec due;
+    pthread_mutex_lock(&log_lock);
+    while (!log_stopping) {
+        log_drain();
+        clock_gettime(CLOCK_REALTIME, &due);
+        due.tv_nsec += MY_LOG_FLUSH_MS * 1000000L;
+        due.tv_sec += due.tv_nsec / 1000000000L;
+        due.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&log_cond, &log_lock, &due);
+    }
+    pthread_mutex_unlock(&log_lock);
+    return NULL;
+}
+
+//Start the flusher. It is started once fuse is running, a thread does not survive its daemonizing
+//fork. Records made before then wait in their rings.
+void log_start() {
+    pthread_mutex_lock(&log_lock);
+    if (!log_running) {
+        log_stopping = 0;
+        log_running = pthread_create(&log_thread, NULL, log_loop, NULL) == 0;
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+//Stop the flusher, if it runs, and write out every record left
+void log_stop() {
+    pthread_mutex_lock(&log_lock);
+    int running = log_running;
+    log_stopping = 1;
+    log_running = 0;
+    pthread_cond_signal(&log_cond);
+    pthread_mutex_unlock(&log_lock);
+    if (running) {
+        pthread_join(log_thread, NULL);
+    }
+    pthread_mutex_lock(&log_lock);
+    log_drain();
+    pthread_mutex_unlock(&log_lock);
 }
 
 // Simple error handler which cleans up and quits
@@ -1,11 +1,1034 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #define FILE "mnt/afile.txt"
+#define STATS "mnt/.myfs/stats"
+#define MYFS_IOC_SEEK_DATA _IOWR('m', 1, off_t)	//as in myfs.h
+#define MYFS_IOC_SEEK_HOLE _IOWR('m', 2, off_t)
+
+//Read the stats file into buf, as a string
+int read_stats(char *buf, size_t size){
+	int res=0;
+	size_t len=0;
+	int fd=open(STATS, O_RDONLY);
+	if(fd==-1){
+		res=errno;
+		perror("open stats");
+		return res;
+	}
+	for(int rd=1;rd>0 && len<size-1;len+=rd){
+		rd=read(fd,buf+len,size-1-len);
+		if(rd==-1){
+			res=errno;
+			perror("read stats");
+			break;
+		}
+	}
+	buf[len]='\0';
+	close(fd);
+	return res;
+}
+
+//Create files dir/<prefix><i> for i from first to last-1
+int make_files(const char *dir, const char *prefix, int first, int last){
+	int res=0;
+	char name[256];
+	for(int i=first;i<last && res==0;i++){
+		sprintf(name,"%s/%s%d",dir,prefix,i);
+		int fd=open(name, O_RDWR|O_CREAT, S_IRWXU);
+		if(fd==-1){
+			res=errno;
+			perror(name);
+		}else{
+			close(fd);
+		}
+	}
+	return res;
+}
+
+//List dir, counting in seen[i] how many times <prefix><i> comes up for i below n. Any other name
+//but . and .. is an error.
+int list_files(const char *dir, const char *prefix, unsigned char *seen, int n){
+	int res=0;
+	size_t len=strlen(prefix);
+	struct dirent *de;
+	DIR *d=opendir(dir);
+	if(d==NULL){
+		res=errno;
+		perror(dir);
+		return res;
+	}
+	memset(seen,0,n);
+	while(res==0 && (de=readdir(d))!=NULL){
+		char *end;
+		long i=strtol(de->d_name+len,&end,10);
+		if(strcmp(de->d_name,".")==0 || strcmp(de->d_name,"..")==0){
+			continue;
+		}
+		if(strncmp(de->d_name,prefix,len)!=0 || *end!='\0' || end==de->d_name+len || i<0 || i>=n){
+			fprintf(stderr,"%s: unexpected entry %s\n",dir,de->d_name);
+			res=EIO;
+		}else{
+			seen[i]++;
+		}
+	}
+	closedir(d);
+	return res;
+}
+
+//The directory index: a few thousand entries split the hash table of a directory many times.
+//Every name has to be found, listed once, and gone once unlinked, and the directory can only be
+//removed once it is empty.
+#define DIR_FILES 2000
+int test_big_dir(){
+	int res=0;
+	static unsigned char seen[DIR_FILES];
+	char name[64];
+	struct stat st;
+	if(mkdir("mnt/big", S_IRWXU)!=0){
+		res=errno;
+		perror("mkdir");
+		return res;
+	}
+	if((res=make_files("mnt/big","f",0,DIR_FILES))!=0){
+		return res;
+	}
+	for(int i=0;i<DIR_FILES && res==0;i++){
+		sprintf(name,"mnt/big/f%d",i);
+		if(stat(name,&st)!=0 || !S_ISREG(st.st_mode)){
+			res=errno?errno:EIO;
+			perror(name);
+		}
+	}
+	if(res==0 && (res=list_files("mnt/big","f",seen,DIR_FILES))==0){
+		for(int i=0;i<DIR_FILES && res==0;i++){
+			if(seen[i]!=1){
+				fprintf(stderr,"big dir: f%d listed %d times\n",i,seen[i]);
+				res=EIO;
+			}
+		}
+	}
+	if(res==0 && rmdir("mnt/big")==0){
+		fprintf(stderr,"big dir: removed while not empty\n");
+		res=EIO;
+	}
+	for(int i=0;i<DIR_FILES && res==0;i+=2){
+		sprintf(name,"mnt/big/f%d",i);
+		if(unlink(name)!=0){
+			res=errno;
+			perror(name);
+		}
+	}
+	if(res==0 && (res=list_files("mnt/big","f",seen,DIR_FILES))==0){
+		for(int i=0;i<DIR_FILES && res==0;i++){
+			sprintf(name,"mnt/big/f%d",i);
+			int found=stat(name,&st)==0;
+			if(seen[i]!=i%2 || found!=i%2){
+				fprintf(stderr,"big dir: f%d listed %d times, found %d, after unlinking the even ones\n",i,seen[i],found);
+				res=EIO;
+			}
+		}
+	}
+	for(int i=1;i<DIR_FILES;i+=2){
+		sprintf(name,"mnt/big/f%d",i);
+		unlink(name);
+	}
+	if(rmdir("mnt/big")!=0 && res==0){
+		res=errno;
+		perror("rmdir");
+	}
+	return res;
+}
+
+//Contents of block idx of a test file: its number, then a byte derived from it
+void fill_block(char *buf, size_t bs, long long idx){
+	memset(buf,'a'+idx%26,bs);
+	sprintf(buf,"block %lld",idx);
+}
+
+//Read block idx of fd and compare it with what fill_block wrote, or with zeros if zero is set
+int check_block(int fd, size_t bs, long long idx, int zero){
+	static char want[1<<16], got[1<<16];
+	if(zero){
+		memset(want,0,bs);
+	}else{
+		fill_block(want,bs,idx);
+	}
+	ssize_t rd=pread(fd,got,bs,idx*(off_t)bs);
+	if(rd!=(ssize_t)bs || memcmp(want,got,bs)!=0){
+		fprintf(stderr,"block %lld: read %ld bytes, %s\n",idx,(long)rd,rd==(ssize_t)bs?"wrong data":"short");
+		return EIO;
+	}
+	return 0;
+}
+
+//The block map: blocks at either end of the direct keys and of the single, double and triple
+//indirect trees of a sparse file are written and read back, the holes between them read as
+//zeros, and truncating back through the trees keeps what is left.
+#define DIRECT 13
+#define INDIRECT 256
+int test_block_map(){
+	int res=0;
+	static char block[1<<16];
+	long long single=DIRECT, dbl=single+INDIRECT, triple=dbl+(long long)INDIRECT*INDIRECT;
+	long long data[]={0,DIRECT-1,single,dbl-1,dbl,triple-1,triple,triple+3*(long long)INDIRECT*INDIRECT+7};
+	long long holes[]={1,single+1,dbl+1,dbl+INDIRECT,triple+1,triple+(long long)INDIRECT*INDIRECT};
+	int ndata=sizeof(data)/sizeof(data[0]), nholes=sizeof(holes)/sizeof(holes[0]);
+	struct stat st;
+	int fd=open("mnt/map", O_RDWR|O_CREAT, S_IRWXU);
+	if(fd==-1){
+		res=errno;
+		perror("open");
+		return res;
+	}
+	fstat(fd,&st);
+	size_t bs=st.st_blksize;
+	for(int i=0;i<ndata && res==0;i++){
+		fill_block(block,bs,data[i]);
+		if(pwrite(fd,block,bs,data[i]*(off_t)bs)!=(ssize_t)bs){
+			res=errno;
+			perror("write");
+		}
+	}
+	if(res==0 && fsync(fd)!=0){
+		res=errno;
+		perror("fsync");
+	}
+	for(int i=0;i<ndata && res==0;i++){
+		res=check_block(fd,bs,data[i],0);
+	}
+	for(int i=0;i<nholes && res==0;i++){
+		res=check_block(fd,bs,holes[i],1);
+	}
+	if(res==0 && (fstat(fd,&st)!=0 || st.st_size!=(data[ndata-1]+1)*(off_t)bs)){
+		fprintf(stderr,"block map: size %lld\n",(long long)st.st_size);
+		res=EIO;
+	}
+	//Cut the triple indirect tree off, then all of it
+	if(res==0 && ftruncate(fd,triple*(off_t)bs)!=0){
+		res=errno;
+		perror("ftruncate");
+	}
+	for(int i=0;i<ndata && data[i]<triple && res==0;i++){
+		res=check_block(fd,bs,data[i],0);
+	}
+	if(res==0 && ftruncate(fd,(triple+1)*(off_t)bs)==0){
+		res=check_block(fd,bs,triple,1);
+	}
+	if(res==0 && (ftruncate(fd,0)!=0 || fstat(fd,&st)!=0 || st.st_size!=0 || pread(fd,block,bs,0)!=0)){
+		fprintf(stderr,"block map: not empty after truncating to 0\n");
+		res=EIO;
+	}
+	close(fd);
+	unlink("mnt/map");
+	return res;
+}
+
+//The extent layout, on a mount made with -o extents: every other block of a file written back to
+//front makes more extents than the fcb holds, so they move to a record of their own; filling the
+//gaps and truncating to a few blocks brings them back into the fcb. The data has to read back
+//the same all the way through, whatever the layout.
+#define EXT_BLOCKS 40
+int test_extents(){
+	int res=0;
+	static char block[1<<16];
+	struct stat st;
+	int fd=open("mnt/ext", O_RDWR|O_CREAT, S_IRWXU);
+	if(fd==-1){
+		res=errno;
+		perror("open");
+		return res;
+	}
+	fstat(fd,&st);
+	size_t bs=st.st_blksize;
+	for(int pass=0;pass<2 && res==0;pass++){
+		for(int i=EXT_BLOCKS-2+pass;i>=0 && res==0;i-=2){
+			fill_block(block,bs,i);
+			if(pwrite(fd,block,bs,i*(off_t)bs)!=(ssize_t)bs){
+				res=errno;
+				perror("write");
+			}
+		}
+		if(res==0 && fsync(fd)!=0){
+			res=errno;
+			perror("fsync");
+		}
+		for(int i=0;i<EXT_BLOCKS-1+pass && res==0;i++){
+			res=check_block(fd,bs,i,pass==0 && i%2==1);
+		}
+	}
+	if(res==0 && (ftruncate(fd,5*(off_t)bs)!=0 || fsync(fd)!=0)){
+		res=errno;
+		perror("ftruncate");
+	}
+	for(int i=0;i<5 && res==0;i++){
+		res=check_block(fd,bs,i,0);
+	}
+	if(res==0 && pread(fd,block,bs,5*(off_t)bs)!=0){
+		fprintf(stderr,"extents: data past the end after truncating\n");
+		res=EIO;
+	}
+	fill_block(block,bs,100);
+	if(res==0 && (pwrite(fd,block,bs,100*(off_t)bs)!=(ssize_t)bs || fsync(fd)!=0)){
+		res=errno;
+		perror("write");
+	}
+	for(int i=0;i<=100 && res==0;i++){
+		res=check_block(fd,bs,i,i>=5 && i<100);
+	}
+	close(fd);
+	unlink("mnt/ext");
+	return res;
+}
+
+//Wait for the reclaimer to free whatever the tests before have deleted, as the stats file tells
+int wait_orphans(){
+	static char stats[1<<16];
+	unsigned int left=1;
+	for(int tries=0;tries<6000 && left>0;tries++){
+		int res=read_stats(stats,sizeof(stats));
+		char *line=strstr(stats,"orphans ");
+		if(res!=0){
+			return res;
+		}
+		if(line==NULL || sscanf(line,"orphans %u",&left)!=1){
+			fprintf(stderr,"no orphans line in the stats\n");
+			return EIO;
+		}
+		if(left>0){
+			usleep(10000);
+		}
+	}
+	if(left>0){
+		fprintf(stderr,"%u orphans still not reclaimed\n",left);
+		return EIO;
+	}
+	return 0;
+}
+
+//The free list: the ids of deleted files are given to the files created next. More files than
+//the head of the list holds make it move to records of its own and back. Waits for the reclaimer
+//first, which would otherwise free ids of its own in between.
+#define FREE_FILES 40
+int test_free_ids(){
+	int res=0;
+	char name[64];
+	ino_t freed[FREE_FILES];
+	struct stat st;
+	if((res=wait_orphans())!=0){
+		return res;
+	}
+	if(mkdir("mnt/free", S_IRWXU)!=0){
+		res=errno;
+		perror("mkdir");
+		return res;
+	}
+	if((res=make_files("mnt/free","f",0,FREE_FILES))!=0){
+		return res;
+	}
+	for(int i=0;i<FREE_FILES && res==0;i++){
+		sprintf(name,"mnt/free/f%d",i);
+		if(stat(name,&st)!=0 || unlink(name)!=0){
+			res=errno;
+			perror(name);
+		}
+		freed[i]=st.st_ino;
+	}
+	if(res==0){
+		res=make_files("mnt/free","g",0,FREE_FILES);
+	}
+	for(int i=0;i<FREE_FILES && res==0;i++){
+		int found=0;
+		sprintf(name,"mnt/free/g%d",i);
+		if(stat(name,&st)!=0){
+			res=errno;
+			perror(name);
+		}
+		for(int j=0;j<FREE_FILES && !found;j++){
+			found=freed[j]==st.st_ino;
+		}
+		if(res==0 && !found){
+			fprintf(stderr,"free ids: g%d has inode %llu, not one of those freed\n",i,(unsigned long long)st.st_ino);
+			res=EIO;
+		}
+	}
+	for(int i=0;i<FREE_FILES;i++){
+		sprintf(name,"mnt/free/g%d",i);
+		unlink(name);
+	}
+	if(rmdir("mnt/free")!=0 && res==0){
+		res=errno;
+		perror("rmdir");
+	}
+	return res;
+}
+
+//Keys derived from the inode number, on a mount made with -o seqids: a file deleted and
+//reclaimed gives its number to the next file, which must not find any of the old blocks under the
+//keys it derives from it.
+#define OLD_BLOCKS 20
+int test_reused_keys(){
+	int res=0;
+	static char block[1<<16];
+	struct stat st;
+	int fd=open("mnt/old", O_RDWR|O_CREAT, S_IRWXU);
+	if(fd==-1){
+		res=errno;
+		perror("open");
+		return res;
+	}
+	fstat(fd,&st);
+	size_t bs=st.st_blksize;
+	for(int i=0;i<OLD_BLOCKS && res==0;i++){
+		fill_block(block,bs,i);
+		if(pwrite(fd,block,bs,i*(off_t)bs)!=(ssize_t)bs){
+			res=errno;
+			perror("write");
+		}
+	}
+	close(fd);
+	if(unlink("mnt/old")!=0 && res==0){
+		res=errno;
+		perror("unlink");
+	}
+	if(res==0){
+		res=wait_orphans();
+	}
+	if(res!=0){
+		return res;
+	}
+	fd=open("mnt/new", O_RDWR|O_CREAT, S_IRWXU);
+	if(fd==-1){
+		res=errno;
+		perror("open");
+		return res;
+	}
+	fill_block(block,bs,0);
+	if(pwrite(fd,block,bs,0)!=(ssize_t)bs){
+		res=errno;
+		perror("write");
+	}
+	fill_block(block,bs,300);
+	if(res==0 && pwrite(fd,block,bs,300*(off_t)bs)!=(ssize_t)bs){
+		res=errno;
+		perror("write");
+	}
+	for(int i=0;i<=300 && res==0;i++){
+		res=check_block(fd,bs,i,i!=0 && i!=300);
+	}
+	close(fd);
+	unlink("mnt/new");
+	return res;
+}
+
+//Inline data: a small file is kept in its fcb until it outgrows it. Appending past that, or
+//writing far past the end of a small file, moves the data to a block of its own, which has to
+//hold everything written before.
+#define INLINE_SMALL 100
+#define INLINE_BIG 1000
+int test_inline(){
+	int res=0;
+	char want[INLINE_BIG], got[INLINE_BIG];
+	for(int i=0;i<INLINE_BIG;i++){
+		want[i]='0'+i%61;
+	}
+	for(int far=0;far<2 && res==0;far++){
+		off_t at=far?(off_t)1<<20:INLINE_SMALL;
+		int fd=open("mnt/small", O_RDWR|O_CREAT|O_TRUNC, S_IRWXU);
+		if(fd==-1){
+			res=errno;
+			perror("open");
+			return res;
+		}
+		if(write(fd,want,INLINE_SMALL)!=INLINE_SMALL){
+			res=errno;
+			perror("write");
+		}
+		if(res==0 && (pread(fd,got,INLINE_BIG,0)!=INLINE_SMALL || memcmp(want,got,INLINE_SMALL)!=0)){
+			fprintf(stderr,"inline: small file reads back wrong\n");
+			res=EIO;
+		}
+		if(res==0 && pwrite(fd,want+INLINE_SMALL,INLINE_BIG-INLINE_SMALL,at)!=INLINE_BIG-INLINE_SMALL){
+			res=errno;
+			perror("write");
+		}
+		if(res==0 && fsync(fd)!=0){
+			res=errno;
+			perror("fsync");
+		}
+		if(res==0 && (pread(fd,got,INLINE_SMALL,0)!=INLINE_SMALL ||
+			pread(fd,got+INLINE_SMALL,INLINE_BIG-INLINE_SMALL,at)!=INLINE_BIG-INLINE_SMALL ||
+			pread(fd,got,1,at+INLINE_BIG-INLINE_SMALL)!=0 || memcmp(want,got,INLINE_BIG)!=0)){
+			fprintf(stderr,"inline: file grown %s reads back wrong\n",far?"far past its end":"by appending");
+			res=EIO;
+		}
+		for(off_t off=INLINE_SMALL;far && off<at && res==0;off+=sizeof(got)){
+			size_t n=at-off<(off_t)sizeof(got)?at-off:sizeof(got);
+			if(pread(fd,got,n,off)!=(ssize_t)n){
+				res=EIO;
+			}
+			for(size_t i=0;i<n && res==0;i++){
+				res=got[i]==0?0:EIO;
+			}
+			if(res!=0){
+				fprintf(stderr,"inline: hole at %lld does not read as zeros\n",(long long)off);
+			}
+		}
+		close(fd);
+	}
+	unlink("mnt/small");
+	return res;
+}
+
+//The fcbs of a few thousand new files have to spread over the buckets of the inode cache and the
+//stripes of the inode locks. Run on a mount made with -o seqids too, whose ids differ only in a
+//few bytes.
+#define SPREAD_FILES 3000
+int test_ids_spread(){
+	int res=0;
+	char name[64];
+	static char stats[1<<16];
+	if(mkdir("mnt/spread", S_IRWXU)!=0){
+		res=errno;
+		perror("mkdir");
+		return res;
+	}
+	for(int i=0;i<SPREAD_FILES && res==0;i++){
+		sprintf(name,"mnt/spread/f%d",i);
+		int fd=open(name, O_RDWR|O_CREAT, S_IRWXU);
+		if(fd==-1){
+			res=errno;
+			perror("open");
+		}else{
+			close(fd);
+		}
+	}
+	if(res==0 && (res=read_stats(stats,sizeof(stats)))==0){
+		int fcbs=0,used=0,buckets=0,longest=0,stripes=0,locks=0;
+		char *line=strstr(stats,"icache ");
+		if(line==NULL || sscanf(line,"icache fcbs %d buckets %d/%d longest %d stripes %d/%d",&fcbs,&used,&buckets,&longest,&stripes,&locks)!=6){
+			fprintf(stderr,"spread: no icache line in the stats\n");
+			res=EIO;
+		}else if(fcbs<SPREAD_FILES || used<buckets*3/4 || longest>4*(fcbs/buckets+1) || stripes<locks*15/16){
+			fprintf(stderr,"spread: %d fcbs in %d/%d buckets, longest chain %d, %d/%d lock stripes\n",fcbs,used,buckets,longest,stripes,locks);
+			res=EIO;
+		}
+	}
+	for(int i=0;i<SPREAD_FILES;i++){
+		sprintf(name,"mnt/spread/f%d",i);
+		unlink(name);
+	}
+	if(rmdir("mnt/spread")!=0 && res==0){
+		res=errno;
+		perror("rmdir");
+	}
+	return res;
+}
+
+//A listing goes on at a cookie which does not depend on where the entries sit in their bucket.
+//Unlinking what has been listed, as rm -rf does, must not make the listing pass over the entries
+//after it, and neither must the bucket splits of a directory growing under a listing.
+#define LIST_FILES 1000
+int test_readdir_unlink(){
+	int res=0;
+	static unsigned char seen[LIST_FILES];
+	char name[512];
+	struct dirent *de;
+	int i,listed=0;
+	if(mkdir("mnt/list", S_IRWXU)!=0){
+		res=errno;
+		perror("mkdir");
+		return res;
+	}
+	if((res=make_files("mnt/list","e",0,LIST_FILES))!=0){
+		return res;
+	}
+	//Unlink every entry as soon as it is listed
+	DIR *dir=opendir("mnt/list");
+	if(dir==NULL){
+		res=errno;
+		perror("opendir");
+		return res;
+	}
+	memset(seen,0,sizeof(seen));
+	while(res==0 && (de=readdir(dir))!=NULL){
+		if(sscanf(de->d_name,"e%d",&i)==1 && i>=0 && i<LIST_FILES){
+			seen[i]++;
+			sprintf(name,"mnt/list/%s",de->d_name);
+			if(unlink(name)!=0){
+				res=errno;
+				perror("unlink");
+			}
+		}
+	}
+	closedir(dir);
+	for(i=0;i<LIST_FILES && res==0;i++){
+		if(seen[i]!=1){
+			fprintf(stderr,"readdir: e%d listed %d times while unlinking\n",i,seen[i]);
+			res=EIO;
+		}
+	}
+	//Grow the directory, and so split its buckets, half way through a listing
+	if(res==0 && (res=make_files("mnt/list","e",0,LIST_FILES/5))==0 && (dir=opendir("mnt/list"))!=NULL){
+		memset(seen,0,sizeof(seen));
+		while(res==0 && (de=readdir(dir))!=NULL){
+			if(sscanf(de->d_name,"e%d",&i)==1 && i>=0 && i<LIST_FILES){
+				seen[i]++;
+			}
+			if(++listed==LIST_FILES/10){
+				res=make_files("mnt/list","n",0,LIST_FILES);
+			}
+		}
+		closedir(dir);
+		for(i=0;i<LIST_FILES/5 && res==0;i++){
+			if(seen[i]!=1){
+				fprintf(stderr,"readdir: e%d listed %d times while splitting\n",i,seen[i]);
+				res=EIO;
+			}
+		}
+		for(i=0;i<LIST_FILES;i++){
+			sprintf(name,"mnt/list/e%d",i);
+			unlink(name);
+			sprintf(name,"mnt/list/n%d",i);
+			unlink(name);
+		}
+	}
+	if(rmdir("mnt/list")!=0 && res==0){
+		res=errno;
+		perror("rmdir");
+	}
+	return res;
+}
+
+//Packed directory entries: names of every length up to NAME_MAX, files and directories, sit
+//next to each other in the buckets. Each has to be listed once under its own name with its own
+//type, and a longer name is refused. A name is its type, a letter repeated and its length.
+#define NAMES_DIR "mnt/names"
+void make_name(char *buf, int len){
+	sprintf(buf,"%s/",NAMES_DIR);
+	buf+=strlen(buf);
+	memset(buf,'a'+len%26,len);
+	buf[0]=len%2?'f':'d';
+	sprintf(buf+len-3,"%03d",len);
+}
+int test_names(){
+	int res=0;
+	char name[512];
+	static unsigned char seen[NAME_MAX+1];
+	struct dirent *de;
+	if(mkdir(NAMES_DIR, S_IRWXU)!=0){
+		res=errno;
+		perror("mkdir");
+		return res;
+	}
+	for(int len=4;len<=NAME_MAX && res==0;len++){
+		make_name(name,len);
+		int fd=len%2?open(name, O_RDWR|O_CREAT, S_IRWXU):mkdir(name, S_IRWXU);
+		if(fd==-1){
+			res=errno;
+			perror(name);
+		}else if(len%2){
+			close(fd);
+		}
+	}
+	make_name(name,NAME_MAX+1);
+	if(res==0 && (open(name, O_RDWR|O_CREAT, S_IRWXU)!=-1 || errno!=ENAMETOOLONG)){
+		fprintf(stderr,"names: a name of %d bytes was not refused\n",NAME_MAX+1);
+		res=EIO;
+	}
+	DIR *dir=opendir(NAMES_DIR);
+	if(dir==NULL){
+		res=errno;
+		perror(NAMES_DIR);
+	}
+	while(res==0 && (de=readdir(dir))!=NULL){
+		int len=strlen(de->d_name);
+		if(strcmp(de->d_name,".")==0 || strcmp(de->d_name,"..")==0){
+			continue;
+		}
+		make_name(name,len);
+		if(len<4 || len>NAME_MAX || strcmp(name+strlen(NAMES_DIR)+1,de->d_name)!=0){
+			fprintf(stderr,"names: unexpected entry %s\n",de->d_name);
+			res=EIO;
+		}else if(de->d_type!=(len%2?DT_REG:DT_DIR)){
+			fprintf(stderr,"names: entry of %d bytes has type %d\n",len,de->d_type);
+			res=EIO;
+		}else{
+			seen[len]++;
+		}
+	}
+	if(dir!=NULL){
+		closedir(dir);
+	}
+	for(int len=4;len<=NAME_MAX && res==0;len++){
+		if(seen[len]!=1){
+			fprintf(stderr,"names: entry of %d bytes listed %d times\n",len,seen[len]);
+			res=EIO;
+		}
+	}
+	for(int len=4;len<=NAME_MAX;len++){
+		make_name(name,len);
+		if(len%2){
+			unlink(name);
+		}else{
+			rmdir(name);
+		}
+	}
+	if(rmdir(NAMES_DIR)!=0 && res==0){
+		res=errno;
+		perror("rmdir");
+	}
+	return res;
+}
+
+//Orphans: a file unlinked while it is open is gone from its directory at once, but keeps its data
+//for the handle until that is closed, and is reclaimed after that.
+#define ORPHAN_BLOCKS 8
+int test_orphan(){
+	int res=0;
+	static char block[1<<16];
+	struct stat st;
+	struct dirent *de;
+	if(mkdir("mnt/orphan", S_IRWXU)!=0){
+		res=errno;
+		perror("mkdir");
+		return res;
+	}
+	int fd=open("mnt/orphan/f", O_RDWR|O_CREAT, S_IRWXU);
+	if(fd==-1){
+		res=errno;
+		perror("open");
+		return res;
+	}
+	fstat(fd,&st);
+	size_t bs=st.st_blksize;
+	for(int i=0;i<ORPHAN_BLOCKS/2 && res==0;i++){
+		fill_block(block,bs,i);
+		if(pwrite(fd,block,bs,i*(off_t)bs)!=(ssize_t)bs){
+			res=errno;
+			perror("write");
+		}
+	}
+	if(res==0 && unlink("mnt/orphan/f")!=0){
+		res=errno;
+		perror("unlink");
+	}
+	if(res==0 && (stat("mnt/orphan/f",&st)==0 || errno!=ENOENT)){
+		fprintf(stderr,"orphan: still found after unlinking\n");
+		res=EIO;
+	}
+	for(int i=ORPHAN_BLOCKS/2;i<ORPHAN_BLOCKS && res==0;i++){
+		fill_block(block,bs,i);
+		if(pwrite(fd,block,bs,i*(off_t)bs)!=(ssize_t)bs){
+			res=errno;
+			perror("write");
+		}
+	}
+	for(int i=0;i<ORPHAN_BLOCKS && res==0;i++){
+		res=check_block(fd,bs,i,0);
+	}
+	if(res==0 && (fstat(fd,&st)!=0 || st.st_size!=ORPHAN_BLOCKS*(off_t)bs)){
+		fprintf(stderr,"orphan: size %lld through the handle\n",(long long)st.st_size);
+		res=EIO;
+	}
+	close(fd);
+	if(res==0){
+		res=wait_orphans();
+	}
+	DIR *dir=opendir("mnt/orphan");
+	while(res==0 && dir!=NULL && (de=readdir(dir))!=NULL){
+		if(strcmp(de->d_name,".")!=0 && strcmp(de->d_name,"..")!=0){
+			fprintf(stderr,"orphan: %s left in the directory\n",de->d_name);
+			res=EIO;
+		}
+	}
+	if(dir!=NULL){
+		closedir(dir);
+	}
+	if(rmdir("mnt/orphan")!=0 && res==0){
+		res=errno;
+		perror("rmdir");
+	}
+	return res;
+}
+
+//Read a whole file and compare it with want, size bytes
+int check_file(int fd, const char *want, off_t size, const char *what){
+	static char got[8<<16];
+	struct stat st;
+	if(fstat(fd,&st)!=0 || st.st_size!=size || pread(fd,got,sizeof(got),0)!=size || memcmp(want,got,size)!=0){
+		fprintf(stderr,"%s: file reads back wrong, size %lld\n",what,(long long)st.st_size);
+		return EIO;
+	}
+	return 0;
+}
+
+//fallocate: reserving blocks past the end grows the file with zeros unless FALLOC_FL_KEEP_SIZE
+//is given, a write into them reads back, and punching a hole zeroes exactly the bytes asked for,
+//parts of blocks too, and leaves the size alone.
+int test_fallocate(){
+	int res=0;
+	static char want[8<<16];
+	struct stat st;
+	int fd=open("mnt/falloc", O_RDWR|O_CREAT, S_IRWXU);
+	if(fd==-1){
+		res=errno;
+		perror("open");
+		return res;
+	}
+	fstat(fd,&st);
+	size_t bs=st.st_blksize;
+	memset(want,0,sizeof(want));
+	fill_block(want,bs,0);
+	if(pwrite(fd,want,bs,0)!=(ssize_t)bs || fallocate(fd,0,bs,4*bs)!=0){
+		res=errno;
+		perror("fallocate");
+	}
+	if(res==0){
+		res=check_file(fd,want,5*bs,"reserve");
+	}
+	if(res==0 && fallocate(fd,FALLOC_FL_KEEP_SIZE,5*bs,3*bs)!=0){
+		res=errno;
+		perror("fallocate");
+	}
+	if(res==0){
+		res=check_file(fd,want,5*bs,"reserve keeping the size");
+	}
+	for(int i=2;i<5 && res==0;i++){
+		fill_block(want+i*bs,bs,i);
+		if(pwrite(fd,want+i*bs,bs,i*bs)!=(ssize_t)bs){
+			res=errno;
+			perror("write");
+		}
+	}
+	if(res==0){
+		res=check_file(fd,want,5*bs,"write into reserved blocks");
+	}
+	if(res==0 && fallocate(fd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,bs/2,3*bs+100-bs/2)!=0){
+		res=errno;
+		perror("fallocate");
+	}
+	memset(want+bs/2,0,3*bs+100-bs/2);
+	if(res==0){
+		res=check_file(fd,want,5*bs,"punch");
+	}
+	if(res==0 && (fallocate(fd,FALLOC_FL_PUNCH_HOLE,0,bs)!=-1 || errno!=EOPNOTSUPP)){
+		fprintf(stderr,"fallocate: punching a hole without FALLOC_FL_KEEP_SIZE was not refused\n");
+		res=EIO;
+	}
+	close(fd);
+	unlink("mnt/falloc");
+	return res;
+}
+
+//Where SEEK_DATA or SEEK_HOLE from off lands, through the ioctl of myfs, or -errno
+off_t seek_ioctl(int fd, int data, off_t off){
+	if(ioctl(fd,data?MYFS_IOC_SEEK_DATA:MYFS_IOC_SEEK_HOLE,&off)!=0){
+		return -errno;
+	}
+	return off;
+}
+
+//SEEK_DATA and SEEK_HOLE over data, a hole, blocks reserved by fallocate, which hold no data
+//yet, and a punched block, both while the blocks are still buffered and once they are stored.
+//Past the last byte there is nothing to find.
+int test_seek(){
+	int res=0;
+	static char block[1<<16];
+	struct stat st;
+	int fd=open("mnt/seek", O_RDWR|O_CREAT, S_IRWXU);
+	if(fd==-1){
+		res=errno;
+		perror("open");
+		return res;
+	}
+	fstat(fd,&st);
+	off_t bs=st.st_blksize;
+	//block 0 data, 1-2 hole, 3-4 reserved, 5-7 data, 8 punched, 9 data
+	off_t want[][3]={
+		{1,0,0},{0,0,bs},{1,bs,5*bs},{1,3*bs+10,5*bs},{0,3*bs+10,3*bs+10},{1,5*bs+10,5*bs+10},
+		{0,5*bs,8*bs},{1,8*bs,9*bs},{0,9*bs,10*bs},{1,10*bs,-ENXIO},{0,10*bs,-ENXIO},
+	};
+	for(int i=0;i<10 && res==0;i++){
+		fill_block(block,bs,i);
+		if(i!=1 && i!=2 && i!=3 && i!=4 && pwrite(fd,block,bs,i*bs)!=bs){
+			res=errno;
+			perror("write");
+		}
+	}
+	if(res==0 && (fallocate(fd,FALLOC_FL_KEEP_SIZE,3*bs,2*bs)!=0 ||
+		fallocate(fd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,8*bs,bs)!=0)){
+		res=errno;
+		perror("fallocate");
+	}
+	for(int stored=0;stored<2 && res==0;stored++){
+		if(stored && fsync(fd)!=0){
+			res=errno;
+			perror("fsync");
+		}
+		for(int i=0;i<sizeof(want)/sizeof(want[0]) && res==0;i++){
+			off_t got=seek_ioctl(fd,want[i][0],want[i][1]);
+			if(got!=want[i][2]){
+				fprintf(stderr,"seek: %s from %lld gave %lld, not %lld%s\n",want[i][0]?"data":"hole",
+					(long long)want[i][1],(long long)got,(long long)want[i][2],stored?" once stored":"");
+				res=EIO;
+			}
+		}
+	}
+	close(fd);
+	unlink("mnt/seek");
+	return res;
+}
+
+//st_blocks counts the blocks a file has data stored in, in 512-byte units of st_blksize blocks:
+//a block written far past the others leaves a hole which takes no room, and punching a block
+//out gives its room back.
+int test_st_blocks(){
+	int res=0;
+	static char block[1<<16];
+	struct stat st;
+	int fd=open("mnt/sparse", O_RDWR|O_CREAT, S_IRWXU);
+	if(fd==-1){
+		res=errno;
+		perror("open");
+		return res;
+	}
+	if(fstat(fd,&st)!=0 || st.st_blksize<512 || st.st_blksize>(blksize_t)sizeof(block)){
+		res=errno?errno:EIO;
+		fprintf(stderr,"st_blocks: st_blksize %ld\n",(long)st.st_blksize);
+	}
+	blksize_t bs=st.st_blksize;
+	memset(block,'s',sizeof(block));
+	if(res==0 && (pwrite(fd,block,bs,0)!=bs || pwrite(fd,block,bs,1000*(off_t)bs)!=bs || fsync(fd)!=0)){
+		res=errno;
+		perror("write");
+	}
+	if(res==0 && (fstat(fd,&st)!=0 || st.st_size!=1001*(off_t)bs || st.st_blocks!=2*bs/512)){
+		fprintf(stderr,"st_blocks: %lld blocks after writing 2 of %ld bytes\n",(long long)st.st_blocks,(long)bs);
+		res=EIO;
+	}
+	if(res==0 && (fallocate(fd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,0,bs)!=0 || fsync(fd)!=0)){
+		res=errno;
+		perror("fallocate");
+	}
+	if(res==0 && (fstat(fd,&st)!=0 || st.st_blocks!=bs/512)){
+		fprintf(stderr,"st_blocks: %lld blocks after punching one of 2\n",(long long)st.st_blocks);
+		res=EIO;
+	}
+	close(fd);
+	unlink("mnt/sparse");
+	return res;
+}
+
+//Hard links and rename: a link is the same file under a second name and counts in its nlink; a
+//rename over a file replaces it, over an empty directory replaces that, and is refused over a
+//directory which is not empty or between a file and a directory. A directory's nlink is 2 and
+//one for each directory in it.
+int check_nlink(const char *path, nlink_t nlink, ino_t ino){
+	struct stat st;
+	if(stat(path,&st)!=0 || st.st_nlink!=nlink || (ino!=0 && st.st_ino!=ino)){
+		fprintf(stderr,"links: %s has nlink %lu, inode %llu, not %lu, %llu\n",path,(unsigned long)st.st_nlink,
+			(unsigned long long)st.st_ino,(unsigned long)nlink,(unsigned long long)ino);
+		return EIO;
+	}
+	return 0;
+}
+int write_file(const char *path, const char *text){
+	int res=0;
+	int fd=open(path, O_RDWR|O_CREAT|O_TRUNC, S_IRWXU);
+	if(fd==-1 || write(fd,text,strlen(text))!=(ssize_t)strlen(text)){
+		res=errno;
+		perror(path);
+	}
+	if(fd!=-1){
+		close(fd);
+	}
+	return res;
+}
+int test_links(){
+	int res=0;
+	char buf[16]={0};
+	struct stat st;
+	if(mkdir("mnt/links", S_IRWXU)!=0){
+		res=errno;
+		perror("mkdir");
+		return res;
+	}
+	if((res=write_file("mnt/links/a","aaaa"))!=0 || (res=write_file("mnt/links/c","cccc"))!=0){
+		return res;
+	}
+	stat("mnt/links/a",&st);
+	ino_t ino=st.st_ino;
+	if(link("mnt/links/a","mnt/links/b")!=0){
+		res=errno;
+		perror("link");
+	}
+	if(res==0 && (res=check_nlink("mnt/links/a",2,ino))==0 && (res=check_nlink("mnt/links/b",2,ino))==0 &&
+		unlink("mnt/links/a")!=0){
+		res=errno;
+		perror("unlink");
+	}
+	if(res==0 && (res=check_nlink("mnt/links/b",1,ino))==0 && rename("mnt/links/b","mnt/links/c")!=0){
+		res=errno;
+		perror("rename");
+	}
+	int fd=open("mnt/links/c", O_RDONLY);
+	if(res==0 && (fd==-1 || read(fd,buf,sizeof(buf))!=4 || strcmp(buf,"aaaa")!=0 ||
+		stat("mnt/links/b",&st)==0 || check_nlink("mnt/links/c",1,ino)!=0)){
+		fprintf(stderr,"links: rename over a file did not replace it\n");
+		res=EIO;
+	}
+	if(fd!=-1){
+		close(fd);
+	}
+	if(res==0 && (mkdir("mnt/links/d1", S_IRWXU)!=0 || mkdir("mnt/links/d1/sub", S_IRWXU)!=0 ||
+		mkdir("mnt/links/d2", S_IRWXU)!=0 || mkdir("mnt/links/d3", S_IRWXU)!=0)){
+		res=errno;
+		perror("mkdir");
+	}
+	if(res==0 && (res=check_nlink("mnt/links",5,0))==0 && (res=check_nlink("mnt/links/d1",3,0))==0 &&
+		rename("mnt/links/d1","mnt/links/d2")!=0){
+		res=errno;
+		perror("rename");
+	}
+	if(res==0 && (stat("mnt/links/d1",&st)==0 || stat("mnt/links/d2/sub",&st)!=0)){
+		fprintf(stderr,"links: rename over an empty directory did not replace it\n");
+		res=EIO;
+	}
+	if(res==0 && (res=check_nlink("mnt/links",4,0))==0 && (rename("mnt/links/d3","mnt/links/d2")!=-1 || errno!=ENOTEMPTY)){
+		fprintf(stderr,"links: rename over a directory which is not empty was not refused\n");
+		res=EIO;
+	}
+	if(res==0 && (rename("mnt/links/c","mnt/links/d3")!=-1 || errno!=EISDIR)){
+		fprintf(stderr,"links: rename of a file over a directory was not refused\n");
+		res=EIO;
+	}
+	if(res==0 && (rename("mnt/links/d3","mnt/links/c")!=-1 || errno!=ENOTDIR)){
+		fprintf(stderr,"links: rename of a directory over a file was not refused\n");
+		res=EIO;
+	}
+	unlink("mnt/links/c");
+	rmdir("mnt/links/d1/sub");
+	rmdir("mnt/links/d1");
+	rmdir("mnt/links/d2/sub");
+	rmdir("mnt/links/d2");
+	rmdir("mnt/links/d3");
+	if(rmdir("mnt/links")!=0 && res==0){
+		res=errno;
+		perror("rmdir");
+	}
+	return res;
+}
 
 int main(int argc, char** argv){
 	int res=0;
@@ -26,5 +1049,47 @@ int main(int argc, char** argv){
 		res=errno;
 		perror("open");
 	}
+	if(res==0){
+		res=test_big_dir();
+	}
+	if(res==0){
+		res=test_block_map();
+	}
+	if(res==0){
+		res=test_extents();
+	}
+	if(res==0){
+		res=test_free_ids();
+	}
+	if(res==0){
+		res=test_ids_spread();
+	}
+	if(res==0){
+		res=test_reused_keys();
+	}
+	if(res==0){
+		res=test_inline();
+	}
+	if(res==0){
+		res=test_names();
+	}
+	if(res==0){
+		res=test_readdir_unlink();
+	}
+	if(res==0){
+		res=test_orphan();
+	}
+	if(res==0){
+		res=test_fallocate();
+	}
+	if(res==0){
+		res=test_st_blocks();
+	}
+	if(res==0){
+		res=test_seek();
+	}
+	if(res==0){
+		res=test_links();
+	}
 	return res;
 }
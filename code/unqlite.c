@@ -49785,8 +49785,9 @@ static int lhPageDefragment(lhpage *pPage)
 	lhcell *pCell;
 	/* Get a temporary page from the pager. This opertaion never fail */
 	zTmp = pEngine->pIo->xTmpPage(pEngine->pIo->pHandle);
-	/* Move the target cells to the begining */
-	pCell = pPage->pList;
+	/* Move the target cells to the begining. Cells are installed on the master
+	 * page list, so walk that list even when defragmenting a slave page. */
+	pCell = pPage->pMaster->pList;
 	/* Write the slave page number */
 	SyBigEndianPack64(&zTmp[2/*Offset of the first cell */+2/*Offset of the first free block */],pPage->sHdr.iSlave);
 	zPtr = &zTmp[L_HASH_PAGE_HDR_SZ]; /* Offset to start writing from */
@@ -51237,7 +51238,22 @@ static void lhash_page_release(void *pUserData)
 	lhash_kv_engine *pEngine = pPage->pHash;
 	lhcell *pNext,*pCell = pPage->pList;
 	unqlite_page *pRaw = pPage->pRaw;
+	lhpage *pSlave,*pNextSlave;
 	sxu32 n;
+	if( pPage->pMaster == pPage ){
+		/* The cells of the slave pages live on this (master) page and are dropped
+		 * below. Slave pages may still be held by the pager, so detach them too:
+		 * otherwise a reload of this page would reuse their stale instances,
+		 * pointing to this freed master, and never reload their cells.
+		 */
+		pSlave = pPage->pSlave;
+		for( n = 0 ; n < pPage->iSlave && pSlave ; ++n ){
+			pNextSlave = pSlave->pNextSlave;
+			pSlave->pRaw->pUserData = 0;
+			SyMemBackendPoolFree(&pEngine->sAllocator,pSlave);
+			pSlave = pNextSlave;
+		}
+	}
 	/* Drop in-memory cells */
 	for( n = 0 ; n < pPage->nCell ; ++n ){
 		pNext = pCell->pNext;
@@ -57055,6 +57071,15 @@ static int pager_write_hot_dirty_pages(Pager *pPager,Page *pDirty)
 		}
 		/* Point to the next page */
 		pNext = pDirty->pPrevHot; /* Not a bug: Reverse link */
+		if( pDirty->nRef > 0 ){
+			/* Referenced again since it was made hot. Its user may still be changing it,
+			 * so it can neither be released nor marked clean; leave it on the dirty list
+			 * for the final commit.
+			 */
+			pDirty->flags &= ~PAGE_HOT_DIRTY;
+			pDirty = pNext;
+			continue;
+		}
 		if( (pDirty->flags & PAGE_DONT_WRITE) == 0 ){
 			rc = unqliteOsWrite(pPager->pfd,pDirty->zData,pPager->iPageSize,pDirty->pgno * pPager->iPageSize);
 			if( rc != UNQLITE_OK ){